@@ -3,6 +3,8 @@ project "Renderer"
 	language "C++"
 	cppdialect "C++14"
 	staticruntime "on"
+	-- packet fragment shading uses 8-wide AVX2 registers (see src/Simd.h)
+	vectorextensions "AVX2"
 
 	targetdir ("../bin/" .. outputdir .. "/%{prj.name}")
 	objdir ("../bin-int/" .. outputdir .. "/%{prj.name}")
@@ -0,0 +1,48 @@
+#include "AllocationCounter.h"
+
+#ifdef COUNT_HEAP_ALLOCATIONS
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<size_t> HeapAllocations(0);
+
+// the array and nothrow versions call this one
+void* operator new(size_t bytes)
+{
+	HeapAllocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = std::malloc(bytes ? bytes : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	std::free(p);
+}
+
+bool heapAllocationsCounted()
+{
+	return true;
+}
+
+size_t heapAllocationCount()
+{
+	return HeapAllocations.load(std::memory_order_relaxed);
+}
+#else
+bool heapAllocationsCounted()
+{
+	return false;
+}
+
+size_t heapAllocationCount()
+{
+	return 0;
+}
+#endif
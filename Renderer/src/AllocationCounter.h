@@ -0,0 +1,12 @@
+#pragma once
+#include <cstddef>
+
+// counts the heap allocations of the program, to check that the frames of a sequence allocate nothing once they are
+// warm (see FrameArena.h). Counting replaces the global operator new, so it is only built in when COUNT_HEAP_ALLOCATIONS
+// is defined (e.g. added to the defines of premake5.lua)
+
+// true when the program is built with COUNT_HEAP_ALLOCATIONS
+bool heapAllocationsCounted();
+// calls of operator new, by any thread, since the program started (0 when they are not counted): the difference over
+// a frame tells how much it allocated outside of its arena
+size_t heapAllocationCount();
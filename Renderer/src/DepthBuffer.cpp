@@ -0,0 +1,95 @@
+#include "DepthBuffer.h"
+
+#include <limits>
+
+DepthBuffer::DepthBuffer(int w, int h, Format format)
+	: w(w), h(h), stride((w + TILE_SIZE - 1) / TILE_SIZE * TILE_SIZE), fmt(format),
+	  unormMax(format == UNORM16 ? 65535.f : 16777215.f),
+	  tilesX((w + TILE_SIZE - 1) / TILE_SIZE), tilesY((h + TILE_SIZE - 1) / TILE_SIZE),
+	  tileFlags(tilesX * tilesY), tileFar(tilesX * tilesY)
+{
+	// whole tiles are allocated so that preparing the last row/column of tiles stays inside the buffer
+	size_t n = static_cast<size_t>(stride) * tilesY * TILE_SIZE;
+	switch (fmt)
+	{
+	case UNORM24:
+		depth24 = AlignedBuffer<std::uint32_t>(n);
+		break;
+	case UNORM16:
+		depth16 = AlignedBuffer<std::uint16_t>(n);
+		break;
+	default:
+		depth = AlignedBuffer<float>(n);
+	}
+	clear();
+}
+
+float DepthBuffer::clearKey() const
+{
+	switch (fmt)
+	{
+	case REVERSED_Z:
+		// 1/w = 0: infinitely far
+		return 0.f;
+	case UNORM24:
+	case UNORM16:
+		return unormMax;
+	default:
+		return std::numeric_limits<float>::max();
+	}
+}
+
+void DepthBuffer::clear()
+{
+	std::fill(tileFlags.begin(), tileFlags.end(), CLEARED);
+	std::fill(tileFar.begin(), tileFar.end(), clearKey());
+	prepared = 0;
+}
+
+void DepthBuffer::clearTile(int tx, int ty)
+{
+	tileFlags[ty * tilesX + tx] = CLEARED;
+	tileFar[ty * tilesX + tx] = clearKey();
+}
+
+void DepthBuffer::prepare(int x0, int x1, int y0, int y1)
+{
+	for (int ty = y0 / TILE_SIZE; ty <= y1 / TILE_SIZE; ty++)
+	{
+		for (int tx = x0 / TILE_SIZE; tx <= x1 / TILE_SIZE; tx++)
+		{
+			std::uint8_t& flags = tileFlags[ty * tilesX + tx];
+			if (flags & CLEARED)
+			{
+				// fill the rows of the tile with the far plane in the storage format
+				vfloat far = clearKey();
+				for (int y = ty * TILE_SIZE; y < (ty + 1) * TILE_SIZE; y++)
+					for (int x = tx * TILE_SIZE; x < (tx + 1) * TILE_SIZE; x += SIMD_WIDTH)
+						store(x, y, far);
+				prepared++;
+			}
+			flags = STALE;
+		}
+	}
+}
+
+float DepthBuffer::farthest(int tx, int ty)
+{
+	std::uint8_t& flags = tileFlags[ty * tilesX + tx];
+	if (flags == STALE)
+	{
+		// only the pixels inside the screen count (the padding is never written)
+		int x1 = std::min(w, (tx + 1) * TILE_SIZE), y1 = std::min(h, (ty + 1) * TILE_SIZE);
+		vfloat far = -std::numeric_limits<float>::max();
+		for (int y = ty * TILE_SIZE; y < y1; y++)
+		{
+			for (int x = tx * TILE_SIZE; x < x1; x += SIMD_WIDTH)
+				far = max(far, select(vfloat::ramp(static_cast<float>(x)) < static_cast<float>(x1), load(x, y), far));
+		}
+		alignas(32) float lanes[SIMD_WIDTH];
+		far.store(lanes);
+		tileFar[ty * tilesX + tx] = *std::max_element(lanes, lanes + SIMD_WIDTH);
+		flags = 0;
+	}
+	return tileFar[ty * tilesX + tx];
+}
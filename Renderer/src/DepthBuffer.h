@@ -0,0 +1,183 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "Framebuffer.h"
+#include "Simd.h"
+
+// depth attachment with per-tile metadata and a choice of storage formats:
+// - FLOAT32: NDC depth as a float (default)
+// - REVERSED_Z: 1/w as a float, greater is closer: float precision follows the distance instead of
+//   being wasted close to the camera (the near plane maps to the largest values, the horizon to 0)
+// - UNORM24: NDC depth quantized to 24 bits (stored in 32 bits, the top byte is free for a stencil)
+// - UNORM16: NDC depth quantized to 16 bits: half the memory and bandwidth of the other formats
+// The rasterizer does not deal with the formats: it compares depth keys (see key()), where smaller is closer
+// for every format. UNORM formats clamp depths outside of [near, far].
+// The screen is split into TILE_SIZE x TILE_SIZE tiles that keep
+// - a clear flag: clear() only flags the tiles, the pixels of a tile are reset when it is first prepared
+// - the farthest key of the tile, to reject the parts of a triangle behind all its pixels without reading them
+// Same row layout as Framebuffer (the pitch is a multiple of TILE_SIZE pixels).
+class DepthBuffer
+{
+public:
+	enum Format
+	{
+		FLOAT32,
+		REVERSED_Z,
+		UNORM24,
+		UNORM16
+	};
+
+	static constexpr int TILE_SIZE = 16;
+
+	DepthBuffer(int w, int h, Format format = FLOAT32);
+
+	int width() const { return w; }
+	int height() const { return h; }
+	int pitch() const { return stride; }
+	Format format() const { return fmt; }
+	// REVERSED_Z keys are computed from 1/w (gl_FragCoord.w) instead of the NDC depth (gl_FragCoord.z)
+	bool reversed() const { return fmt == REVERSED_Z; }
+	// storage size of one pixel
+	int bytespp() const { return fmt == UNORM16 ? 2 : 4; }
+
+	// raw rows of the FLOAT32 format (the rows of a cleared tile are only valid once it has been prepared)
+	float* row(int y) { return depth.data() + y * stride; }
+	const float* row(int y) const { return depth.data() + y * stride; }
+
+	// depth key of an NDC depth (1/w for REVERSED_Z), smaller keys are closer
+	float key(float v) const
+	{
+		switch (fmt)
+		{
+		case REVERSED_Z:
+			return -v;
+		case UNORM24:
+		case UNORM16:
+			// round to the nearest representable depth
+			return std::floor(std::min(std::max(v * 0.5f + 0.5f, 0.f), 1.f) * unormMax + 0.5f);
+		default:
+			return v;
+		}
+	}
+	vfloat key(const vfloat& v) const
+	{
+		switch (fmt)
+		{
+		case REVERSED_Z:
+			return -v;
+		case UNORM24:
+		case UNORM16:
+			return floor(clamp(v * 0.5f + 0.5f, 0.f, 1.f) * unormMax + 0.5f);
+		default:
+			return v;
+		}
+	}
+
+	// key of a pixel (its tile must have been prepared)
+	float get(int x, int y) const
+	{
+		switch (fmt)
+		{
+		case REVERSED_Z:
+			return -depth[y * stride + x];
+		case UNORM24:
+			return static_cast<float>(depth24[y * stride + x]);
+		case UNORM16:
+			return static_cast<float>(depth16[y * stride + x]);
+		default:
+			return depth[y * stride + x];
+		}
+	}
+	void set(int x, int y, float k)
+	{
+		switch (fmt)
+		{
+		case REVERSED_Z:
+			depth[y * stride + x] = -k;
+			break;
+		case UNORM24:
+			depth24[y * stride + x] = static_cast<std::uint32_t>(k);
+			break;
+		case UNORM16:
+			depth16[y * stride + x] = static_cast<std::uint16_t>(k);
+			break;
+		default:
+			depth[y * stride + x] = k;
+		}
+	}
+
+	// keys of SIMD_WIDTH pixels starting at x (a multiple of SIMD_WIDTH)
+	vfloat load(int x, int y) const
+	{
+		switch (fmt)
+		{
+		case REVERSED_Z:
+			return -vfloat::load(depth.data() + y * stride + x);
+		case UNORM24:
+			return toFloat(vint::load(depth24.data() + y * stride + x));
+		case UNORM16:
+			return toFloat(vint::load(depth16.data() + y * stride + x));
+		default:
+			return vfloat::load(depth.data() + y * stride + x);
+		}
+	}
+	void store(int x, int y, const vfloat& k)
+	{
+		switch (fmt)
+		{
+		case REVERSED_Z:
+			(-k).store(depth.data() + y * stride + x);
+			break;
+		case UNORM24:
+			toInt(k).store(depth24.data() + y * stride + x);
+			break;
+		case UNORM16:
+			toInt(k).store(depth16.data() + y * stride + x);
+			break;
+		default:
+			k.store(depth.data() + y * stride + x);
+		}
+	}
+
+	// fast clear: resets the tile metadata only
+	void clear();
+	// fast clear of a single tile
+	void clearTile(int tx, int ty);
+	// resets the pixels of the tiles overlapping [x0, x1] x [y0, y1] if they have been cleared
+	// and marks their farthest key as out of date: call it before reading or writing pixels
+	void prepare(int x0, int x1, int y0, int y1);
+	// farthest key of a tile, recomputed if its pixels may have changed since the last call
+	float farthest(int tx, int ty);
+
+	// number of tiles whose pixels have been reset since the last clear() (the others were never touched)
+	int preparedTiles() const { return prepared; }
+
+private:
+	enum TileFlags : std::uint8_t
+	{
+		CLEARED = 1, // the pixels of the tile still hold the previous frame
+		STALE = 2, // pixels were written since the farthest key was computed
+	};
+
+	// key of the far plane
+	float clearKey() const;
+
+	int w;
+	int h;
+	int stride;
+	Format fmt;
+	float unormMax;
+	// only the storage of the format is allocated
+	AlignedBuffer<float> depth;
+	AlignedBuffer<std::uint32_t> depth24;
+	AlignedBuffer<std::uint16_t> depth16;
+
+	int tilesX;
+	int tilesY;
+	std::vector<std::uint8_t> tileFlags;
+	std::vector<float> tileFar;
+	int prepared = 0;
+};
@@ -0,0 +1,70 @@
+#include "Diagnostics.h"
+
+#include <algorithm>
+#include <iostream>
+
+RasterDiagnostics::RasterDiagnostics(int w, int h)
+	: width(w), height(h),
+	  tilesX((w + TILE_SIZE - 1) / TILE_SIZE), tilesY((h + TILE_SIZE - 1) / TILE_SIZE),
+	  depthTests(w * h, 0), shadeCount(w * h, 0), tileTime(tilesX * tilesY, 0.0)
+{
+}
+
+void RasterDiagnostics::clear()
+{
+	std::fill(depthTests.begin(), depthTests.end(), 0);
+	std::fill(shadeCount.begin(), shadeCount.end(), 0);
+	std::fill(tileTime.begin(), tileTime.end(), 0.0);
+}
+
+TGAColor RasterDiagnostics::heat(float t)
+{
+	// piecewise linear ramp through 6 key colors
+	static const float keys[6][3] = {
+		{0.f, 0.f, 0.f}, // nothing
+		{0.f, 0.f, 1.f}, // blue
+		{0.f, 1.f, 0.f}, // green
+		{1.f, 1.f, 0.f}, // yellow
+		{1.f, 0.f, 0.f}, // red
+		{1.f, 1.f, 1.f}, // white (hottest)
+	};
+	t = std::min(std::max(t, 0.f), 1.f) * 5.f;
+	int i = std::min(static_cast<int>(t), 4);
+	float f = t - i;
+	std::uint8_t rgb[3];
+	for (int c = 0; c < 3; c++)
+		rgb[c] = static_cast<std::uint8_t>(255.f * (keys[i][c] * (1.f - f) + keys[i + 1][c] * f));
+	return TGAColor(rgb[0], rgb[1], rgb[2]);
+}
+
+// normalize a per-pixel counter by its maximum and write it out through the color ramp
+template <typename T>
+static bool writeCounter(const std::vector<T>& values, int w, int h, const std::string& filename)
+{
+	T maxValue = *std::max_element(values.begin(), values.end());
+	TGAImage image(w, h, TGAImage::RGB);
+	for (int y = 0; y < h; y++)
+	{
+		for (int x = 0; x < w; x++)
+		{
+			float t = maxValue > 0 ? static_cast<float>(values[y * w + x]) / maxValue : 0.f;
+			image.set(x, y, RasterDiagnostics::heat(t));
+		}
+	}
+	std::cout << filename << ": max " << maxValue << std::endl;
+	return image.write_tga_file(filename, false);
+}
+
+bool RasterDiagnostics::write_heatmaps(const std::string& prefix) const
+{
+	// expand the per-tile timings to a per-pixel image so all 3 heatmaps have the framebuffer size
+	std::vector<double> tilePixels(width * height);
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+			tilePixels[y * width + x] = tileTime[(y / TILE_SIZE) * tilesX + x / TILE_SIZE];
+
+	bool ok = writeCounter(depthTests, width, height, prefix + "_depth.tga");
+	ok = writeCounter(shadeCount, width, height, prefix + "_overdraw.tga") && ok;
+	ok = writeCounter(tilePixels, width, height, prefix + "_tiletime.tga") && ok;
+	return ok;
+}
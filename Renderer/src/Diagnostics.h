@@ -0,0 +1,39 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "tgaimage.h"
+
+// RasterDiagnostics collects per-pixel and per-tile work counters while triangle() rasterizes.
+// It is only filled when it has been installed with setDiagnostics() (see tinyOpenGL.h),
+// so the normal draw path pays nothing for it.
+struct RasterDiagnostics
+{
+	// the screen is split into TILE_SIZE x TILE_SIZE tiles to accumulate rasterization time
+	static constexpr int TILE_SIZE = 16;
+
+	RasterDiagnostics(int w, int h);
+
+	// reset all counters (call it before every frame)
+	void clear();
+
+	// write 3 heatmaps (depth complexity, overdraw and per-tile time) mapped to a color ramp:
+	// <prefix>_depth.tga, <prefix>_overdraw.tga, <prefix>_tiletime.tga
+	bool write_heatmaps(const std::string& prefix) const;
+
+	// maps t in [0, 1] to a black -> blue -> green -> yellow -> red -> white color ramp
+	static TGAColor heat(float t);
+
+	int width;
+	int height;
+	int tilesX;
+	int tilesY;
+
+	// number of depth tests performed for each pixel (depth complexity)
+	std::vector<std::uint32_t> depthTests;
+	// number of times the fragment shader ran for each pixel (overdraw)
+	std::vector<std::uint32_t> shadeCount;
+	// time (in seconds) spent rasterizing and shading inside each tile
+	std::vector<double> tileTime;
+};
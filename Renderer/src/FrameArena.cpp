@@ -0,0 +1,81 @@
+#include "FrameArena.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <xmmintrin.h>
+
+// std::max() takes it by reference
+constexpr size_t FrameArena::ALIGNMENT;
+
+FrameArena::FrameArena(size_t capacity)
+{
+	addBlock(std::max<size_t>(capacity, ALIGNMENT));
+}
+
+FrameArena::~FrameArena()
+{
+	for (const Block& block : blocks)
+		_mm_free(block.data);
+}
+
+void FrameArena::addBlock(size_t size)
+{
+	char* data = static_cast<char*>(_mm_malloc(size, ALIGNMENT));
+	if (!data)
+		throw std::bad_alloc();
+	blocks.push_back(Block{data, size});
+	nHeapAllocations++;
+}
+
+void* FrameArena::allocate(size_t bytes, size_t align)
+{
+	size_t start = (offset + align - 1) & ~(align - 1);
+	if (start + bytes > blocks.back().size)
+	{
+		// the rest of this block is wasted: the next block is at least as large as this one
+		usedBefore += offset;
+		addBlock(std::max(blocks.back().size, bytes));
+		start = 0;
+	}
+	offset = start + bytes;
+	highWater = std::max(highWater, used());
+	return blocks.back().data + start;
+}
+
+void FrameArena::reset()
+{
+	if (blocks.size() > 1)
+	{
+		// one block large enough for the whole frame from now on
+		size_t size = 0;
+		for (const Block& block : blocks)
+		{
+			size += block.size;
+			_mm_free(block.data);
+		}
+		blocks.clear();
+		addBlock(size);
+	}
+	offset = 0;
+	usedBefore = 0;
+}
+
+size_t FrameArena::capacity() const
+{
+	size_t size = 0;
+	for (const Block& block : blocks)
+		size += block.size;
+	return size;
+}
+
+static thread_local FrameArena* CurrentArena = nullptr;
+
+FrameArena* frameArena()
+{
+	return CurrentArena;
+}
+
+void setFrameArena(FrameArena* arena)
+{
+	CurrentArena = arena;
+}
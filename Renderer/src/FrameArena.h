@@ -0,0 +1,98 @@
+#pragma once
+#include <cstddef>
+#include <new>
+#include <vector>
+
+// linear allocator for the transient data of a frame (batched matrices, transformed vertices, instance lists, ...):
+// allocate() bumps a pointer, nothing is freed individually, reset() rewinds everything at the end of the frame.
+// When a frame needs more than the capacity, extra blocks are taken from the heap; the next reset() replaces them
+// by a single block as large as everything the frame used, so a sequence of similar frames allocates from the heap
+// during its first frames only.
+// An arena is used by one thread: install it with setFrameArena() on the thread that renders the frame.
+class FrameArena
+{
+public:
+	static constexpr size_t DEFAULT_CAPACITY = 1 << 20;
+
+	explicit FrameArena(size_t capacity = DEFAULT_CAPACITY);
+	~FrameArena();
+
+	FrameArena(const FrameArena&) = delete;
+	FrameArena& operator=(const FrameArena&) = delete;
+
+	// uninitialized memory for bytes bytes aligned to align (a power of 2, at most ALIGNMENT)
+	void* allocate(size_t bytes, size_t align = alignof(std::max_align_t));
+	// forgets every allocation (O(1) unless the frame overflowed the first block)
+	void reset();
+
+	// statistics: bytes allocated since the last reset(), the most bytes a frame allocated,
+	// the size of the blocks and the number of blocks taken from the heap so far
+	size_t used() const { return usedBefore + offset; }
+	size_t highWaterMark() const { return highWater; }
+	size_t capacity() const;
+	size_t heapAllocations() const { return nHeapAllocations; }
+
+	static constexpr size_t ALIGNMENT = 64;
+
+private:
+	struct Block
+	{
+		char* data;
+		size_t size;
+	};
+
+	void addBlock(size_t size);
+
+	std::vector<Block> blocks;
+	// bump offset in the last block, and bytes used in the blocks before it
+	size_t offset = 0;
+	size_t usedBefore = 0;
+	size_t highWater = 0;
+	size_t nHeapAllocations = 0;
+};
+
+// arena of the frame rendered by the calling thread (nullptr: none, transient data comes from the heap)
+FrameArena* frameArena();
+void setFrameArena(FrameArena* arena);
+
+// standard allocator over the arena installed on the constructing thread (or the heap when there is none):
+// containers of transient data use it through FrameVector
+template <typename T>
+class ArenaAllocator
+{
+public:
+	using value_type = T;
+
+	ArenaAllocator() : arena(frameArena()) {}
+	template <typename U>
+	ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+	T* allocate(size_t n)
+	{
+		if (arena)
+			return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+		return static_cast<T*>(::operator new(n * sizeof(T)));
+	}
+
+	// arena memory is released by FrameArena::reset()
+	void deallocate(T* p, size_t)
+	{
+		if (!arena)
+			::operator delete(p);
+	}
+
+	template <typename U>
+	bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+	template <typename U>
+	bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+
+private:
+	template <typename U>
+	friend class ArenaAllocator;
+
+	FrameArena* arena;
+};
+
+// vector of transient data: must not outlive the frame (the reset() of its arena)
+template <typename T>
+using FrameVector = std::vector<T, ArenaAllocator<T>>;
@@ -0,0 +1,142 @@
+#include "FramePipeline.h"
+
+#include <algorithm>
+#include <chrono>
+
+FramePipeline::FramePipeline(int w, int h, int framesInFlight)
+{
+	int n = std::max(framesInFlight, 1);
+	buffers.reserve(n);
+	for (int i = 0; i < n; i++)
+		buffers.emplace_back(w, h);
+	busy.assign(n, false);
+	jobs.resize(n);
+	filenames.resize(n);
+	encoder = std::thread(&FramePipeline::encodeLoop, this);
+	geometry = std::thread(&FramePipeline::geometryLoop, this);
+}
+
+FramePipeline::~FramePipeline()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	queued.notify_one();
+	geometryQueued.notify_one();
+	// the encoder empties the queue before it stops, the geometry thread finishes its job
+	encoder.join();
+	geometry.join();
+}
+
+Framebuffer& FramePipeline::acquire()
+{
+	int next = (current + 1) % static_cast<int>(buffers.size());
+	auto start = std::chrono::steady_clock::now();
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		freed.wait(lock, [&] { return !busy[next]; });
+	}
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	waited += elapsed.count();
+	current = next;
+	return buffers[current];
+}
+
+void FramePipeline::submit(const std::string& filename)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		busy[current] = true;
+		filenames[current] = filename;
+		jobs[(firstJob + nJobs++) % jobs.size()] = current;
+	}
+	queued.notify_one();
+}
+
+void FramePipeline::finish()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	freed.wait(lock, [&] { return std::none_of(busy.begin(), busy.end(), [](bool b) { return b; }); });
+}
+
+void FramePipeline::prepare(std::function<void()> job)
+{
+	// one job at a time: the previous one must be done
+	waitPrepared();
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		geometryJob = std::move(job);
+		geometryPending = true;
+	}
+	geometryQueued.notify_one();
+}
+
+void FramePipeline::waitPrepared()
+{
+	auto start = std::chrono::steady_clock::now();
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		geometryDone.wait(lock, [&] { return !geometryPending; });
+	}
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	waitedPrepared += elapsed.count();
+}
+
+void FramePipeline::geometryLoop()
+{
+	for (;;)
+	{
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			geometryQueued.wait(lock, [&] { return stopping || geometryPending; });
+			if (!geometryPending)
+				return;
+			job = std::move(geometryJob);
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		job();
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			geometryPending = false;
+			prepared += elapsed.count();
+		}
+		geometryDone.notify_all();
+	}
+}
+
+void FramePipeline::encodeLoop()
+{
+	for (;;)
+	{
+		int buffer;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			queued.wait(lock, [&] { return stopping || nJobs > 0; });
+			if (nJobs == 0)
+				return;
+			buffer = jobs[firstJob];
+			firstJob = (firstJob + 1) % jobs.size();
+			nJobs--;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		// same orientation as the single frames of main.cpp
+		buffers[buffer].toTGA(encodedImage);
+		encodedImage.write_tga_file(filenames[buffer], false);
+		buffers[buffer].clear();
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			busy[buffer] = false;
+			nWritten++;
+			encoded += elapsed.count();
+		}
+		freed.notify_all();
+	}
+}
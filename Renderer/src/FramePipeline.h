@@ -0,0 +1,87 @@
+#pragma once
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Framebuffer.h"
+#include "tgaimage.h"
+
+// frames of a sequence in flight: while frame N is rendered, the frames before it are encoded and written to disk
+// by a background thread, each from its own framebuffer (framesInFlight = 2: double buffering, 3: triple buffering).
+// The encoder also clears a framebuffer once it is written, so the next frame rendered into it starts right away.
+// acquire() only blocks when every framebuffer is still queued for writing: the queue is bounded by framesInFlight.
+// A second thread runs the geometry stage of the next frame (see prepare()) while the current one is rasterized.
+class FramePipeline
+{
+public:
+	FramePipeline(int w, int h, int framesInFlight = 3);
+	// writes the frames still queued
+	~FramePipeline();
+
+	FramePipeline(const FramePipeline&) = delete;
+	FramePipeline& operator=(const FramePipeline&) = delete;
+
+	// the (cleared) framebuffer of the next frame
+	Framebuffer& acquire();
+	// queues the framebuffer returned by the last acquire() to be written to filename
+	void submit(const std::string& filename);
+	// waits until every submitted frame is written
+	void finish();
+
+	// runs job (the vertex and culling stage of the next frame, see prepareElements()) on the geometry thread while
+	// the caller rasterizes the current frame; job must not touch what the rasterization reads.
+	// waitPrepared() blocks until the last job given to prepare() is done
+	void prepare(std::function<void()> job);
+	void waitPrepared();
+
+	int framesInFlight() const { return static_cast<int>(buffers.size()); }
+	// statistics (read them after finish()): frames written, time the render thread waited in acquire() and time
+	// spent encoding and writing (ms)
+	int written() const { return nWritten; }
+	double waitedMs() const { return waited; }
+	double encodedMs() const { return encoded; }
+	// time spent in the geometry jobs, and waiting for them in waitPrepared() (ms)
+	double preparedMs() const { return prepared; }
+	double waitedPreparedMs() const { return waitedPrepared; }
+
+private:
+	void encodeLoop();
+	void geometryLoop();
+
+	std::vector<Framebuffer> buffers;
+	// buffers queued or being written
+	std::vector<bool> busy;
+	// buffer returned by the last acquire()
+	int current = -1;
+
+	// buffers queued for writing, oldest first: a ring of one slot per buffer (a buffer is queued at most once)
+	std::vector<int> jobs;
+	size_t firstJob = 0;
+	size_t nJobs = 0;
+	// file name of each buffer, the image it is encoded into (both keep their storage from one frame to the next)
+	std::vector<std::string> filenames;
+	TGAImage encodedImage;
+	std::mutex mutex;
+	// signaled when a job is queued (or on shutdown) and when a buffer is free again
+	std::condition_variable queued;
+	std::condition_variable freed;
+	bool stopping = false;
+	std::thread encoder;
+
+	// the job of the geometry thread, pending until it is done
+	std::function<void()> geometryJob;
+	bool geometryPending = false;
+	// signaled when a job is given (or on shutdown) and when it is done
+	std::condition_variable geometryQueued;
+	std::condition_variable geometryDone;
+	std::thread geometry;
+
+	int nWritten = 0;
+	double waited = 0.0;
+	double encoded = 0.0;
+	double prepared = 0.0;
+	double waitedPrepared = 0.0;
+};
@@ -0,0 +1,103 @@
+#include "Framebuffer.h"
+
+#include <algorithm>
+#include <new>
+#include <xmmintrin.h>
+
+template <typename T>
+AlignedBuffer<T>::AlignedBuffer(size_t n)
+	: ptr(static_cast<T*>(_mm_malloc(n * sizeof(T), ALIGNMENT))), count(n)
+{
+	if (!ptr)
+		throw std::bad_alloc();
+}
+
+template <typename T>
+AlignedBuffer<T>::AlignedBuffer(const AlignedBuffer& other) : AlignedBuffer(other.count)
+{
+	std::copy(other.ptr, other.ptr + count, ptr);
+}
+
+template <typename T>
+AlignedBuffer<T>::AlignedBuffer(AlignedBuffer&& other) noexcept : ptr(other.ptr), count(other.count)
+{
+	other.ptr = nullptr;
+	other.count = 0;
+}
+
+template <typename T>
+AlignedBuffer<T>& AlignedBuffer<T>::operator=(AlignedBuffer other) noexcept
+{
+	std::swap(ptr, other.ptr);
+	std::swap(count, other.count);
+	return *this;
+}
+
+template <typename T>
+AlignedBuffer<T>::~AlignedBuffer()
+{
+	_mm_free(ptr);
+}
+
+template class AlignedBuffer<std::uint32_t>;
+template class AlignedBuffer<float>;
+template class AlignedBuffer<std::uint16_t>;
+template class AlignedBuffer<std::uint8_t>;
+
+// pad the rows to a multiple of 16 4-byte pixels so that every row starts on a 64-byte boundary
+static int alignedPitch(int w)
+{
+	return (w + 15) & ~15;
+}
+
+Framebuffer::Framebuffer(int w, int h) : w(w), h(h), stride(alignedPitch(w)), pixels(alignedPitch(w) * h)
+{
+	clear();
+}
+
+void Framebuffer::clear(std::uint32_t c)
+{
+	std::fill(pixels.data(), pixels.data() + pixels.size(), c);
+}
+
+TGAImage Framebuffer::toTGA(int bpp) const
+{
+	TGAImage image;
+	toTGA(image, bpp);
+	return image;
+}
+
+void Framebuffer::toTGA(TGAImage& image, int bpp) const
+{
+	if (image.width() != w || image.height() != h || image.bytespp() != bpp)
+		image = TGAImage(w, h, bpp);
+	std::uint8_t* out = image.buffer();
+	for (int y = 0; y < h; y++)
+	{
+		const std::uint8_t* in = reinterpret_cast<const std::uint8_t*>(row(y));
+		if (bpp == TGAImage::RGBA)
+		{
+			std::memcpy(out, in, w * 4);
+			out += w * 4;
+			continue;
+		}
+		for (int x = 0; x < w; x++, in += 4)
+		{
+			if (bpp == TGAImage::GRAYSCALE)
+			{
+				*out++ = in[0];
+			}
+			else
+			{
+				*out++ = in[0];
+				*out++ = in[1];
+				*out++ = in[2];
+			}
+		}
+	}
+}
+
+bool Framebuffer::write_tga_file(const std::string filename, const bool vflip, const bool rle) const
+{
+	return toTGA().write_tga_file(filename, vflip, rle);
+}
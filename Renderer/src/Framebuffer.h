@@ -0,0 +1,80 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+
+#include "tgaimage.h"
+
+// heap array aligned to ALIGNMENT bytes so that rows can be written with aligned SIMD stores
+template <typename T>
+class AlignedBuffer
+{
+public:
+	static constexpr size_t ALIGNMENT = 64;
+
+	AlignedBuffer() = default;
+	explicit AlignedBuffer(size_t n);
+	AlignedBuffer(const AlignedBuffer& other);
+	AlignedBuffer(AlignedBuffer&& other) noexcept;
+	AlignedBuffer& operator=(AlignedBuffer other) noexcept;
+	~AlignedBuffer();
+
+	T* data() { return ptr; }
+	const T* data() const { return ptr; }
+	size_t size() const { return count; }
+	T& operator[](size_t i) { return ptr[i]; }
+	const T& operator[](size_t i) const { return ptr[i]; }
+
+private:
+	T* ptr = nullptr;
+	size_t count = 0;
+};
+
+// color attachment: one 32-bit pixel per sample, stored with the same BGRA byte order as TGAColor.
+// Accessors are unchecked, the rasterizer clamps to the screen before writing.
+// Every row starts on a 64-byte boundary (the pitch is padded to a multiple of 16 pixels).
+class Framebuffer
+{
+public:
+	Framebuffer(int w, int h);
+
+	int width() const { return w; }
+	int height() const { return h; }
+	// number of pixels between two rows
+	int pitch() const { return stride; }
+
+	std::uint32_t* row(int y) { return pixels.data() + y * stride; }
+	const std::uint32_t* row(int y) const { return pixels.data() + y * stride; }
+
+	void set(int x, int y, std::uint32_t c) { row(y)[x] = c; }
+	std::uint32_t get(int x, int y) const { return row(y)[x]; }
+
+	// fills every pixel with a packed color
+	void clear(std::uint32_t c = 0);
+
+	// TGAColor <-> packed 32-bit pixel
+	static std::uint32_t pack(const TGAColor& c)
+	{
+		std::uint32_t p;
+		std::memcpy(&p, c.bgra, sizeof(p));
+		return p;
+	}
+
+	static TGAColor unpack(std::uint32_t p)
+	{
+		return TGAColor(reinterpret_cast<const std::uint8_t*>(&p), 4);
+	}
+
+	// conversion to a TGAImage only happens when writing the frame out
+	TGAImage toTGA(int bpp = TGAImage::RGB) const;
+	// same into image, whose pixels are reused when it already has the size and format of the frame
+	void toTGA(TGAImage& image, int bpp = TGAImage::RGB) const;
+	bool write_tga_file(const std::string filename, const bool vflip = true, const bool rle = true) const;
+
+private:
+	int w;
+	int h;
+	int stride;
+	AlignedBuffer<std::uint32_t> pixels;
+};
@@ -0,0 +1,200 @@
+#include "GBuffer.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Parallel.h"
+
+GBuffer::GBuffer(int w, int h)
+	: vb(w, h), surfaces(static_cast<size_t>(vb.zbuffer.pitch()) * h),
+	  tilesX((w + TILE_SIZE - 1) / TILE_SIZE), tilesY((h + TILE_SIZE - 1) / TILE_SIZE), dirty(tilesX * tilesY)
+{
+}
+
+GBuffer::TileRect GBuffer::tilesOf(const Mesh& mesh, IShader& shader) const
+{
+	const TileRect screen = {0, tilesX - 1, 0, tilesY - 1};
+	float xmin = vb.width, xmax = 0.f, ymin = vb.height, ymax = 0.f;
+	Vertex scratch;
+	for (size_t i = 0; i < mesh.vertexCount(); i++)
+	{
+		glm::vec4 hcp;
+		shader.vertex(mesh.fetch(i, scratch), 0, hcp);
+		// a vertex behind the camera may project anywhere
+		if (hcp.w <= 0.f)
+			return screen;
+		// same viewport transform as RasterTriangle::setup
+		float x = (hcp.x / hcp.w + 1) / 2 * vb.width, y = (1 - hcp.y / hcp.w) / 2 * vb.height;
+		xmin = std::min(xmin, x);
+		xmax = std::max(xmax, x);
+		ymin = std::min(ymin, y);
+		ymax = std::max(ymax, y);
+	}
+	if (xmin > xmax || ymin > ymax || xmax < 0.f || ymax < 0.f || xmin >= vb.width || ymin >= vb.height)
+		return TileRect{0, -1, 0, -1};
+	auto tile = [](float v, int last)
+	{
+		return std::min(std::max(static_cast<int>(std::floor(v)) / static_cast<int>(TILE_SIZE), 0), last);
+	};
+	return TileRect{tile(xmin, tilesX - 1), tile(xmax, tilesX - 1), tile(ymin, tilesY - 1), tile(ymax, tilesY - 1)};
+}
+
+void GBuffer::markTiles(const TileRect& rect)
+{
+	for (int ty = rect.ty0; ty <= rect.ty1; ty++)
+		for (int tx = rect.tx0; tx <= rect.tx1; tx++)
+			dirty[ty * tilesX + tx] = 1;
+}
+
+int GBuffer::update(const std::vector<Mesh>& meshes, const glm::mat4& viewProjection, const ShaderPool& shaders)
+{
+	const bool rebuild = !valid || viewProjection != cachedViewProjection || meshes.size() != cachedVersions.size();
+	// nothing moved (the common case of the look-dev loop): no shader is touched, no tile is scanned
+	if (!rebuild && std::equal(cachedVersions.begin(), cachedVersions.end(), meshes.begin(),
+	                           [](unsigned version, const Mesh& mesh) { return version == mesh.geometryVersion; }))
+		return 0;
+	std::fill(dirty.begin(), dirty.end(), rebuild ? 1 : 0);
+
+	// a changed mesh dirties the tiles it covered before the change and the ones it covers now
+	cachedTiles.resize(meshes.size());
+	for (size_t m = 0; m < meshes.size(); m++)
+	{
+		if (!rebuild && meshes[m].geometryVersion == cachedVersions[m])
+			continue;
+		TileRect rect = tilesOf(meshes[m], shaders.get(0, m));
+		if (!rebuild)
+		{
+			markTiles(cachedTiles[m]);
+			markTiles(rect);
+		}
+		cachedTiles[m] = rect;
+	}
+
+	valid = true;
+	cachedViewProjection = viewProjection;
+	cachedVersions.resize(meshes.size());
+	for (size_t m = 0; m < meshes.size(); m++)
+		cachedVersions[m] = meshes[m].geometryVersion;
+
+	int dirtyTiles = static_cast<int>(std::count(dirty.begin(), dirty.end(), 1));
+	if (dirtyTiles == 0)
+		return 0;
+
+	// reset the dirty tiles
+	for (int ty = 0; ty < tilesY; ty++)
+	{
+		for (int tx = 0; tx < tilesX; tx++)
+		{
+			if (!dirty[ty * tilesX + tx])
+				continue;
+			vb.zbuffer.clearTile(tx, ty);
+			int x1 = std::min<int>(vb.width, (tx + 1) * TILE_SIZE), y1 = std::min<int>(vb.height, (ty + 1) * TILE_SIZE);
+			for (int y = ty * TILE_SIZE; y < y1; y++)
+				std::fill(vb.row(y) + tx * TILE_SIZE, vb.row(y) + x1, VisibilityBuffer::EMPTY);
+		}
+	}
+
+	// rasterize again every mesh overlapping a dirty tile (an unchanged mesh may have been hidden by a changed one),
+	// clipped to the dirty tiles
+	for (size_t m = 0; m < meshes.size(); m++)
+	{
+		const TileRect& rect = cachedTiles[m];
+		if (!VisibilityBuffer::canPack(m, meshes[m].indices.size() / 3))
+			continue;
+		bool overlaps = false;
+		for (int ty = rect.ty0; ty <= rect.ty1 && !overlaps; ty++)
+			for (int tx = rect.tx0; tx <= rect.tx1 && !overlaps; tx++)
+				overlaps = dirty[ty * tilesX + tx] != 0;
+		if (!overlaps)
+			continue;
+
+		IShader& shader = shaders.get(0, m);
+		const vector<unsigned int>& indices = meshes[m].indices;
+		Vertex scratch;
+		for (size_t i = 0; i < indices.size(); i += 3)
+		{
+			glm::vec4 hcp[3];
+			for (int j = 0; j < 3; j++)
+				shader.vertex(meshes[m].fetch(indices[i + j], scratch), j, hcp[j]);
+			triangleVisibility(hcp, VisibilityBuffer::packID(static_cast<uint32_t>(m), static_cast<uint32_t>(i / 3)),
+			                   vb, rebuild ? nullptr : dirty.data());
+		}
+	}
+
+	sampleSurfaces(meshes, shaders);
+	return dirtyTiles;
+}
+
+void GBuffer::sampleSurfaces(const std::vector<Mesh>& meshes, const ShaderPool& shaders)
+{
+	// same walk as shadeVisibility(), with surface() instead of fragment()
+	parallelForWorkers(tilesX * tilesY, [&](uint32_t tile, uint32_t worker)
+	{
+		if (!dirty[tile])
+			return;
+		uint32_t x0 = tile % tilesX * TILE_SIZE, y0 = tile / tilesX * TILE_SIZE;
+		uint32_t x1 = std::min<uint32_t>(x0 + TILE_SIZE, vb.width), y1 = std::min<uint32_t>(y0 + TILE_SIZE, vb.height);
+
+		uint32_t currentID = VisibilityBuffer::EMPTY;
+		IShader* shader = nullptr;
+		RasterTriangle tri;
+		Vertex scratch;
+		for (uint32_t y = y0; y < y1; ++y)
+		{
+			uint32_t* idRow = vb.row(y);
+			Surface* surfaceRow = surfaces.data() + y * vb.zbuffer.pitch();
+			for (uint32_t x = x0; x < x1; ++x)
+			{
+				uint32_t id = idRow[x];
+				if (id == VisibilityBuffer::EMPTY)
+				{
+					continue;
+				}
+				if (id != currentID)
+				{
+					uint32_t m = VisibilityBuffer::meshOf(id);
+					uint32_t t = VisibilityBuffer::triangleOf(id);
+					shader = &shaders.get(worker, m);
+					glm::vec4 hcp[3];
+					for (int j = 0; j < 3; j++)
+						shader->vertex(meshes[m].fetch(meshes[m].indices[3 * t + j], scratch), j, hcp[j]);
+					tri.setup(hcp, vb.width, vb.height, shader->v_Varyings, shader->nVaryings);
+					currentID = id;
+				}
+
+				glm::vec4 gl_FragCoord = tri.fragCoord(x, y);
+				float varyings[MAX_VARYINGS];
+				tri.interpolate(gl_FragCoord, varyings);
+				// discarded fragments are left out of the lighting
+				if (shader->surface(gl_FragCoord, varyings, surfaceRow[x]))
+					idRow[x] = VisibilityBuffer::EMPTY;
+			}
+		}
+	});
+}
+
+void GBuffer::relight(const ShaderPool& shaders, Framebuffer& image) const
+{
+	// lighting() does not change the shaders: the ones of worker 0 are shared by all workers
+	parallelFor(tilesX * tilesY, [&](uint32_t tile)
+	{
+		uint32_t x0 = tile % tilesX * TILE_SIZE, y0 = tile / tilesX * TILE_SIZE;
+		uint32_t x1 = std::min<uint32_t>(x0 + TILE_SIZE, vb.width), y1 = std::min<uint32_t>(y0 + TILE_SIZE, vb.height);
+		for (uint32_t y = y0; y < y1; ++y)
+		{
+			const uint32_t* idRow = vb.row(y);
+			const Surface* surfaceRow = surfaces.data() + y * vb.zbuffer.pitch();
+			uint32_t* colorRow = image.row(y);
+			for (uint32_t x = x0; x < x1; ++x)
+			{
+				if (idRow[x] == VisibilityBuffer::EMPTY)
+				{
+					continue;
+				}
+				TGAColor color;
+				shaders.get(0, VisibilityBuffer::meshOf(idRow[x])).lighting(surfaceRow[x], color);
+				colorRow[x] = Framebuffer::pack(color);
+			}
+		}
+	});
+}
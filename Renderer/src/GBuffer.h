@@ -0,0 +1,62 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "VisibilityBuffer.h"
+
+// G-buffer for incremental re-lighting: the visibility buffer (depth + triangle IDs) of the deferred path,
+// plus the Surface (albedo, normal, specular exponent) of every visible pixel, produced by IShader::surface().
+// Once it is filled, relight() only runs IShader::lighting() per pixel: changing the light or the material
+// uniforms neither rasterizes nor samples a texture again.
+// update() keeps the buffer in sync with the meshes: only the tiles covered by meshes whose geometry changed
+// (Mesh::geometryVersion), before or after the change, are rasterized and sampled again.
+class GBuffer
+{
+public:
+	static constexpr uint32_t TILE_SIZE = VisibilityBuffer::TILE_SIZE;
+
+	GBuffer(int w, int h);
+
+	int width() const { return vb.width; }
+	int height() const { return vb.height; }
+	const VisibilityBuffer& visibility() const { return vb; }
+	const Surface& surface(int x, int y) const { return surfaces[y * vb.zbuffer.pitch() + x]; }
+
+	// brings the buffer up to date: everything is rebuilt the first time, after invalidate() or when the camera
+	// (viewProjection) or the set of meshes changed, otherwise only the tiles of the changed meshes.
+	// shaders: the shaders of the meshes for each worker, with their uniforms set (see shadeVisibility()).
+	// returns the number of tiles rebuilt (0, without running any shader, when nothing changed)
+	int update(const std::vector<Mesh>& meshes, const glm::mat4& viewProjection, const ShaderPool& shaders);
+	// forces the next update() to rebuild everything
+	void invalidate() { valid = false; }
+
+	// lights every visible pixel with the lighting() of the shader of its mesh and writes it to image
+	void relight(const ShaderPool& shaders, Framebuffer& image) const;
+
+private:
+	// the tiles [tx0, tx1] x [ty0, ty1] a mesh may cover (empty when tx0 > tx1)
+	struct TileRect
+	{
+		int tx0, tx1, ty0, ty1;
+	};
+
+	// projects the vertices of the mesh with the vertex shader
+	TileRect tilesOf(const Mesh& mesh, IShader& shader) const;
+	void markTiles(const TileRect& rect);
+	// fills the surfaces of the dirty tiles
+	void sampleSurfaces(const std::vector<Mesh>& meshes, const ShaderPool& shaders);
+
+	VisibilityBuffer vb;
+	// one surface per pixel, rows are laid out like the visibility buffer
+	std::vector<Surface> surfaces;
+	int tilesX;
+	int tilesY;
+	// tiles to rebuild during update()
+	std::vector<std::uint8_t> dirty;
+
+	// what the buffer was built from
+	bool valid = false;
+	glm::mat4 cachedViewProjection{1.f};
+	std::vector<unsigned> cachedVersions;
+	std::vector<TileRect> cachedTiles;
+};
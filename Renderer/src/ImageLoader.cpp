@@ -0,0 +1,121 @@
+#include "ImageLoader.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstring>
+#include <iostream>
+
+#if defined(__SSSE3__) || defined(__AVX2__)
+#include <tmmintrin.h>
+#define IMAGE_LOADER_SSSE3
+#endif
+
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image/stb_image.h>
+
+#include "Parallel.h"
+
+void swizzleRGB(const std::uint8_t* in, std::uint8_t* out, size_t count, int channels)
+{
+	size_t i = 0;
+#ifdef IMAGE_LOADER_SSSE3
+	if (channels == 4)
+	{
+		// 4 texels per register
+		const __m128i order = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 4 * i));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4 * i), _mm_shuffle_epi8(v, order));
+		}
+	}
+	else
+	{
+		// 5 texels (15 bytes) per register: the 16th byte is copied as is and rewritten by the next step
+		const __m128i order = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+		for (; 3 * i + 16 <= 3 * count; i += 5)
+		{
+			__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 3 * i));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 3 * i), _mm_shuffle_epi8(v, order));
+		}
+	}
+#endif
+	for (; i < count; i++)
+	{
+		const std::uint8_t* t = in + i * channels;
+		std::uint8_t* o = out + i * channels;
+		std::uint8_t r = t[0];
+		o[0] = t[2];
+		o[1] = t[1];
+		o[2] = r;
+		if (channels == 4)
+			o[3] = t[3];
+	}
+}
+
+static bool isTGA(const std::string& filename)
+{
+	if (filename.size() < 4)
+		return false;
+	std::string ext = filename.substr(filename.size() - 4);
+	std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+	return ext == ".tga";
+}
+
+bool loadImage(const std::string& filename, TGAImage& image, bool flipVertically)
+{
+	if (isTGA(filename))
+	{
+		TGAImage tga;
+		if (!tga.read_tga_file(filename))
+			return false;
+		if (flipVertically)
+			tga.flip_vertically();
+		image = std::move(tga);
+		return true;
+	}
+
+	int w, h, n;
+	if (!stbi_info(filename.c_str(), &w, &h, &n))
+	{
+		std::cerr << "can't decode file " << filename << ": " << stbi_failure_reason() << "\n";
+		return false;
+	}
+	// grayscale stays grayscale, grayscale + alpha becomes BGRA
+	const int channels = n == 1 ? TGAImage::GRAYSCALE : n == 3 ? TGAImage::RGB : TGAImage::RGBA;
+	stbi_uc* pixels = stbi_load(filename.c_str(), &w, &h, &n, channels);
+	if (!pixels)
+	{
+		std::cerr << "can't decode file " << filename << ": " << stbi_failure_reason() << "\n";
+		return false;
+	}
+
+	// swizzle (and flip) in one pass over the rows
+	TGAImage decoded(w, h, channels);
+	const size_t rowBytes = static_cast<size_t>(w) * channels;
+	for (int y = 0; y < h; y++)
+	{
+		const std::uint8_t* in = pixels + y * rowBytes;
+		std::uint8_t* out = decoded.buffer() + (flipVertically ? h - 1 - y : y) * rowBytes;
+		if (channels == TGAImage::GRAYSCALE)
+			std::memcpy(out, in, rowBytes);
+		else
+			swizzleRGB(in, out, w, channels);
+	}
+	stbi_image_free(pixels);
+	image = std::move(decoded);
+	return true;
+}
+
+size_t loadImages(const std::vector<std::string>& filenames, std::vector<TGAImage>& images)
+{
+	images.assign(filenames.size(), TGAImage());
+	std::atomic<size_t> loaded(0);
+	parallelFor(static_cast<uint32_t>(filenames.size()), [&](uint32_t i)
+	{
+		if (loadImage(filenames[i], images[i]))
+			loaded++;
+	});
+	return loaded;
+}
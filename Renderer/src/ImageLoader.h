@@ -0,0 +1,21 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "tgaimage.h"
+
+// decodes an image file into a TGAImage, the representation every texture of the renderer uses:
+// .tga files through TGAImage::read_tga_file, the others (PNG, JPEG, BMP, ...) through stb_image.
+// Decoded images get the layout of a loaded TGA file: BGR or BGRA texels (grayscale stays 1 byte), first row at
+// the top (stb_image decodes top-down too, flipVertically puts the first row at the bottom instead).
+// Returns false (and leaves image untouched) when the file cannot be read.
+bool loadImage(const std::string& filename, TGAImage& image, bool flipVertically = false);
+
+// loads images[i] from filenames[i], decoding the files in parallel (one file per worker).
+// The image of a file that cannot be read stays empty (width() == 0); returns the number of files read
+size_t loadImages(const std::vector<std::string>& filenames, std::vector<TGAImage>& images);
+
+// RGB(A) -> BGR(A) byte order (channels: 3 or 4) of count texels; in and out may be the same buffer.
+// SSSE3 byte shuffles when the build has them
+void swizzleRGB(const std::uint8_t* in, std::uint8_t* out, size_t count, int channels);
@@ -0,0 +1,227 @@
+#include "Lod.h"
+
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <unordered_map>
+#include <unordered_set>
+
+// cells of the clustering grid along the bounding box diagonal for level 1 (level n uses 2^(n - 1) times bigger cells)
+static const float LOD_GRID_RESOLUTION = 128.f;
+
+static uint64_t cellKey(const glm::vec3& p, const glm::vec3& origin, float cellSize)
+{
+	glm::vec3 c = glm::floor((p - origin) / cellSize);
+	// 21 bits per axis
+	return (static_cast<uint64_t>(c.x) & 0x1fffff) | (static_cast<uint64_t>(c.y) & 0x1fffff) << 21
+		| (static_cast<uint64_t>(c.z) & 0x1fffff) << 42;
+}
+
+// simplified index buffer of the mesh for the given cell size
+static vector<unsigned int> clusterIndices(const Mesh& mesh, float cellSize)
+{
+	struct Cluster
+	{
+		glm::vec3 sum{0.f};
+		unsigned int count = 0;
+		unsigned int representative = 0;
+		float bestDistance = 0.f;
+	};
+
+	// 1) average position of each cell
+	std::unordered_map<uint64_t, Cluster> clusters;
+	vector<uint64_t> keys(mesh.vertexCount());
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		keys[i] = cellKey(mesh.position(i), mesh.aabbMin, cellSize);
+		Cluster& c = clusters[keys[i]];
+		c.sum += mesh.position(i);
+		c.count++;
+	}
+
+	// 2) the representative of a cell is its vertex closest to the average (it keeps its own normal, uv, ...)
+	for (auto& it : clusters)
+		it.second.bestDistance = std::numeric_limits<float>::max();
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		Cluster& c = clusters[keys[i]];
+		glm::vec3 d = mesh.position(i) - c.sum / static_cast<float>(c.count);
+		float distance = glm::dot(d, d);
+		if (distance < c.bestDistance)
+		{
+			c.bestDistance = distance;
+			c.representative = static_cast<unsigned int>(i);
+		}
+	}
+
+	// 3) remap the triangles, dropping the collapsed and duplicated ones
+	vector<unsigned int> indices;
+	std::unordered_set<uint64_t> seen;
+	for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3)
+	{
+		unsigned int a = clusters[keys[mesh.indices[i]]].representative;
+		unsigned int b = clusters[keys[mesh.indices[i + 1]]].representative;
+		unsigned int c = clusters[keys[mesh.indices[i + 2]]].representative;
+		if (a == b || b == c || a == c)
+			continue;
+		// rotate the smallest index first so that the same triangle (same winding) has a single key
+		while (a > b || a > c)
+		{
+			unsigned int t = a;
+			a = b;
+			b = c;
+			c = t;
+		}
+		uint64_t key = static_cast<uint64_t>(a) * 0x9E3779B97F4A7C15ull ^ static_cast<uint64_t>(b) << 32 ^ c;
+		if (!seen.insert(key).second)
+			continue;
+		indices.push_back(a);
+		indices.push_back(b);
+		indices.push_back(c);
+	}
+	return indices;
+}
+
+void generateLODs(Mesh& mesh, int levels)
+{
+	float diagonal = glm::length(mesh.aabbMax - mesh.aabbMin);
+	if (diagonal <= 0.f)
+		return;
+	float cellSize = diagonal / LOD_GRID_RESOLUTION;
+	size_t previousCount = mesh.indices.size();
+	for (int level = 0; level < levels; level++, cellSize *= 2.f)
+	{
+		MeshLOD lod;
+		lod.indices = clusterIndices(mesh, cellSize);
+		lod.error = cellSize;
+		// a level that barely removes triangles only costs memory
+		if (lod.indices.empty() || lod.indices.size() * 10 > previousCount * 9)
+			continue;
+		previousCount = lod.indices.size();
+		mesh.lods.push_back(std::move(lod));
+	}
+}
+
+// cache file layout (native endianness):
+// uint32 mesh count, then for each mesh: uint32 vertex count, uint32 index count, uint32 level count,
+// then for each level: float error, uint32 index count, the indices
+static bool loadLODCache(std::vector<Mesh>& meshes, const std::string& cacheFile)
+{
+	std::ifstream in(cacheFile, std::ios::binary);
+	if (!in.is_open())
+		return false;
+	auto read32 = [&in]()
+	{
+		uint32_t v = 0;
+		in.read(reinterpret_cast<char*>(&v), sizeof(v));
+		return v;
+	};
+
+	std::vector<std::vector<MeshLOD>> levels(meshes.size());
+	if (read32() != meshes.size())
+		return false;
+	for (size_t m = 0; m < meshes.size(); m++)
+	{
+		// the cache is stale if the mesh changed
+		if (read32() != meshes[m].vertexCount() || read32() != meshes[m].indices.size())
+			return false;
+		levels[m].resize(read32());
+		for (MeshLOD& lod : levels[m])
+		{
+			in.read(reinterpret_cast<char*>(&lod.error), sizeof(lod.error));
+			lod.indices.resize(read32());
+			in.read(reinterpret_cast<char*>(lod.indices.data()), lod.indices.size() * sizeof(unsigned int));
+			for (unsigned int index : lod.indices)
+			{
+				if (!in.good() || index >= meshes[m].vertexCount())
+					return false;
+			}
+		}
+	}
+	if (!in.good())
+		return false;
+	for (size_t m = 0; m < meshes.size(); m++)
+		meshes[m].lods = std::move(levels[m]);
+	return true;
+}
+
+static bool saveLODCache(const std::vector<Mesh>& meshes, const std::string& cacheFile)
+{
+	std::ofstream out(cacheFile, std::ios::binary);
+	if (!out.is_open())
+		return false;
+	auto write32 = [&out](size_t v)
+	{
+		uint32_t v32 = static_cast<uint32_t>(v);
+		out.write(reinterpret_cast<const char*>(&v32), sizeof(v32));
+	};
+	write32(meshes.size());
+	for (const Mesh& mesh : meshes)
+	{
+		write32(mesh.vertexCount());
+		write32(mesh.indices.size());
+		write32(mesh.lods.size());
+		for (const MeshLOD& lod : mesh.lods)
+		{
+			out.write(reinterpret_cast<const char*>(&lod.error), sizeof(lod.error));
+			write32(lod.indices.size());
+			out.write(reinterpret_cast<const char*>(lod.indices.data()), lod.indices.size() * sizeof(unsigned int));
+		}
+	}
+	return out.good();
+}
+
+void buildLODs(std::vector<Mesh>& meshes, const std::string& cacheFile, int levels)
+{
+	if (loadLODCache(meshes, cacheFile))
+	{
+		std::cout << "LODs loaded from " << cacheFile << std::endl;
+		return;
+	}
+	for (Mesh& mesh : meshes)
+	{
+		mesh.lods.clear();
+		generateLODs(mesh, levels);
+		std::cout << "LODs: " << mesh.indices.size() / 3;
+		for (const MeshLOD& lod : mesh.lods)
+			std::cout << " -> " << lod.indices.size() / 3;
+		std::cout << " triangles" << std::endl;
+	}
+	if (!saveLODCache(meshes, cacheFile))
+		std::cerr << "can't write the LOD cache " << cacheFile << "\n";
+}
+
+float lodPixelScale(const glm::mat4& projection, int screenHeight)
+{
+	// projection[1][1] = 1 / tan(fovy / 2) maps view space y / distance to NDC y, NDC spans 2 units on screen
+	return projection[1][1] * screenHeight * 0.5f;
+}
+
+float maxScale(const glm::mat4& model)
+{
+	return std::max(glm::length(glm::vec3(model[0])),
+	                std::max(glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2]))));
+}
+
+int selectLOD(const Mesh& mesh, const glm::mat4& mvp, float modelScale, float pixelScale, float maxPixelError)
+{
+	if (mesh.lods.empty())
+		return 0;
+	glm::vec3 center = (mesh.aabbMin + mesh.aabbMax) * 0.5f;
+	float radius = glm::length(mesh.aabbMax - mesh.aabbMin) * 0.5f * modelScale;
+	// clip space w is the view space distance along the view direction
+	float distance = (mvp * glm::vec4(center, 1.f)).w - radius;
+	if (distance <= 0.f)
+		return 0;
+
+	int level = 0;
+	for (size_t i = 0; i < mesh.lods.size(); i++)
+	{
+		float pixelError = mesh.lods[i].error * modelScale * pixelScale / distance;
+		if (pixelError > maxPixelError)
+			break;
+		level = static_cast<int>(i) + 1;
+	}
+	return level;
+}
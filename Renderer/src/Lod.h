@@ -0,0 +1,29 @@
+#pragma once
+#include <string>
+#include <vector>
+
+#include "Mesh.h"
+
+// Level of detail: far away instances of dense meshes produce sub-pixel triangles that only cost setup time.
+// generateLODs() simplifies a mesh by vertex clustering: vertices falling into the same cell of a uniform grid
+// are merged into one representative vertex of that cell, and triangles that collapse are dropped.
+// Each level doubles the cell size, so its error (Mesh::lods[i].error) is the cell size.
+// Since the representatives are existing vertices, a level is only a new index buffer.
+
+// appends up to `levels` levels to mesh.lods (levels that would not remove triangles are not kept)
+void generateLODs(Mesh& mesh, int levels = 3);
+
+// generates the levels of all meshes, or loads them from cacheFile when it matches the meshes;
+// freshly generated levels are written to cacheFile
+void buildLODs(std::vector<Mesh>& meshes, const std::string& cacheFile, int levels = 3);
+
+// number of pixels covered by one world unit at distance 1 for this projection and screen height
+float lodPixelScale(const glm::mat4& projection, int screenHeight);
+
+// largest scale factor of the axes of a model matrix (the modelScale of selectLOD)
+float maxScale(const glm::mat4& model);
+
+// picks the coarsest level whose error, projected at the distance of the closest point of the mesh bounding sphere,
+// stays under maxPixelError pixels.
+// mvp: model-view-projection of the draw, modelScale: largest scale factor of the model matrix
+int selectLOD(const Mesh& mesh, const glm::mat4& mvp, float modelScale, float pixelScale, float maxPixelError);
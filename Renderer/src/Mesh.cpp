@@ -1,10 +1,119 @@
 ﻿#include "Mesh.h"
 
+#include <cmath>
+
 Mesh::Mesh(const vector<Vertex>& vertices, const vector<unsigned int>& indices, const vector<Texture>& textures)
 	: vertices(vertices), indices(indices), textures(textures)
 {
 	// now that we have all the required data, set the vertex buffers and its attribute pointers.
 	// setupMesh();
+	if (!vertices.empty())
+	{
+		aabbMin = aabbMax = vertices[0].Position;
+		for (const Vertex& v : vertices)
+		{
+			aabbMin = glm::min(aabbMin, v.Position);
+			aabbMax = glm::max(aabbMax, v.Position);
+		}
+	}
+
+	float uvArea = 0.f, area = 0.f;
+	for (size_t i = 0; i + 2 < indices.size(); i += 3)
+	{
+		const Vertex& a = vertices[indices[i]];
+		const Vertex& b = vertices[indices[i + 1]];
+		const Vertex& c = vertices[indices[i + 2]];
+		area += glm::length(glm::cross(b.Position - a.Position, c.Position - a.Position));
+		glm::vec2 e1 = b.TexCoords - a.TexCoords, e2 = c.TexCoords - a.TexCoords;
+		uvArea += std::abs(e1.x * e2.y - e1.y * e2.x);
+	}
+	if (area > 0.f)
+		uvDensity = std::sqrt(uvArea / area);
+
+	for (const Vertex& v : vertices)
+	{
+		if (v.m_BoneIDs[0] >= 0 && v.m_Weights[0] > 0.f)
+		{
+			skinned = true;
+			break;
+		}
+	}
+	if (skinned)
+	{
+		// until the first skinMesh() the mesh is drawn in its bind pose
+		skinnedVertices = vertices;
+	}
+}
+
+bool Mesh::pack()
+{
+	if (skinned)
+		return false;
+	if (packed())
+		return true;
+
+	if (!vertices.empty())
+	{
+		uvMin = uvMax = vertices[0].TexCoords;
+		for (const Vertex& v : vertices)
+		{
+			uvMin = glm::min(uvMin, v.TexCoords);
+			uvMax = glm::max(uvMax, v.TexCoords);
+		}
+	}
+
+	glm::vec3 extent = aabbMax - aabbMin;
+	glm::vec2 uvExtent = uvMax - uvMin;
+	packedVertices.resize(vertices.size());
+	for (size_t i = 0; i < vertices.size(); i++)
+	{
+		const Vertex& v = vertices[i];
+		PackedVertex& p = packedVertices[i];
+		for (int c = 0; c < 3; c++)
+			p.position[c] = packing::unorm16(extent[c] > 0.f ? (v.Position[c] - aabbMin[c]) / extent[c] : 0.f);
+		packing::octEncode(v.Normal, p.normal);
+		packing::octEncode(v.Tangent, p.tangent);
+		// the bitangent only keeps its side: the lowest bit of the tangent
+		bool flipped = glm::dot(glm::cross(v.Normal, v.Tangent), v.Bitangent) < 0.f;
+		p.tangent[1] = static_cast<std::int16_t>((p.tangent[1] & ~1) | (flipped ? 1 : 0));
+		for (int c = 0; c < 2; c++)
+			p.texCoords[c] = packing::unorm16(uvExtent[c] > 0.f ? (v.TexCoords[c] - uvMin[c]) / uvExtent[c] : 0.f);
+	}
+	// release the memory (clear() would keep the capacity)
+	vector<Vertex>().swap(vertices);
+	return true;
+}
+
+size_t Mesh::prepareTextures()
+{
+	size_t bytes = 0;
+	for (Texture& tex : textures)
+	{
+		if (tex.prepared.empty() && !tex.paged)
+		{
+			tex.prepared = PreparedTexture(tex.data, PreparedTexture::formatFor(tex.type));
+			tex.data = TGAImage();
+		}
+		bytes += tex.prepared.bytes();
+	}
+	return bytes;
+}
+
+Vertex Mesh::unpack(size_t i) const
+{
+	const PackedVertex& p = packedVertices[i];
+	Vertex v;
+	v.Position = position(i);
+	v.Normal = packing::octDecode(p.normal);
+	v.Tangent = packing::octDecode(p.tangent);
+	v.Bitangent = glm::cross(v.Normal, v.Tangent) * (p.tangent[1] & 1 ? -1.f : 1.f);
+	v.TexCoords = uvMin + (uvMax - uvMin) * glm::vec2(packing::unorm16(p.texCoords[0]), packing::unorm16(p.texCoords[1]));
+	for (int b = 0; b < MAX_BONE_INFLUENCE; b++)
+	{
+		v.m_BoneIDs[b] = -1;
+		v.m_Weights[b] = 0.f;
+	}
+	return v;
 }
 
 // void Mesh::Draw(Shader& shader)
@@ -3,13 +3,18 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
+#include "PackedVertex.h"
+#include "PreparedTexture.h"
 #include "tgaimage.h"
 using std::string;
 using std::vector;
 
+class VirtualTexture;
+
 #define MAX_BONE_INFLUENCE 4
 
 struct Vertex
@@ -33,6 +38,13 @@ struct Vertex
 	float m_Weights[MAX_BONE_INFLUENCE];
 };
 
+// a bone of the skeleton: its index in the bone palette and the matrix from mesh space to bone space
+struct BoneInfo
+{
+	int id;
+	glm::mat4 offset;
+};
+
 // texture represents a diffuse or specular maps
 struct Texture
 {
@@ -40,6 +52,19 @@ struct Texture
 	TGAImage data{};
 	string type{}; // "diffuse" or "specular"? 
 	string path{}; // we store the path of the texture to compare with other textures;
+	// data converted to the format of its type by Mesh::prepareTextures (data is then released)
+	PreparedTexture prepared{};
+	// the pages of the texture when it is streamed by a PageCache, which owns it (see VirtualTexture.h,
+	// data is then released)
+	const VirtualTexture* paged = nullptr;
+};
+
+// a simplified version of a mesh (see Lod.h): a shorter index buffer over the same vertices
+struct MeshLOD
+{
+	vector<unsigned int> indices;
+	// how far (mesh space) a simplified surface can be from the original one
+	float error = 0.f;
 };
 
 // a mesh represents a single drawable entity
@@ -51,14 +76,81 @@ public:
 	vector<unsigned int> indices; // for indexed drawing
 	vector<Texture> textures;
 	unsigned int VAO;
+	// axis aligned bounding box of the vertex positions (mesh space)
+	glm::vec3 aabbMin{0.f};
+	glm::vec3 aabbMax{0.f};
+	// true if at least one vertex is influenced by a bone
+	bool skinned = false;
+	// scratch buffer written by skinMesh() (see Skinning.h) each frame and reused across frames
+	vector<Vertex> skinnedVertices;
+	// levels of detail 1, 2, ... (increasingly coarse); level 0 is the mesh itself
+	vector<MeshLOD> lods;
+	// always rasterize this mesh into the occlusion buffer (see Occlusion.h)
+	bool occluder = false;
+	// bumped whenever the positions of drawVertices() change (skinMesh() does it), so caches built from them
+	// (e.g. shadow maps, see ShadowMap.h) know when to rebuild
+	unsigned geometryVersion = 0;
+	// world matrix of the mesh: where its node of the model hierarchy places it (see SceneHierarchy.h). The identity
+	// for skinned meshes: their bone palette places their vertices in model space (see Skinning.h)
+	glm::mat4 transform{1.f};
+	// compact copy of the vertices filled by pack() (see PackedVertex.h), `vertices` is then released
+	vector<PackedVertex> packedVertices;
+	// bounding rectangle of the texture coordinates (the range of the packed ones)
+	glm::vec2 uvMin{0.f};
+	glm::vec2 uvMax{0.f};
+	// texture coordinate units per mesh space unit: square root of the ratio of the UV area of the triangles to their
+	// area (virtual textures pick their mip from it, see VirtualTexture.h)
+	float uvDensity = 0.f;
 
 	// ??? Should we pass these vectors as const& 
 	Mesh(const vector<Vertex>& vertices, const vector<unsigned int>& indices, const vector<Texture>& textures);
 
+	// the vertices the vertex stage should read: the skinned ones for skinned meshes (empty for packed meshes)
+	const vector<Vertex>& drawVertices() const { return skinned ? skinnedVertices : vertices; }
+
+	// replaces the vertices by their packed version (quantized, octahedral normals, unorm16 UVs, see PackedVertex.h).
+	// Skinned meshes keep their vertices (bone influences are not packed): returns false for them
+	bool pack();
+	bool packed() const { return !packedVertices.empty(); }
+	size_t vertexCount() const { return packed() ? packedVertices.size() : vertices.size(); }
+
+	// converts every texture (but the paged ones) to the shader-ready format of its type (see PreparedTexture.h)
+	// and releases the TGA images; returns the bytes of texels afterwards
+	size_t prepareTextures();
+
+	// vertex i as the vertex stage reads it: the draw vertex, or the packed one decoded into scratch
+	const Vertex& fetch(size_t i, Vertex& scratch) const
+	{
+		if (!packed())
+			return drawVertices()[i];
+		scratch = unpack(i);
+		return scratch;
+	}
+	// position of vertex i (decoded for packed meshes)
+	glm::vec3 position(size_t i) const
+	{
+		if (!packed())
+			return drawVertices()[i].Position;
+		const PackedVertex& p = packedVertices[i];
+		return aabbMin + (aabbMax - aabbMin) * glm::vec3(packing::unorm16(p.position[0]), packing::unorm16(p.position[1]),
+		                                                 packing::unorm16(p.position[2]));
+	}
+
+	// the index buffer of a level of detail (level 0 and missing levels fall back to the closest one available)
+	const vector<unsigned int>& lodIndices(int level) const
+	{
+		if (level <= 0 || lods.empty())
+			return indices;
+		return lods[std::min<size_t>(level, lods.size()) - 1].indices;
+	}
+
 	// render the mesh
 	// we give a shader to the Draw function so that we can set several uniforms before drawing (like linking samplers to texture units).
 	// void Draw(Shader& shader);
 private:
+	// decodes packed vertex i
+	Vertex unpack(size_t i) const;
+
 	// render data 
 	unsigned int VBO, EBO;
 
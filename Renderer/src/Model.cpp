@@ -1,18 +1,22 @@
 ﻿#include "Model.h"
 
-#define STB_IMAGE_IMPLEMENTATION
 #include <iostream>
-#include <stb_image/stb_image.h>
 #include <assimp/postprocess.h>
 
+#include "ImageLoader.h"
 #include "tgaimage.h"
+#include "VirtualTexture.h"
 using std::cout;
 using std::endl;
 
+static glm::mat4 convertMatrixToGLMFormat(const aiMatrix4x4& from);
 
-Model::Model(string const& path, bool gamma) : gammaCorrection(gamma)
+
+Model::Model(string const& path, bool gamma, bool decodeTextures) : gammaCorrection(gamma)
 {
 	loadModel(path);
+	if (decodeTextures)
+		loadTextures();
 }
 
 Model::~Model()
@@ -33,8 +37,10 @@ void Model::loadModel(string const& path)
 	// create smooth normal vectors for each vertex if the model doesn't contain normal vectors 
 	// flip the texture coordinates on the y-axis because OpenGL expects the 0.0 coordinate on the y-axis to be on the bottom side of the image, but images usually have 0.0 at the top of the y-axis
 	// calculate the tangents and bitangents for the imported meshes.
+	// keep at most MAX_BONE_INFLUENCE (4, Assimp's default) bone weights per vertex, renormalized
 	const aiScene* scene = importer.ReadFile(
-		path, aiProcess_Triangulate | aiProcess_GenSmoothNormals | aiProcess_FlipUVs | aiProcess_CalcTangentSpace);
+		path, aiProcess_Triangulate | aiProcess_GenSmoothNormals | aiProcess_FlipUVs | aiProcess_CalcTangentSpace |
+		aiProcess_LimitBoneWeights);
 	// check for errors
 	if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) // if is Not Zero
 	{
@@ -46,13 +52,16 @@ void Model::loadModel(string const& path)
 
 	// process ASSIMP's root node recursively
 	processNode(scene->mRootNode, scene);
+	// place the meshes where their nodes are
+	hierarchy.update(meshes);
 }
 
-void Model::processNode(aiNode* node, const aiScene* scene)
+void Model::processNode(aiNode* node, const aiScene* scene, int parent)
 {
 	// Because each node (possibly) contains a set of children we want to first process the node in question, and then continue processing all the node's children and so on. 
 
 	// process each mesh located at the current node
+	uint32_t firstMesh = static_cast<uint32_t>(meshes.size());
 	for (unsigned int i = 0; i < node->mNumMeshes; i++)
 	{
 		// the node object only contains indices to index the actual objects in the scene. 
@@ -60,10 +69,13 @@ void Model::processNode(aiNode* node, const aiScene* scene)
 		aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
 		meshes.push_back(processMesh(mesh, scene));
 	}
+	// the node comes before its children in the flattened hierarchy, and its meshes are the ones just added
+	int index = hierarchy.addNode(node->mName.C_Str(), parent, convertMatrixToGLMFormat(node->mTransformation),
+	                              firstMesh, node->mNumMeshes);
 	// after we've processed all of the meshes (if any) we then recursively process each of the children nodes
 	for (unsigned int i = 0; i < node->mNumChildren; i++)
 	{
-		processNode(node->mChildren[i], scene);
+		processNode(node->mChildren[i], scene, index);
 	}
 
 
@@ -83,12 +95,15 @@ Mesh Model::processMesh(aiMesh* mesh, const aiScene* scene)
 	vector<Vertex> vertices;
 	vector<unsigned int> indices;
 	vector<Texture> textures;
+	vertices.reserve(mesh->mNumVertices);
+	indices.reserve(mesh->mNumFaces * 3);
 
 	// walk through each of the mesh's vertices
 	for (unsigned int i = 0; i < mesh->mNumVertices; i++)
 	{
 		// we create a vertex from Vertex struct that will be populated and later added to the vertices vector
 		Vertex vertex{};
+		setVertexBoneDataToDefault(vertex);
 
 		// Note: you can't directly assign mesh properties to glm, thus we need to assign them element by element 
 		// positions
@@ -128,6 +143,9 @@ Mesh Model::processMesh(aiMesh* mesh, const aiScene* scene)
 		vertices.push_back(vertex);
 	}
 
+	// bone IDs and weights are stored per bone in Assimp, not per vertex
+	extractBoneWeightForVertices(vertices, mesh, scene);
+
 	// Assimp defines each mesh as having an array of faces where each face represents a single primitive (due to aiProcess_Triangulate option, it's always triangle)
 	// now walk through each of the mesh's faces and retrieve the corresponding vertex indices.
 	for (unsigned int i = 0; i < mesh->mNumFaces; i++)
@@ -195,14 +213,9 @@ vector<Texture> Model::loadMaterialTextures(aiMaterial* mat, aiTextureType type,
 		}
 		if (!skip)
 		{
-			// if texture hasn't been loaded already, load it
+			// if texture hasn't been loaded already, load it (loadTextures() decodes all of them at the end)
 			Texture texture;
 			// texture.id = TextureFromFile(str.C_Str(), this->directory);
-			string filename = string(str.C_Str());
-			filename = directory + '/' + filename;
-			cout << "texture file " << filename << " loading " << (texture.data.read_tga_file(filename)
-				                                                       ? "ok"
-				                                                       : "failed") << endl;
 			texture.type = typeName;
 			texture.path = str.C_Str();
 			textures.push_back(texture);
@@ -213,6 +226,139 @@ vector<Texture> Model::loadMaterialTextures(aiMaterial* mat, aiTextureType type,
 	return textures;
 }
 
+void Model::loadTextures()
+{
+	vector<string> filenames;
+	for (const Texture& texture : textures_loaded)
+		filenames.push_back(directory + '/' + texture.path);
+	vector<TGAImage> images;
+	loadImages(filenames, images);
+	for (size_t i = 0; i < textures_loaded.size(); i++)
+	{
+		cout << "texture file " << filenames[i] << " loading " << (images[i].width() > 0 ? "ok" : "failed") << endl;
+		textures_loaded[i].data = std::move(images[i]);
+	}
+
+	// the meshes got a copy of each texture without its image
+	for (Mesh& mesh : meshes)
+	{
+		for (Texture& texture : mesh.textures)
+		{
+			for (const Texture& loaded : textures_loaded)
+			{
+				if (loaded.path == texture.path)
+				{
+					texture.data = loaded.data;
+					break;
+				}
+			}
+		}
+	}
+}
+
+size_t Model::pageTextures(PageCache& cache)
+{
+	size_t paged = 0;
+	for (Texture& texture : textures_loaded)
+	{
+		const string filename = directory + '/' + texture.path;
+		texture.paged = cache.open(filename, PreparedTexture::formatFor(texture.type), &texture.data);
+		if (texture.paged)
+		{
+			texture.data = TGAImage();
+			paged++;
+		}
+		else if (texture.data.width() == 0)
+		{
+			// not paged: decoded like loadTextures() does
+			loadImage(filename, texture.data);
+		}
+	}
+
+	for (Mesh& mesh : meshes)
+	{
+		for (Texture& texture : mesh.textures)
+		{
+			for (const Texture& loaded : textures_loaded)
+			{
+				if (loaded.path == texture.path)
+				{
+					texture.paged = loaded.paged;
+					texture.data = loaded.data;
+					break;
+				}
+			}
+		}
+	}
+	return paged;
+}
+
+// Assimp matrices are row-major, glm matrices are column-major
+static glm::mat4 convertMatrixToGLMFormat(const aiMatrix4x4& from)
+{
+	glm::mat4 to;
+	to[0][0] = from.a1; to[1][0] = from.a2; to[2][0] = from.a3; to[3][0] = from.a4;
+	to[0][1] = from.b1; to[1][1] = from.b2; to[2][1] = from.b3; to[3][1] = from.b4;
+	to[0][2] = from.c1; to[1][2] = from.c2; to[2][2] = from.c3; to[3][2] = from.c4;
+	to[0][3] = from.d1; to[1][3] = from.d2; to[2][3] = from.d3; to[3][3] = from.d4;
+	return to;
+}
+
+void Model::setVertexBoneDataToDefault(Vertex& vertex)
+{
+	for (int i = 0; i < MAX_BONE_INFLUENCE; i++)
+	{
+		vertex.m_BoneIDs[i] = -1;
+		vertex.m_Weights[i] = 0.0f;
+	}
+}
+
+void Model::setVertexBoneData(Vertex& vertex, int boneID, float weight)
+{
+	for (int i = 0; i < MAX_BONE_INFLUENCE; ++i)
+	{
+		if (vertex.m_BoneIDs[i] < 0)
+		{
+			vertex.m_Weights[i] = weight;
+			vertex.m_BoneIDs[i] = boneID;
+			return;
+		}
+	}
+	// more than MAX_BONE_INFLUENCE bones: drop the extra influence
+}
+
+void Model::extractBoneWeightForVertices(vector<Vertex>& vertices, aiMesh* mesh, const aiScene* scene)
+{
+	for (unsigned int boneIndex = 0; boneIndex < mesh->mNumBones; ++boneIndex)
+	{
+		int boneID;
+		string boneName = mesh->mBones[boneIndex]->mName.C_Str();
+		// bones can be shared by several meshes, give each name a single palette slot
+		auto it = boneInfoMap.find(boneName);
+		if (it == boneInfoMap.end())
+		{
+			BoneInfo newBoneInfo;
+			newBoneInfo.id = boneCounter;
+			newBoneInfo.offset = convertMatrixToGLMFormat(mesh->mBones[boneIndex]->mOffsetMatrix);
+			boneInfoMap[boneName] = newBoneInfo;
+			boneID = boneCounter;
+			boneCounter++;
+		}
+		else
+		{
+			boneID = it->second.id;
+		}
+
+		aiVertexWeight* weights = mesh->mBones[boneIndex]->mWeights;
+		for (unsigned int weightIndex = 0; weightIndex < mesh->mBones[boneIndex]->mNumWeights; ++weightIndex)
+		{
+			unsigned int vertexId = weights[weightIndex].mVertexId;
+			if (vertexId < vertices.size())
+				setVertexBoneData(vertices[vertexId], boneID, weights[weightIndex].mWeight);
+		}
+	}
+}
+
 // void Model::Draw(Shader& shader)
 // {
 // 	//  loops over each of the meshes to call their respective Draw function:
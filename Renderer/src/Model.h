@@ -2,12 +2,16 @@
 
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
+#include <map>
 #include <string>
 #include <vector>
 
 #include "Mesh.h"
+#include "SceneHierarchy.h"
 
-// loads a texture (with stb_image.h) and return the texture ID
+class PageCache;
+
+// loads a texture (with stb_image.h) and return the texture ID (images are decoded by ImageLoader.h now)
 // unsigned int TextureFromFile(const char* path, const string& directory, bool gamma = false);
 
 // a model that contains multiple meshes, possibly with multiple textures. 
@@ -17,17 +21,32 @@ public:
 	// stores all the textures loaded so far, optimization to make sure textures aren't loaded more than once.
 	vector<Texture> textures_loaded;
 	vector<Mesh> meshes;
+	// the node hierarchy of the file (node transforms and the meshes of each node)
+	SceneHierarchy hierarchy;
 	// store the directory of the file path that we'll later need when loading textures.
 	string directory;
 	bool gammaCorrection;
+	// all bones of all meshes by name; BoneInfo::id indexes the bone palette uniform (see Skinning.h)
+	std::map<string, BoneInfo> boneInfoMap;
+	int boneCounter = 0;
 
 	// constructor, expects a filepath to a 3D model.
 	// It then loads the file right away via the loadModel function
-	Model(string const& path, bool gamma = false);
+	// decodeTextures: decode the images of the textures too (see loadTextures), else only their paths are known
+	Model(string const& path, bool gamma = false, bool decodeTextures = true);
 
 	// responsible for freeing stb_image textures (needed for TinyOpenGL) 
 	~Model();
 
+	// decodes the images of all the textures found by loadMaterialTextures() (TGA, PNG, JPEG, ... see ImageLoader.h)
+	// in parallel and gives them to the meshes
+	void loadTextures();
+
+	// streams the textures through the page cache instead (see VirtualTexture.h): an image is only decoded when its
+	// page file has to be built, the textures that cannot be paged are decoded as usual.
+	// returns the number of textures paged
+	size_t pageTextures(PageCache& cache);
+
 	// draws the model, and thus all its meshes
 	// void Draw(Shader& shader);
 
@@ -39,7 +58,8 @@ private:
 	void loadModel(string const& path);
 
 	// processes a node in a recursive fashion. Processes each individual mesh located at the node and repeats this process on its children nodes (if any).
-	void processNode(aiNode* node, const aiScene* scene);
+	// parent: index of the node of the parent in the hierarchy (-1 for the root)
+	void processNode(aiNode* node, const aiScene* scene, int parent = -1);
 
 	// translates an aiMesh object to a mesh object of our own and return it 
 	Mesh processMesh(aiMesh* mesh, const aiScene* scene);
@@ -48,5 +68,12 @@ private:
 	// the required info is returned as a vector of Texture struct.
 	vector<Texture> loadMaterialTextures(aiMaterial* mat, aiTextureType type, string typeName);
 
+	// a vertex is not influenced by any bone until extractBoneWeightForVertices() says so
+	void setVertexBoneDataToDefault(Vertex& vertex);
+	// stores the bone in the first free influence slot of the vertex
+	void setVertexBoneData(Vertex& vertex, int boneID, float weight);
+	// registers the bones of the mesh and fills the bone IDs and weights of its vertices
+	void extractBoneWeightForVertices(vector<Vertex>& vertices, aiMesh* mesh, const aiScene* scene);
+
 	// -----------------------------------------
 };
@@ -0,0 +1,211 @@
+#include "Multisample.h"
+
+#include <algorithm>
+
+// standard sample positions (Direct3D), in 1/16 pixel from the pixel center (y down)
+static const int SAMPLES2[2][2] = {{4, 4}, {-4, -4}};
+static const int SAMPLES4[4][2] = {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+static const int SAMPLES8[8][2] = {{1, -3}, {-1, 3}, {5, 1}, {-3, -5}, {-5, 5}, {-7, -1}, {3, 7}, {7, -7}};
+
+MultisampleBuffer::MultisampleBuffer(int w, int h, int samples, DepthBuffer::Format depthFormat)
+	: w(w), h(h), nSamples(samples), tilesX((w + TILE_SIZE - 1) / TILE_SIZE), tilesY((h + TILE_SIZE - 1) / TILE_SIZE),
+	  tileCompressed(tilesX * tilesY)
+{
+	const int (*pattern)[2] = samples == 2 ? SAMPLES2 : samples == 4 ? SAMPLES4 : SAMPLES8;
+	if (samples != 2 && samples != 4)
+		nSamples = 8;
+	for (int s = 0; s < nSamples; s++)
+		positions[s] = glm::vec2(pattern[s][0], pattern[s][1]) / 16.f;
+
+	colors.reserve(nSamples);
+	depths.reserve(nSamples);
+	for (int s = 0; s < nSamples; s++)
+	{
+		colors.emplace_back(w, h);
+		depths.emplace_back(w, h, depthFormat);
+	}
+	clear();
+}
+
+void MultisampleBuffer::clear(std::uint32_t c)
+{
+	// the other planes are only read once their tile has been decompressed
+	colors[0].clear(c);
+	for (DepthBuffer& depth : depths)
+		depth.clear();
+	std::fill(tileCompressed.begin(), tileCompressed.end(), 1);
+}
+
+int MultisampleBuffer::compressedTiles() const
+{
+	return static_cast<int>(std::count(tileCompressed.begin(), tileCompressed.end(), 1));
+}
+
+void MultisampleBuffer::decompress(int x, int y)
+{
+	int tx = x / TILE_SIZE, ty = y / TILE_SIZE;
+	std::uint8_t& flag = tileCompressed[ty * tilesX + tx];
+	if (!flag)
+		return;
+	int x0 = tx * TILE_SIZE, x1 = std::min(w, x0 + TILE_SIZE);
+	for (int row = ty * TILE_SIZE; row < std::min(h, (ty + 1) * TILE_SIZE); row++)
+	{
+		for (int s = 1; s < nSamples; s++)
+			std::copy(colors[0].row(row) + x0, colors[0].row(row) + x1, colors[s].row(row) + x0);
+	}
+	flag = 0;
+}
+
+void MultisampleBuffer::resolve(Framebuffer& image) const
+{
+	for (int y = 0; y < h; y++)
+	{
+		for (int tx = 0; tx < tilesX; tx++)
+		{
+			int x0 = tx * TILE_SIZE, x1 = std::min(w, x0 + TILE_SIZE);
+			// compressed tiles are copied as is
+			if (tileCompressed[(y / TILE_SIZE) * tilesX + tx])
+			{
+				std::copy(colors[0].row(y) + x0, colors[0].row(y) + x1, image.row(y) + x0);
+				continue;
+			}
+			for (int x = x0; x < x1; x++)
+			{
+				// average each 8-bit channel: even and odd bytes are summed in separate 16-bit lanes
+				std::uint32_t first = colors[0].get(x, y);
+				std::uint64_t even = 0, odd = 0;
+				bool uniform = true;
+				for (int s = 0; s < nSamples; s++)
+				{
+					std::uint32_t p = colors[s].get(x, y);
+					uniform = uniform && p == first;
+					even += p & 0x00ff00ff;
+					odd += p >> 8 & 0x00ff00ff;
+				}
+				if (uniform)
+				{
+					image.set(x, y, first);
+					continue;
+				}
+				std::uint32_t p = 0;
+				for (int c = 0; c < 2; c++)
+				{
+					p |= static_cast<std::uint32_t>(((even >> (16 * c) & 0xffff) + nSamples / 2) / nSamples) << (16 * c);
+					p |= static_cast<std::uint32_t>(((odd >> (16 * c) & 0xffff) + nSamples / 2) / nSamples) << (16 * c + 8);
+				}
+				image.set(x, y, p);
+			}
+		}
+	}
+}
+
+void triangleMultisample(glm::vec4* hcp, IShader& shader, MultisampleBuffer& target)
+{
+	RasterTriangle tri;
+	if (!tri.setup(hcp, target.width(), target.height(), shader.v_Varyings, shader.nVaryings, true))
+	{
+		return;
+	}
+
+	const int nSamples = target.samples();
+	const uint32_t allSamples = (1u << nSamples) - 1;
+	// the depth format is the same for every sample plane
+	const bool reversedZ = target.depth(0).reversed();
+	const glm::vec3& keyPlane = reversedZ ? tri.oneOverWPlane : tri.depthPlane;
+	float varyings[MAX_VARYINGS];
+	float keys[MultisampleBuffer::MAX_SAMPLES];
+	// the planes at a sample are the planes at the pixel center plus a per-triangle offset
+	float edgeOffsets[MultisampleBuffer::MAX_SAMPLES][3];
+	float keyOffsets[MultisampleBuffer::MAX_SAMPLES];
+	for (int s = 0; s < nSamples; s++)
+	{
+		const glm::vec2& d = target.position(s);
+		for (int e = 0; e < 3; e++)
+			edgeOffsets[s][e] = tri.edge[e].x * d.x + tri.edge[e].y * d.y;
+		keyOffsets[s] = keyPlane.x * d.x + keyPlane.y * d.y;
+		target.depth(s).prepare(tri.x0, tri.x1, tri.y0, tri.y1);
+	}
+
+	for (uint32_t y = tri.y0; y <= tri.y1; ++y)
+	{
+		for (uint32_t x = tri.x0; x <= tri.x1; ++x)
+		{
+			// coverage and depth test of every sample
+			float cx = x + 0.5f, cy = y + 0.5f;
+			float w0 = RasterTriangle::eval(tri.edge[0], cx, cy);
+			float w1 = RasterTriangle::eval(tri.edge[1], cx, cy);
+			float w2 = RasterTriangle::eval(tri.edge[2], cx, cy);
+			float center = RasterTriangle::eval(keyPlane, cx, cy);
+			uint32_t passed = 0;
+			for (int s = 0; s < nSamples; s++)
+			{
+				if (w0 + edgeOffsets[s][0] < 0 || w1 + edgeOffsets[s][1] < 0 || w2 + edgeOffsets[s][2] < 0)
+				{
+					continue;
+				}
+				DepthBuffer& depth = target.depth(s);
+				keys[s] = depth.key(center + keyOffsets[s]);
+				if (keys[s] < depth.get(x, y))
+					passed |= 1u << s;
+			}
+			if (!passed)
+			{
+				continue;
+			}
+
+			// shade once, at the pixel center if the triangle covers it, otherwise at the first visible sample
+			// (so the varyings are never extrapolated outside of the triangle)
+			float px = cx, py = cy;
+			if (w0 < 0 || w1 < 0 || w2 < 0)
+			{
+				int s = 0;
+				while (!(passed >> s & 1))
+					s++;
+				px += target.position(s).x;
+				py += target.position(s).y;
+			}
+			glm::vec4 gl_FragCoord(px, py, RasterTriangle::eval(tri.depthPlane, px, py),
+			                       RasterTriangle::eval(tri.oneOverWPlane, px, py));
+			tri.interpolate(gl_FragCoord, varyings);
+			TGAColor color;
+			if (shader.fragment(gl_FragCoord, varyings, color))
+			{
+				// fragment shader can discard this pixel
+				continue;
+			}
+			std::uint32_t packed = Framebuffer::pack(color);
+
+			// a pixel whose samples all get the same color keeps its tile compressed
+			if (passed != allSamples)
+				target.decompress(x, y);
+			for (int s = 0; s < nSamples; s++)
+			{
+				if (passed >> s & 1)
+					target.depth(s).set(x, y, keys[s]);
+			}
+			if (target.compressed(x, y))
+			{
+				target.color(0).set(x, y, packed);
+				continue;
+			}
+			for (int s = 0; s < nSamples; s++)
+			{
+				if (passed >> s & 1)
+					target.color(s).set(x, y, packed);
+			}
+		}
+	}
+}
+
+void drawElements(const Mesh& mesh, IShader& shader, MultisampleBuffer& target, int lod)
+{
+	const vector<unsigned int>& indices = mesh.lodIndices(lod);
+	Vertex scratch;
+	for (size_t i = 0; i < indices.size(); i += 3)
+	{
+		glm::vec4 homogeneousClipSpace[3];
+		for (int j = 0; j < 3; j++)
+			shader.vertex(mesh.fetch(indices[i + j], scratch), j, homogeneousClipSpace[j]);
+		triangleMultisample(homogeneousClipSpace, shader, target);
+	}
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "tinyOpenGL.h"
+
+// Multisample anti-aliasing: every pixel has SAMPLES (2, 4 or 8) coverage/depth samples at the standard
+// D3D positions, but triangleMultisample() runs the fragment shader only once per pixel and triangle
+// (at the pixel center) and writes the color to the covered samples that pass the depth test.
+// resolve() averages the samples into a Framebuffer.
+// Color is compressed by tile: while every pixel of a TILE_SIZE x TILE_SIZE tile has identical samples
+// (no triangle edge crossed it) only the first sample plane is read and written.
+class MultisampleBuffer
+{
+public:
+	static constexpr int TILE_SIZE = DepthBuffer::TILE_SIZE;
+	static constexpr int MAX_SAMPLES = 8;
+
+	// samples: 2, 4 or 8 (any other count gives 8)
+	MultisampleBuffer(int w, int h, int samples, DepthBuffer::Format depthFormat = DepthBuffer::FLOAT32);
+
+	int width() const { return w; }
+	int height() const { return h; }
+	int samples() const { return nSamples; }
+	// offset of a sample from the pixel center (in pixels)
+	const glm::vec2& position(int s) const { return positions[s]; }
+
+	// fills every sample with a packed color and the far plane, all tiles become compressed
+	void clear(std::uint32_t c = 0);
+
+	// averages the samples of every pixel
+	void resolve(Framebuffer& image) const;
+
+	// number of tiles currently stored compressed
+	int compressedTiles() const;
+
+	// sample planes (same layout as Framebuffer/DepthBuffer)
+	Framebuffer& color(int s) { return colors[s]; }
+	DepthBuffer& depth(int s) { return depths[s]; }
+
+	bool compressed(int x, int y) const { return tileCompressed[(y / TILE_SIZE) * tilesX + x / TILE_SIZE] != 0; }
+	// copies the first sample of every pixel of the tile containing (x, y) to the other samples
+	void decompress(int x, int y);
+
+private:
+	int w;
+	int h;
+	int nSamples;
+	glm::vec2 positions[MAX_SAMPLES];
+	std::vector<Framebuffer> colors;
+	std::vector<DepthBuffer> depths;
+	int tilesX;
+	int tilesY;
+	std::vector<std::uint8_t> tileCompressed;
+};
+
+// triangle() for a multisample target: coverage and depth per sample, shading per pixel (IShader::fragment)
+void triangleMultisample(glm::vec4* hcp, IShader& shader, MultisampleBuffer& target);
+
+// drawElements() into a multisample target
+void drawElements(const Mesh& mesh, IShader& shader, MultisampleBuffer& target, int lod = 0);
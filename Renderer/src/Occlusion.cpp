@@ -0,0 +1,189 @@
+#include "Occlusion.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "FrameArena.h"
+#include "tinyOpenGL.h"
+
+// vertices closer than this (clip space w) are considered behind the camera
+static const float NEAR_W = 1e-5f;
+
+OcclusionBuffer::OcclusionBuffer(int width, int height)
+	: w((width + TILE_WIDTH - 1) / TILE_WIDTH * TILE_WIDTH), h((height + TILE_HEIGHT - 1) / TILE_HEIGHT * TILE_HEIGHT),
+	  tilesX(w / TILE_WIDTH), tilesY(h / TILE_HEIGHT), tiles(tilesX * tilesY)
+{
+	clear();
+}
+
+void OcclusionBuffer::clear()
+{
+	Tile empty;
+	empty.zMax0 = std::numeric_limits<float>::max();
+	empty.zMax1 = -std::numeric_limits<float>::max();
+	empty.mask = 0;
+	std::fill(tiles.begin(), tiles.end(), empty);
+	tested = 0;
+	culled = 0;
+}
+
+// 2D bounding rectangle (raster space) and nearest depth of a box, false if a corner is behind the camera
+static bool projectBox(const glm::mat4& mvp, const glm::vec3& aabbMin, const glm::vec3& aabbMax, int w, int h,
+                       glm::vec2& rectMin, glm::vec2& rectMax, float& zMin)
+{
+	rectMin = glm::vec2(std::numeric_limits<float>::max());
+	rectMax = glm::vec2(-std::numeric_limits<float>::max());
+	zMin = std::numeric_limits<float>::max();
+	for (int corner = 0; corner < 8; corner++)
+	{
+		glm::vec4 p = mvp * glm::vec4(corner & 1 ? aabbMax.x : aabbMin.x,
+		                              corner & 2 ? aabbMax.y : aabbMin.y,
+		                              corner & 4 ? aabbMax.z : aabbMin.z, 1.f);
+		if (p.w <= NEAR_W)
+			return false;
+		// same viewport transform as RasterTriangle::setup
+		glm::vec2 raster((p.x / p.w + 1) / 2 * w, (1 - p.y / p.w) / 2 * h);
+		rectMin = glm::min(rectMin, raster);
+		rectMax = glm::max(rectMax, raster);
+		zMin = std::min(zMin, p.z / p.w);
+	}
+	return true;
+}
+
+bool OcclusionBuffer::isOccluder(const Mesh& mesh, const glm::mat4& mvp) const
+{
+	if (mesh.occluder)
+		return true;
+	glm::vec2 rectMin, rectMax;
+	float zMin;
+	// a box around the camera covers the whole screen, but its triangles would cross the near plane anyway
+	if (!projectBox(mvp, mesh.aabbMin, mesh.aabbMax, w, h, rectMin, rectMax, zMin))
+		return false;
+	rectMin = glm::clamp(rectMin, glm::vec2(0.f), glm::vec2(w, h));
+	rectMax = glm::clamp(rectMax, glm::vec2(0.f), glm::vec2(w, h));
+	glm::vec2 size = rectMax - rectMin;
+	return size.x * size.y >= OCCLUDER_MIN_AREA * w * h;
+}
+
+void OcclusionBuffer::drawOccluder(const Mesh& mesh, const glm::mat4& mvp)
+{
+	// transform each vertex once, indices share them
+	FrameVector<glm::vec4> clip(mesh.vertexCount());
+	for (size_t i = 0; i < clip.size(); i++)
+		clip[i] = mvp * glm::vec4(mesh.position(i), 1.f);
+
+	for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3)
+	{
+		glm::vec4 hcp[3] = {clip[mesh.indices[i]], clip[mesh.indices[i + 1]], clip[mesh.indices[i + 2]]};
+		drawTriangle(hcp);
+	}
+}
+
+void OcclusionBuffer::updateTile(Tile& tile, uint32_t coverage, float zTriMax) const
+{
+	// the working layer is thrown away when the new triangle is closer to the committed layer than to it:
+	// merging them would push the working layer depth too far back
+	if (tile.mask != 0 && zTriMax - tile.zMax1 > tile.zMax0 - zTriMax)
+	{
+		tile.zMax1 = -std::numeric_limits<float>::max();
+		tile.mask = 0;
+	}
+	tile.zMax1 = std::max(tile.zMax1, zTriMax);
+	tile.mask |= coverage;
+	// the whole tile is covered: the working layer becomes the committed one
+	if (tile.mask == 0xffffffff)
+	{
+		tile.zMax0 = std::min(tile.zMax0, tile.zMax1);
+		tile.zMax1 = -std::numeric_limits<float>::max();
+		tile.mask = 0;
+	}
+}
+
+void OcclusionBuffer::drawTriangle(const glm::vec4* hcp)
+{
+	if (hcp[0].w <= NEAR_W || hcp[1].w <= NEAR_W || hcp[2].w <= NEAR_W)
+		return;
+	RasterTriangle tri;
+	if (!tri.setup(hcp, w, h))
+		return;
+	float zTriMin = std::min(tri.raster[0].z, std::min(tri.raster[1].z, tri.raster[2].z));
+	float zTriMax = std::max(tri.raster[0].z, std::max(tri.raster[1].z, tri.raster[2].z));
+
+	for (uint32_t ty = tri.y0 / TILE_HEIGHT; ty <= tri.y1 / TILE_HEIGHT; ty++)
+	{
+		for (uint32_t tx = tri.x0 / TILE_WIDTH; tx <= tri.x1 / TILE_WIDTH; tx++)
+		{
+			Tile& tile = tiles[ty * tilesX + tx];
+			// entirely behind what is already there
+			if (zTriMin >= tile.zMax0)
+				continue;
+
+			// one bit per covered pixel center, row by row
+			uint32_t coverage = 0;
+			float tileX = static_cast<float>(tx * TILE_WIDTH);
+			for (int row = 0; row < TILE_HEIGHT; row++)
+			{
+				vfloat py(ty * TILE_HEIGHT + row + 0.5f);
+				for (int x = 0; x < TILE_WIDTH; x += SIMD_WIDTH)
+				{
+					vfloat px = vfloat::ramp(tileX + x + 0.5f);
+					vfloat covered = (tri.edge[0].x * px + tri.edge[0].y * py + tri.edge[0].z >= 0.f)
+						& (tri.edge[1].x * px + tri.edge[1].y * py + tri.edge[1].z >= 0.f)
+						& (tri.edge[2].x * px + tri.edge[2].y * py + tri.edge[2].z >= 0.f);
+					coverage |= static_cast<uint32_t>(movemask(covered)) << (row * TILE_WIDTH + x);
+				}
+			}
+			if (coverage == 0)
+				continue;
+
+			// farthest depth of the triangle inside the tile: the depth plane is extremal at a tile corner
+			float x0 = tileX, x1 = tileX + TILE_WIDTH;
+			float y0 = static_cast<float>(ty * TILE_HEIGHT), y1 = y0 + TILE_HEIGHT;
+			float zTile = std::max(std::max(RasterTriangle::eval(tri.depthPlane, x0, y0), RasterTriangle::eval(tri.depthPlane, x1, y0)),
+			                       std::max(RasterTriangle::eval(tri.depthPlane, x0, y1), RasterTriangle::eval(tri.depthPlane, x1, y1)));
+			updateTile(tile, coverage, std::min(zTile, zTriMax));
+		}
+	}
+}
+
+bool OcclusionBuffer::testBox(const glm::mat4& mvp, const glm::vec3& aabbMin, const glm::vec3& aabbMax)
+{
+	tested++;
+	glm::vec2 rectMin, rectMax;
+	float zMin;
+	if (!projectBox(mvp, aabbMin, aabbMax, w, h, rectMin, rectMax, zMin))
+		return true;
+	// outside of the screen: that is for frustum culling to decide
+	if (rectMax.x < 0 || rectMax.y < 0 || rectMin.x >= w || rectMin.y >= h)
+		return true;
+
+	// pixels whose center is inside the rectangle (a box smaller than a pixel center is still tested against its pixel)
+	int x0 = std::max(0, static_cast<int>(std::floor(rectMin.x)));
+	int x1 = std::min(w - 1, static_cast<int>(std::floor(rectMax.x)));
+	int y0 = std::max(0, static_cast<int>(std::floor(rectMin.y)));
+	int y1 = std::min(h - 1, static_cast<int>(std::floor(rectMax.y)));
+
+	for (int ty = y0 / TILE_HEIGHT; ty <= y1 / TILE_HEIGHT; ty++)
+	{
+		for (int tx = x0 / TILE_WIDTH; tx <= x1 / TILE_WIDTH; tx++)
+		{
+			const Tile& tile = tiles[ty * tilesX + tx];
+			// behind every pixel of the tile
+			if (zMin >= tile.zMax0)
+				continue;
+			// or behind the working layer, which covers all pixels of the rectangle inside this tile
+			uint32_t rect = 0;
+			for (int y = std::max(y0, ty * TILE_HEIGHT); y <= std::min(y1, ty * TILE_HEIGHT + TILE_HEIGHT - 1); y++)
+			{
+				for (int x = std::max(x0, tx * TILE_WIDTH); x <= std::min(x1, tx * TILE_WIDTH + TILE_WIDTH - 1); x++)
+					rect |= 1u << ((y - ty * TILE_HEIGHT) * TILE_WIDTH + x - tx * TILE_WIDTH);
+			}
+			if ((rect & ~tile.mask) == 0 && zMin >= tile.zMax1)
+				continue;
+			return true;
+		}
+	}
+	culled++;
+	return false;
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "Mesh.h"
+
+// Masked software occlusion culling.
+// Occluders (big meshes: walls, floors, bodies) are rasterized into a small depth buffer first, then the bounding box
+// of every mesh (or instance) is tested against it, so hidden ones skip the vertex and raster work entirely.
+// The buffer does not store a depth per pixel: each TILE_WIDTH x TILE_HEIGHT tile keeps
+// - zMax0: the farthest depth of the tile once it has been fully covered
+// - zMax1 + mask: the farthest depth of the pixels covered since (one bit per pixel)
+// and the two layers are merged when the mask is full (Andersson et al., "Masked Software Occlusion Culling").
+// Depths are NDC depths like in DepthBuffer, a box is hidden if its nearest depth is behind every pixel it overlaps.
+class OcclusionBuffer
+{
+public:
+	// one tile has 32 pixels: 8 per row, so a row is a single AVX2 packet (2 SSE packets)
+	static constexpr int TILE_WIDTH = 8;
+	static constexpr int TILE_HEIGHT = 4;
+	// meshes covering at least this fraction of the screen are used as occluders (see isOccluder)
+	static constexpr float OCCLUDER_MIN_AREA = 0.05f;
+
+	// the size is rounded up to whole tiles
+	OcclusionBuffer(int width = 256, int height = 128);
+
+	int width() const { return w; }
+	int height() const { return h; }
+
+	// reset the depth and the statistics (call it before every frame)
+	void clear();
+
+	// should this mesh (drawn with mvp) be rasterized as an occluder? designated meshes (Mesh::occluder) always are,
+	// the others are picked when their bounding box covers a large part of the screen
+	bool isOccluder(const Mesh& mesh, const glm::mat4& mvp) const;
+
+	// rasterize all triangles of the mesh transformed by mvp (no shader)
+	void drawOccluder(const Mesh& mesh, const glm::mat4& mvp);
+	// rasterize a triangle given in homogeneous clip space.
+	// Triangles crossing the near plane are skipped: missing occluders only make the culling less effective
+	void drawTriangle(const glm::vec4* hcp);
+
+	// is the box [aabbMin, aabbMax] transformed by mvp possibly visible? (false: hidden by the occluders)
+	// every call counts in the statistics
+	bool testBox(const glm::mat4& mvp, const glm::vec3& aabbMin, const glm::vec3& aabbMax);
+
+	// statistics since the last clear(): number of boxes tested and found hidden
+	size_t tested = 0;
+	size_t culled = 0;
+
+private:
+	struct Tile
+	{
+		float zMax0;
+		float zMax1;
+		uint32_t mask;
+	};
+
+	void updateTile(Tile& tile, uint32_t coverage, float zTriMax) const;
+
+	int w;
+	int h;
+	int tilesX;
+	int tilesY;
+	std::vector<Tile> tiles;
+};
@@ -0,0 +1,55 @@
+#include "PackedVertex.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace packing
+{
+	std::uint16_t unorm16(float v)
+	{
+		return static_cast<std::uint16_t>(std::min(std::max(v, 0.f), 1.f) * 65535.f + 0.5f);
+	}
+
+	static std::int16_t snorm16(float v)
+	{
+		return static_cast<std::int16_t>(std::lround(std::min(std::max(v, -1.f), 1.f) * 32767.f));
+	}
+
+	// sign that is never 0
+	static float signNotZero(float v)
+	{
+		return v >= 0.f ? 1.f : -1.f;
+	}
+
+	void octEncode(const glm::vec3& v, std::int16_t out[2])
+	{
+		float l1 = std::abs(v.x) + std::abs(v.y) + std::abs(v.z);
+		if (l1 == 0.f)
+		{
+			out[0] = out[1] = 0;
+			return;
+		}
+		// project onto the octahedron |x| + |y| + |z| = 1, then fold the lower half over the upper one
+		float x = v.x / l1, y = v.y / l1;
+		if (v.z < 0.f)
+		{
+			float fx = (1.f - std::abs(y)) * signNotZero(x);
+			float fy = (1.f - std::abs(x)) * signNotZero(y);
+			x = fx;
+			y = fy;
+		}
+		out[0] = snorm16(x);
+		out[1] = snorm16(y);
+	}
+
+	glm::vec3 octDecode(const std::int16_t in[2])
+	{
+		float x = std::max(in[0] / 32767.f, -1.f), y = std::max(in[1] / 32767.f, -1.f);
+		glm::vec3 v(x, y, 1.f - std::abs(x) - std::abs(y));
+		// unfold the lower half
+		float t = std::max(-v.z, 0.f);
+		v.x += v.x >= 0.f ? -t : t;
+		v.y += v.y >= 0.f ? -t : t;
+		return glm::normalize(v);
+	}
+}
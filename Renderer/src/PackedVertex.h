@@ -0,0 +1,31 @@
+#pragma once
+#include <cstdint>
+
+#include <glm/glm.hpp>
+
+// Compact vertex format for meshes kept resident in memory (see Mesh::pack):
+// - position: 16-bit unsigned per axis, relative to the axis aligned bounding box of the mesh
+// - normal, tangent: octahedral encoding (the unit sphere unfolded onto a square), 2 x 16-bit snorm each;
+//   the lowest bit of the tangent stores the sign of the bitangent (bitangent = sign * cross(normal, tangent))
+// - texture coordinates: 16-bit unsigned, relative to the bounding rectangle of the texture coordinates of the mesh
+//   (half floats would have the same size, but only 11 bits of precision in [0.5, 1): half a texel of a 1024 map)
+// 18 bytes instead of the 88 bytes of Vertex. Bone influences are not stored: skinned meshes are never packed.
+struct PackedVertex
+{
+	std::uint16_t position[3];
+	std::int16_t normal[2];
+	std::int16_t tangent[2];
+	std::uint16_t texCoords[2];
+};
+
+// the conversions of the format (exposed for the mesh code)
+namespace packing
+{
+	// [0, 1] <-> 16-bit unsigned
+	std::uint16_t unorm16(float v);
+	inline float unorm16(std::uint16_t v) { return v * (1.f / 65535.f); }
+
+	// unit vector <-> 2 snorm16 (zero vectors decode to +z)
+	void octEncode(const glm::vec3& v, std::int16_t out[2]);
+	glm::vec3 octDecode(const std::int16_t in[2]);
+}
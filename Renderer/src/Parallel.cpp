@@ -0,0 +1,86 @@
+#include "Parallel.h"
+
+// the worker the calling thread is while it runs items of a loop (-1: none)
+static thread_local int32_t CurrentWorker = -1;
+
+WorkerPool& WorkerPool::instance()
+{
+	static WorkerPool pool;
+	return pool;
+}
+
+WorkerPool::WorkerPool()
+{
+	uint32_t n = std::max(1u, std::thread::hardware_concurrency());
+	for (uint32_t worker = 1; worker < n; worker++)
+		threads.emplace_back(&WorkerPool::loop, this, worker);
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (std::thread& thread : threads)
+		thread.join();
+}
+
+void WorkerPool::run(uint32_t n, void (*fn)(void*, uint32_t, uint32_t), void* ctx)
+{
+	if (n == 0)
+		return;
+	if (CurrentWorker >= 0)
+	{
+		// nested loop: the other workers are busy with the outer one
+		for (uint32_t i = 0; i < n; i++)
+			fn(ctx, i, static_cast<uint32_t>(CurrentWorker));
+		return;
+	}
+
+	std::lock_guard<std::mutex> loopTurn(turn);
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		count = n;
+		body = fn;
+		context = ctx;
+		next = 0;
+		busy = static_cast<uint32_t>(threads.size());
+		generation++;
+	}
+	wake.notify_all();
+	// the calling thread works too
+	work(0);
+	std::unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [&] { return busy == 0; });
+}
+
+void WorkerPool::work(uint32_t worker)
+{
+	CurrentWorker = static_cast<int32_t>(worker);
+	for (uint32_t i = next++; i < count; i = next++)
+		body(context, i, worker);
+	CurrentWorker = -1;
+}
+
+void WorkerPool::loop(uint32_t worker)
+{
+	uint64_t seen = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&] { return stopping || generation != seen; });
+			if (stopping)
+				return;
+			seen = generation;
+		}
+		work(worker);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--busy == 0)
+				done.notify_one();
+		}
+	}
+}
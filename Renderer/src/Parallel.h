@@ -0,0 +1,72 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// the threads behind parallelFor(): one per hardware thread (the calling thread being one of them), started on first
+// use and kept until the program exits, so a parallel loop neither creates threads nor allocates.
+// A loop started from inside a loop runs on the calling thread; loops started by two threads at once take turns
+class WorkerPool
+{
+public:
+	static WorkerPool& instance();
+
+	~WorkerPool();
+
+	// number of workers, the calling thread included
+	uint32_t size() const { return static_cast<uint32_t>(threads.size()) + 1; }
+
+	// runs body(context, i, worker) for every i in [0, count) on all workers; worker (in [0, size())) tells which one
+	// runs item i, so that the workers can keep their own state. Items are handed out one at a time through an atomic
+	// counter, so uneven items (e.g. tiles) stay balanced
+	void run(uint32_t count, void (*body)(void*, uint32_t, uint32_t), void* context);
+
+private:
+	WorkerPool();
+
+	void work(uint32_t worker);
+	void loop(uint32_t worker);
+
+	std::vector<std::thread> threads;
+	// one loop at a time
+	std::mutex turn;
+
+	std::mutex mutex;
+	// signaled when a loop starts (or on shutdown) and when the last worker is done with it
+	std::condition_variable wake;
+	std::condition_variable done;
+	bool stopping = false;
+	uint64_t generation = 0;
+	uint32_t busy = 0;
+
+	// the current loop
+	uint32_t count = 0;
+	void (*body)(void*, uint32_t, uint32_t) = nullptr;
+	void* context = nullptr;
+	std::atomic<uint32_t> next{0};
+};
+
+// runs fn(i) for every i in [0, count) on all hardware threads (see WorkerPool)
+template <typename Fn>
+void parallelFor(uint32_t count, Fn fn)
+{
+	auto body = [](void* context, uint32_t i, uint32_t) { (*static_cast<Fn*>(context))(i); };
+	WorkerPool::instance().run(count, body, &fn);
+}
+
+// same as parallelFor(), with fn(i, worker): worker is in [0, parallelWorkers())
+template <typename Fn>
+void parallelForWorkers(uint32_t count, Fn fn)
+{
+	auto body = [](void* context, uint32_t i, uint32_t worker) { (*static_cast<Fn*>(context))(i, worker); };
+	WorkerPool::instance().run(count, body, &fn);
+}
+
+inline uint32_t parallelWorkers()
+{
+	return WorkerPool::instance().size();
+}
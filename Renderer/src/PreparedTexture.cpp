@@ -0,0 +1,130 @@
+#include "PreparedTexture.h"
+
+#include <cstring>
+
+#include "PackedVertex.h"
+
+PreparedTexture::Format PreparedTexture::formatFor(const std::string& type)
+{
+	if (type == "texture_normal")
+		return OCT16;
+	if (type == "texture_specular" || type == "texture_gloss" || type == "texture_glow" || type == "texture_height")
+		return R8;
+	return RGBA8;
+}
+
+PreparedTexture::PreparedTexture(const TGAImage& img, Format format)
+	: w(img.width()), h(img.height()), fmt(format)
+{
+	const size_t n = static_cast<size_t>(w) * h;
+	if (fmt == R8)
+	{
+		bytes8 = AlignedBuffer<std::uint8_t>(n + 3);
+		std::memset(bytes8.data() + n, 0, 3);
+	}
+	else if (fmt != NONE)
+	{
+		texels = AlignedBuffer<std::uint32_t>(n);
+	}
+
+	for (int y = 0; y < h; y++)
+	{
+		for (int x = 0; x < w; x++)
+		{
+			const size_t i = static_cast<size_t>(y) * w + x;
+			TGAColor c = img.get(x, y);
+			if (fmt == RGBA8)
+			{
+				texels[i] = Framebuffer::pack(c);
+			}
+			else if (fmt == R8)
+			{
+				bytes8[i] = c[0];
+			}
+			else if (fmt == OCT16)
+			{
+				// [0, 255] -> [-1, 1], like the shaders did per fragment
+				glm::vec3 n = glm::vec3(c[0], c[1], c[2]) * 2.f / 255.f - glm::vec3(1.f, 1.f, 1.f);
+				std::int16_t oct[2];
+				packing::octEncode(n, oct);
+				std::memcpy(&texels[i], oct, sizeof(oct));
+			}
+		}
+	}
+}
+
+int PreparedTexture::index(const glm::vec2& uv) const
+{
+	// same truncation as sample2D (through the int parameters of TGAImage::get)
+	int x = static_cast<int>(uv[0] * w), y = static_cast<int>(uv[1] * h);
+	if (x < 0 || y < 0 || x >= w || y >= h)
+		return -1;
+	return y * w + x;
+}
+
+vint PreparedTexture::index(const vfloat& u, const vfloat& v, const vfloat& active, vfloat& mask) const
+{
+	vfloat xf = u * static_cast<float>(w);
+	vfloat yf = v * static_cast<float>(h);
+	mask = active & (xf > -1.f) & (xf < static_cast<float>(w)) & (yf > -1.f) & (yf < static_cast<float>(h));
+	return toInt(yf) * vint(w) + toInt(xf);
+}
+
+TGAColor PreparedTexture::color(const glm::vec2& uv) const
+{
+	int i = index(uv);
+	return i < 0 ? TGAColor() : Framebuffer::unpack(texels[i]);
+}
+
+vint PreparedTexture::color(const vfloat& u, const vfloat& v, const vfloat& active) const
+{
+	vfloat mask;
+	vint i = index(u, v, active, mask);
+	return gather(texels.data(), i, mask);
+}
+
+std::uint8_t PreparedTexture::r8(const glm::vec2& uv) const
+{
+	int i = index(uv);
+	return i < 0 ? 0 : bytes8[i];
+}
+
+vfloat PreparedTexture::r8(const vfloat& u, const vfloat& v, const vfloat& active) const
+{
+	vfloat mask;
+	vint i = index(u, v, active, mask);
+	return toFloat(gather(bytes8.data(), i, mask));
+}
+
+glm::vec3 PreparedTexture::normal(const glm::vec2& uv) const
+{
+	int i = index(uv);
+	// a texel outside the image is black, which decodes to (-1, -1, -1)
+	if (i < 0)
+		return glm::vec3(-1.f);
+	std::int16_t oct[2];
+	std::memcpy(oct, &texels[i], sizeof(oct));
+	return packing::octDecode(oct);
+}
+
+vvec3 PreparedTexture::normal(const vfloat& u, const vfloat& v, const vfloat& active) const
+{
+	vfloat mask;
+	vint i = index(u, v, active, mask);
+	return decodeNormals(gather(texels.data(), i, mask), mask);
+}
+
+vvec3 PreparedTexture::decodeNormals(const vint& t, const vfloat& mask)
+{
+	// the snorm16 pair sits in the upper half of an int32: converted to float, it is scaled by 2^16
+	const float k = 1.f / (32767.f * 65536.f);
+	vfloat x = max(toFloat(t << 16) * k, -1.f);
+	vfloat y = max(toFloat(t & vint(static_cast<int32_t>(0xffff0000u))) * k, -1.f);
+	vfloat z = 1.f - abs(x) - abs(y);
+	// unfold the lower half (see packing::octDecode)
+	vfloat fold = max(-z, 0.f);
+	x = select(x >= 0.f, x - fold, x + fold);
+	y = select(y >= 0.f, y - fold, y + fold);
+	const vfloat outside(-1.f);
+	return vvec3(select(mask, x, outside), select(mask, y, outside), select(mask, z, outside));
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+#include <glm/glm.hpp>
+
+#include "Framebuffer.h"
+#include "Simd.h"
+#include "tgaimage.h"
+
+// texture converted once, when the material is loaded, to the format its role needs in the shaders
+// (see Mesh::prepareTextures), instead of the 1, 3 or 4 bytes per texel of the TGA file:
+// - RGBA8: packed BGRA texels (Framebuffer::pack), fetched with one gather whatever the file format
+// - R8: one byte (the first channel) for the maps the shaders read a single value from (specular, gloss, glow, ...)
+// - OCT16: unit vectors stored as 2 x 16-bit snorm octahedral coordinates (see PackedVertex.h), the [0, 255] to
+//   [-1, 1] conversion of normal maps is done here instead of once per fragment
+// Lookups follow the rules of IShader::sample2D: coordinates are truncated and texels outside the image
+// are black (0, or (-1, -1, -1) for normals).
+class PreparedTexture
+{
+public:
+	enum Format { NONE, RGBA8, R8, OCT16 };
+
+	// format of a texture of type "texture_diffuse", "texture_normal", ... (see Model::loadMaterialTextures)
+	static Format formatFor(const std::string& type);
+
+	PreparedTexture() = default;
+	PreparedTexture(const TGAImage& img, Format format);
+
+	int width() const { return w; }
+	int height() const { return h; }
+	Format format() const { return fmt; }
+	bool empty() const { return fmt == NONE; }
+	// the texels in rows (4 bytes per texel, 1 for R8)
+	const std::uint8_t* data() const
+	{
+		return fmt == R8 ? bytes8.data() : reinterpret_cast<const std::uint8_t*>(texels.data());
+	}
+	// memory used by the texels
+	size_t bytes() const { return texels.size() * sizeof(std::uint32_t) + bytes8.size(); }
+
+	// RGBA8
+	TGAColor color(const glm::vec2& uv) const;
+	vint color(const vfloat& u, const vfloat& v, const vfloat& active) const;
+	// R8
+	std::uint8_t r8(const glm::vec2& uv) const;
+	vfloat r8(const vfloat& u, const vfloat& v, const vfloat& active) const;
+	// OCT16: the direction of the texel, not normalized by the packet version (the shaders normalize it anyway
+	// once it is transformed)
+	glm::vec3 normal(const glm::vec2& uv) const;
+	vvec3 normal(const vfloat& u, const vfloat& v, const vfloat& active) const;
+	// directions of OCT16 texels fetched for the lanes of mask, (-1, -1, -1) for the other lanes
+	static vvec3 decodeNormals(const vint& texels, const vfloat& mask);
+
+private:
+	// index of the texel at uv, or -1 outside the image
+	int index(const glm::vec2& uv) const;
+	vint index(const vfloat& u, const vfloat& v, const vfloat& active, vfloat& mask) const;
+
+	int w = 0;
+	int h = 0;
+	Format fmt = NONE;
+	// RGBA8 and OCT16 texels
+	AlignedBuffer<std::uint32_t> texels;
+	// R8 texels (+ 3 bytes of padding: gather(const uint8_t*, ...) reads 4 bytes per lane)
+	AlignedBuffer<std::uint8_t> bytes8;
+};
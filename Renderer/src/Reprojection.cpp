@@ -0,0 +1,124 @@
+#include "Reprojection.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+#include "Parallel.h"
+
+// the rows of every buffer are laid out like the rows of the visibility buffer (see DepthBuffer)
+ReprojectionCache::ReprojectionCache(int w, int h)
+	: width(w), height(h), pitch((w + DepthBuffer::TILE_SIZE - 1) / DepthBuffer::TILE_SIZE * DepthBuffer::TILE_SIZE),
+	  ids(pitch * h, VisibilityBuffer::EMPTY), depth(pitch * h), color(w, h), age(pitch * h), viewProjection(1.f),
+	  shade(pitch * h), nextAge(pitch * h), nextViewProjection(1.f)
+{
+}
+
+size_t ReprojectionCache::reproject(const VisibilityBuffer& vb, const glm::mat4& vp, Framebuffer& image)
+{
+	nextViewProjection = vp;
+	const bool reuse = valid && vb.width == width && vb.height == height && maxAge > 0;
+	// raster position and NDC depth of the new frame -> clip space of the previous frame
+	const glm::mat4 toPrevious = viewProjection * glm::inverse(vp);
+	const uint8_t ageLimit = static_cast<uint8_t>(std::min(maxAge, 255));
+	std::atomic<size_t> visible(0), reused(0);
+
+	parallelFor(static_cast<uint32_t>(height), [&](uint32_t y)
+	{
+		const uint32_t* idRow = vb.row(y);
+		const float* depthRow = vb.zbuffer.row(y);
+		uint8_t* shadeRow = shade.data() + y * pitch;
+		uint8_t* ageRow = nextAge.data() + y * pitch;
+		uint32_t* colorRow = image.row(y);
+		const float ndcY = 1.f - (y + 0.5f) / height * 2.f;
+		size_t rowVisible = 0, rowReused = 0;
+		for (int x = 0; x < width; x++)
+		{
+			const uint32_t id = idRow[x];
+			shadeRow[x] = 0;
+			if (id == VisibilityBuffer::EMPTY)
+				continue;
+			rowVisible++;
+			shadeRow[x] = 1;
+			if (!reuse)
+			{
+				// without history every pixel is shaded: stagger their ages so that they do not all expire together
+				ageRow[x] = static_cast<uint8_t>((x * 3 + y * 5) % (ageLimit + 1));
+				continue;
+			}
+			ageRow[x] = 0;
+
+			const glm::vec4 p = toPrevious * glm::vec4((x + 0.5f) / width * 2.f - 1.f, ndcY, depthRow[x], 1.f);
+			if (p.w <= 0.f)
+				continue;
+			// viewport transform of the previous frame (see RasterTriangle::setup), nearest pixel
+			const float px = (p.x / p.w + 1.f) / 2.f * width;
+			const float py = (1.f - p.y / p.w) / 2.f * height;
+			if (!(px >= 0.f && px < width && py >= 0.f && py < height))
+				continue;
+			const size_t previous = static_cast<size_t>(py) * pitch + static_cast<size_t>(px);
+			if (ids[previous] != id || std::abs(depth[previous] - p.z / p.w) > depthTolerance
+			    || age[previous] >= ageLimit)
+				continue;
+
+			colorRow[x] = resample(px, py, id);
+			ageRow[x] = static_cast<uint8_t>(age[previous] + 1);
+			shadeRow[x] = 0;
+			rowReused++;
+		}
+		visible += rowVisible;
+		reused += rowReused;
+	});
+
+	nVisible = visible;
+	nReused = reused;
+	return nReused;
+}
+
+uint32_t ReprojectionCache::resample(float px, float py, uint32_t id) const
+{
+	// the 2x2 pixels whose centers surround (px, py), clamped to the image
+	const int x0 = std::max(0, std::min(width - 2, static_cast<int>(px - 0.5f)));
+	const int y0 = std::max(0, std::min(height - 2, static_cast<int>(py - 0.5f)));
+	const float fx = std::min(std::max(px - 0.5f - x0, 0.f), 1.f);
+	const float fy = std::min(std::max(py - 0.5f - y0, 0.f), 1.f);
+	float sum[4] = {0.f, 0.f, 0.f, 0.f};
+	float weights = 0.f;
+	for (int i = 0; i < 4; i++)
+	{
+		const int x = x0 + (i & 1), y = y0 + (i >> 1);
+		// the pixels of other triangles (edges, disocclusions) do not bleed in
+		if (ids[y * pitch + x] != id)
+			continue;
+		const float weight = (i & 1 ? fx : 1.f - fx) * (i >> 1 ? fy : 1.f - fy);
+		const uint32_t c = color.row(y)[x];
+		for (int k = 0; k < 4; k++)
+			sum[k] += weight * (c >> (8 * k) & 0xff);
+		weights += weight;
+	}
+	if (weights <= 0.f)
+		return color.row(static_cast<int>(py))[static_cast<int>(px)];
+	uint32_t c = 0;
+	for (int k = 0; k < 4; k++)
+		c |= static_cast<uint32_t>(sum[k] / weights + 0.5f) << (8 * k);
+	return c;
+}
+
+void ReprojectionCache::store(const VisibilityBuffer& vb, const Framebuffer& image)
+{
+	if (vb.width != width || vb.height != height)
+	{
+		valid = false;
+		return;
+	}
+	parallelFor(static_cast<uint32_t>(height), [&](uint32_t y)
+	{
+		// the depth of the empty pixels is never read (their tile may not even have been cleared)
+		std::copy(vb.row(y), vb.row(y) + width, ids.data() + y * pitch);
+		std::copy(vb.zbuffer.row(y), vb.zbuffer.row(y) + width, depth.data() + y * pitch);
+		std::copy(image.row(y), image.row(y) + width, color.row(y));
+	});
+	age.swap(nextAge);
+	viewProjection = nextViewProjection;
+	valid = true;
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "Framebuffer.h"
+#include "VisibilityBuffer.h"
+
+// Reverse reprojection cache for sequences whose camera moves a little between frames (the meshes stay put): the
+// color, depth and triangle ID of the previous frame are kept, and every visible pixel of the new frame (known from
+// its visibility buffer, before any shading) is projected back into the previous frame with the old and the new
+// view-projection. Its previous color is reused when the pixel it lands on
+// - shows the same triangle (same ID): it was not hidden, it is not a disocclusion
+// - has the depth the reprojected point has there (within depthTolerance, NDC): it is the same side of the triangle
+// - was not reused for maxAge frames in a row already: reused colors blur a little every time they are resampled and
+//   view dependent shading (specular) gets stale, so every pixel is shaded again once in a while
+// The color is filtered bilinearly from the previous pixels around that point that show the same triangle. The other
+// pixels are flagged to be shaded (see shadeVisibility()).
+class ReprojectionCache
+{
+public:
+	ReprojectionCache(int w, int h);
+
+	// NDC depth difference accepted between the reprojected point and the previous pixel
+	float depthTolerance = 1e-3f;
+	// frames a pixel may be reused in a row (0: nothing is reused)
+	int maxAge = 8;
+
+	// copies the reusable colors of the previous frame into image and flags the other visible pixels (see
+	// invalid()). Returns the number of pixels reused (0 for the first frame, after invalidate() or if the size
+	// changed)
+	size_t reproject(const VisibilityBuffer& vb, const glm::mat4& viewProjection, Framebuffer& image);
+	// remembers the frame once its flagged pixels are shaded: its visibility buffer, its colors and its camera
+	void store(const VisibilityBuffer& vb, const Framebuffer& image);
+	// forgets the previous frame (e.g. when the meshes moved)
+	void invalidate() { valid = false; }
+
+	// one flag per pixel, rows are laid out like the visibility buffer: the pixels reproject() could not reuse
+	const std::uint8_t* invalid() const { return shade.data(); }
+
+	// statistics of the last reproject(): visible pixels, pixels reused
+	size_t visible() const { return nVisible; }
+	size_t reused() const { return nReused; }
+	// percentage of the visible pixels of the last frame that were reused
+	float reuseRate() const { return nVisible ? 100.f * nReused / nVisible : 0.f; }
+
+private:
+	// previous color at raster position (px, py), from the pixels of triangle id
+	std::uint32_t resample(float px, float py, std::uint32_t id) const;
+
+	int width;
+	int height;
+	int pitch;
+	// the previous frame
+	std::vector<std::uint32_t> ids;
+	std::vector<float> depth;
+	Framebuffer color;
+	// frames in a row each pixel was reused
+	std::vector<std::uint8_t> age;
+	glm::mat4 viewProjection;
+	bool valid = false;
+
+	// the frame being reprojected: pixels to shade, ages and camera of the frame (saved by store())
+	std::vector<std::uint8_t> shade;
+	std::vector<std::uint8_t> nextAge;
+	glm::mat4 nextViewProjection;
+
+	size_t nVisible = 0;
+	size_t nReused = 0;
+};
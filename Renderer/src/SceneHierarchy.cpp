@@ -0,0 +1,71 @@
+#include "SceneHierarchy.h"
+
+#include <algorithm>
+#include <cassert>
+
+int SceneHierarchy::addNode(const std::string& name, int parent, const glm::mat4& local, uint32_t firstMesh,
+                            uint32_t meshCount)
+{
+	int node = static_cast<int>(parents.size());
+	if (parent >= node)
+		parent = -1;
+	// pre-order: the subtree of the parent must still end here, or its range would hold nodes of other subtrees
+	assert(parent < 0 || subtreeEnds[parent] == static_cast<uint32_t>(node));
+	names.push_back(name);
+	parents.push_back(parent);
+	locals.push_back(local);
+	worlds.push_back(local);
+	meshBegin.push_back(firstMesh);
+	meshCounts.push_back(meshCount);
+	subtreeEnds.push_back(node + 1);
+	// the new node extends the subtrees of all its ancestors
+	for (int a = parent; a >= 0; a = parents[a])
+		subtreeEnds[a] = node + 1;
+	// a new node has never been given to its meshes
+	dirtyNodes.push_back(node);
+	return node;
+}
+
+int SceneHierarchy::find(const std::string& name) const
+{
+	auto it = std::find(names.begin(), names.end(), name);
+	return it == names.end() ? -1 : static_cast<int>(it - names.begin());
+}
+
+void SceneHierarchy::setLocal(int node, const glm::mat4& local)
+{
+	locals[node] = local;
+	dirtyNodes.push_back(node);
+}
+
+size_t SceneHierarchy::update(std::vector<Mesh>& meshes)
+{
+	// in index order an ancestor comes before the nodes of its subtree, which its range already covers
+	std::sort(dirtyNodes.begin(), dirtyNodes.end());
+	size_t updated = 0;
+	uint32_t covered = 0;
+	for (int node : dirtyNodes)
+	{
+		if (static_cast<uint32_t>(node) < covered)
+			continue;
+		covered = subtreeEnds[node];
+		for (uint32_t i = node; i < covered; i++)
+		{
+			// the parent of node is up to date, the parent of any other node of the range comes before it in the range
+			int p = parents[i];
+			worlds[i] = p < 0 ? locals[i] : worlds[p] * locals[i];
+			for (uint32_t m = meshBegin[i]; m < meshBegin[i] + meshCounts[i] && m < meshes.size(); m++)
+			{
+				// the bone palette already places skinned vertices in model space (see Skinning.h): their transform
+				// stays the identity and their node does not move them
+				if (meshes[m].skinned)
+					continue;
+				meshes[m].transform = worlds[i];
+				meshes[m].geometryVersion++;
+			}
+			updated++;
+		}
+	}
+	dirtyNodes.clear();
+	return updated;
+}
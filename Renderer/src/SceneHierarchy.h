@@ -0,0 +1,54 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "Mesh.h"
+
+// the node hierarchy of a model, flattened at load time into arrays indexed by node.
+// Nodes are stored in depth-first pre-order (a node, then its subtree), so the subtree of a node is the index range
+// [node, subtreeEnd(node)), a single pass in index order computes every world matrix, and the meshes of a node are
+// a contiguous range of Model::meshes.
+// setLocal() only records the node: update() recomputes the world matrices of the subtrees of the recorded nodes,
+// and nothing else, and copies them to the meshes (Mesh::transform) that are not skinned
+class SceneHierarchy
+{
+public:
+	// appends a node (parent: index of a node added before, -1 for a root); returns its index.
+	// Nodes must be added in pre-order: the parent is the last node added or one of its ancestors
+	int addNode(const std::string& name, int parent, const glm::mat4& local, uint32_t firstMesh, uint32_t meshCount);
+
+	size_t size() const { return parents.size(); }
+	// index of the first node with this name, -1 if there is none
+	int find(const std::string& name) const;
+
+	const std::string& name(int node) const { return names[node]; }
+	int parent(int node) const { return parents[node]; }
+	// one past the last node of the subtree of node
+	int subtreeEnd(int node) const { return static_cast<int>(subtreeEnds[node]); }
+	const glm::mat4& local(int node) const { return locals[node]; }
+	// valid after update()
+	const glm::mat4& world(int node) const { return worlds[node]; }
+
+	// moves a node (and its subtree) relative to its parent
+	void setLocal(int node, const glm::mat4& local);
+
+	// brings the world matrices of the dirty subtrees up to date and gives them to their meshes (but the skinned ones),
+	// bumping Mesh::geometryVersion so that the caches built from the mesh positions are rebuilt.
+	// returns the number of nodes updated
+	size_t update(std::vector<Mesh>& meshes);
+
+private:
+	std::vector<std::string> names;
+	std::vector<int> parents;
+	std::vector<glm::mat4> locals;
+	std::vector<glm::mat4> worlds;
+	// meshes [meshBegin, meshBegin + meshCounts) of each node
+	std::vector<uint32_t> meshBegin;
+	std::vector<uint32_t> meshCounts;
+	std::vector<uint32_t> subtreeEnds;
+	// roots of the subtrees whose world matrices are out of date (in any order, possibly repeated or nested)
+	std::vector<int> dirtyNodes;
+};
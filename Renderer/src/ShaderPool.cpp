@@ -0,0 +1,13 @@
+#include "ShaderPool.h"
+
+#include "Parallel.h"
+
+ShaderPool::ShaderPool(size_t meshCount, const Factory& make) : nMeshes(meshCount)
+{
+	shaders.reserve(parallelWorkers() * meshCount);
+	for (uint32_t worker = 0; worker < parallelWorkers(); worker++)
+	{
+		for (size_t m = 0; m < meshCount; m++)
+			shaders.push_back(make(m));
+	}
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "tinyOpenGL.h"
+
+// the shaders of the draws that shade on the workers of parallelFor (shadeVisibility(), GBuffer,
+// drawElementsMultiView()): one per mesh for each worker, made once and kept from one frame to the next, so that
+// shading a frame creates no shader. Give them the uniforms of each frame with forEach() before the workers use them
+class ShaderPool
+{
+public:
+	// make(m) returns a new shader for mesh m
+	using Factory = std::function<std::unique_ptr<IShader>(size_t)>;
+
+	ShaderPool(size_t meshCount, const Factory& make);
+
+	size_t meshCount() const { return nMeshes; }
+	// the shader of mesh m for worker (in [0, parallelWorkers()); the calling thread of a parallel loop is worker 0)
+	IShader& get(uint32_t worker, size_t m) const { return *shaders[worker * nMeshes + m]; }
+
+	// calls fn(m, shader) for every shader of the pool
+	template <typename Fn>
+	void forEach(Fn fn)
+	{
+		for (size_t i = 0; i < shaders.size(); i++)
+			fn(i % nMeshes, *shaders[i]);
+	}
+
+private:
+	size_t nMeshes;
+	std::vector<std::unique_ptr<IShader>> shaders;
+};
@@ -0,0 +1,36 @@
+#include "ShadingRate.h"
+
+#include <sstream>
+
+void ShadingRate::clear()
+{
+	pixels[0] = pixels[1] = pixels[2] = 0;
+	invocations = 0;
+}
+
+int ShadingRate::select(float texelsPerPixel) const
+{
+	int rate = maxRate;
+	while (rate > 1 && texelsPerPixel * rate > maxTexels)
+		rate /= 2;
+	return rate;
+}
+
+void ShadingRate::count(int rate, int nPixels, int nLanes)
+{
+	pixels[rate == 4 ? 2 : rate == 2 ? 1 : 0] += nPixels;
+	invocations += nLanes;
+}
+
+std::string ShadingRate::report() const
+{
+	const uint64_t total = pixels[0] + pixels[1] + pixels[2];
+	std::ostringstream out;
+	out.precision(3);
+	const char* names[3] = {"1x1", "2x2", "4x4"};
+	for (int i = 0; i < 3; i++)
+		out << names[i] << " " << (total ? 100.0 * pixels[i] / total : 0.0) << "%, ";
+	out << "of " << total << " pixels, " << (total ? static_cast<double>(invocations) / total : 0.0)
+		<< " invocations per pixel";
+	return out.str();
+}
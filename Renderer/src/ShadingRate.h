@@ -0,0 +1,36 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+// Variable rate shading: triangle() can run the packet fragment shader once per 2x2 or 4x4 block of pixels (a coarse
+// pixel, shaded at the center of its block) and give the color to every pixel of the block that the triangle covers
+// and that passes the depth test: coverage and depth stay per pixel, only the shading is shared.
+// The rate of each 16x16 tile of a triangle comes from the texel footprint of the shader's texture coordinates
+// (IShader::rateVarying) at the tile: where the texture is magnified, neighbouring pixels read the same texels and a
+// coarse pixel loses little. A draw can also force its rate (IShader::shadingRate).
+// The heuristic is only used when a ShadingRate is installed with setShadingRate() (see tinyOpenGL.h), and only by
+// packet shaders (see IShader::packetShading)
+struct ShadingRate
+{
+	// a coarse pixel may span at most this many texels: higher values trade quality for throughput
+	float maxTexels = 1.f;
+	// coarsest rate the heuristic picks: 1, 2 or 4
+	int maxRate = 4;
+
+	// pixels written at each rate (1x1, 2x2, 4x4) and packet fragment shader lanes run since the last clear()
+	uint64_t pixels[3] = {};
+	uint64_t invocations = 0;
+
+	// reset the counters (call it before every frame)
+	void clear();
+
+	// the coarsest rate (1, 2 or 4) whose coarse pixels span at most maxTexels texels, for a footprint of
+	// texelsPerPixel texels per pixel
+	int select(float texelsPerPixel) const;
+
+	// record the pixels written at rate (1, 2 or 4) and the lanes shaded for them
+	void count(int rate, int nPixels, int nLanes);
+
+	// shading rate distribution, e.g. "1x1 61%, 2x2 30%, 4x4 9%, of 120000 pixels, 0.52 invocations per pixel"
+	std::string report() const;
+};
@@ -0,0 +1,120 @@
+#include "ShadowMap.h"
+
+#include <cmath>
+
+ShadowMap::ShadowMap(int size)
+	// the light space depth range is as wide as the map (see render()): one texel spans 2 / n in NDC depth too
+	: n(size), bias(DEPTH_BIAS_TEXELS * 2.f / size), depth(size, size)
+{
+}
+
+bool ShadowMap::update(const std::vector<Mesh>& casters, const glm::vec3& lightDir)
+{
+	glm::vec3 dir = glm::normalize(lightDir);
+	bool changed = !valid || dir != cachedLightDir || casters.size() != cachedCasters.size();
+	for (size_t m = 0; !changed && m < casters.size(); m++)
+		changed = &casters[m] != cachedCasters[m] || casters[m].geometryVersion != cachedVersions[m];
+	if (!changed)
+		return false;
+
+	render(casters, dir);
+	valid = true;
+	cachedLightDir = dir;
+	cachedCasters.resize(casters.size());
+	cachedVersions.resize(casters.size());
+	for (size_t m = 0; m < casters.size(); m++)
+	{
+		cachedCasters[m] = &casters[m];
+		cachedVersions[m] = casters[m].geometryVersion;
+	}
+	renders++;
+	return true;
+}
+
+void ShadowMap::render(const std::vector<Mesh>& casters, const glm::vec3& dir)
+{
+	// bounding box of the posed vertices in world space (Mesh::aabbMin/aabbMax is the bind pose of skinned meshes)
+	glm::vec3 lo(0.f), hi(0.f);
+	bool empty = true;
+	for (const Mesh& mesh : casters)
+	{
+		for (size_t i = 0; i < mesh.vertexCount(); i++)
+		{
+			glm::vec3 p = glm::vec3(mesh.transform * glm::vec4(mesh.position(i), 1.f));
+			lo = empty ? p : glm::min(lo, p);
+			hi = empty ? p : glm::max(hi, p);
+			empty = false;
+		}
+	}
+
+	// look at the bounding sphere from the light: the orthographic box [-r, r]^3 around its center contains it
+	glm::vec3 center = (lo + hi) * 0.5f;
+	float r = std::max(glm::length(hi - lo) * 0.5f, 1e-3f);
+	glm::vec3 up = std::abs(dir.y) > 0.99f ? glm::vec3(0.f, 0.f, 1.f) : glm::vec3(0.f, 1.f, 0.f);
+	lightVP = glm::ortho(-r, r, -r, r, 0.f, 2.f * r) * glm::lookAt(center + dir * r, center, up);
+
+	depth.clear();
+	for (const Mesh& mesh : casters)
+	{
+		// shared vertices are transformed once
+		glm::mat4 lightMVP = lightVP * mesh.transform;
+		lightSpace.resize(mesh.vertexCount());
+		for (size_t i = 0; i < lightSpace.size(); i++)
+			lightSpace[i] = lightMVP * glm::vec4(mesh.position(i), 1.f);
+
+		for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3)
+		{
+			glm::vec4 hcp[3] = {lightSpace[mesh.indices[i]], lightSpace[mesh.indices[i + 1]],
+			                    lightSpace[mesh.indices[i + 2]]};
+			triangleDepth(hcp, depth);
+		}
+	}
+	// the tiles no caster touched still have to be reset to the far plane before the lookups
+	depth.prepare(0, n - 1, 0, n - 1);
+}
+
+float ShadowMap::visibility(const glm::vec3& lightNDC) const
+{
+	// same viewport transform as RasterTriangle::setup
+	float tx = (lightNDC.x + 1.f) * 0.5f * n, ty = (1.f - lightNDC.y) * 0.5f * n;
+	if (!valid || tx < 0.f || ty < 0.f || tx >= n || ty >= n)
+		return 1.f;
+
+	float z = lightNDC.z - bias;
+	int cx = static_cast<int>(tx), cy = static_cast<int>(ty);
+	int lit = 0;
+	for (int y = cy - 1; y <= cy + 1; y++)
+	{
+		const float* row = depth.row(std::min(std::max(y, 0), n - 1));
+		for (int x = cx - 1; x <= cx + 1; x++)
+			lit += z <= row[std::min(std::max(x, 0), n - 1)];
+	}
+	return lit / 9.f;
+}
+
+vfloat ShadowMap::visibility(const vvec3& lightNDC, const vfloat& active) const
+{
+	if (!valid)
+		return 1.f;
+	vfloat tx = (lightNDC.x + 1.f) * (0.5f * n), ty = (1.f - lightNDC.y) * (0.5f * n);
+	vfloat inside = active & (tx >= 0.f) & (ty >= 0.f) & (tx < static_cast<float>(n)) & (ty < static_cast<float>(n));
+	if (!movemask(inside))
+		return 1.f;
+
+	vfloat z = lightNDC.z - bias;
+	vfloat cx = floor(tx), cy = floor(ty);
+	const float last = static_cast<float>(n - 1);
+	// the map is FLOAT32: its raw depths are gathered as bits
+	const uint32_t* texels = reinterpret_cast<const uint32_t*>(depth.row(0));
+	vfloat lit(0.f);
+	for (int dy = -1; dy <= 1; dy++)
+	{
+		vint rowStart = toInt(clamp(cy + static_cast<float>(dy), 0.f, last)) * vint(depth.pitch());
+		for (int dx = -1; dx <= 1; dx++)
+		{
+			vint index = rowStart + toInt(clamp(cx + static_cast<float>(dx), 0.f, last));
+			lit += vfloat(1.f) & (z <= asFloat(gather(texels, index, inside)));
+		}
+	}
+	return select(inside, lit * (1.f / 9.f), vfloat(1.f));
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <vector>
+
+#include "tinyOpenGL.h"
+
+// Shadow map of a directional light: the casters are rendered from the light with triangleDepth() (no fragment
+// shader, no color), with an orthographic projection fitted to their bounding sphere.
+// The shaders carry the light space position of their vertices as a varying (see lightViewProjection()) and
+// look the interpolated one up with visibility().
+// The map is cached: update() only renders it again when the light direction or the geometry of a caster changed
+// (Mesh::geometryVersion), so the frames of a camera sweep share a single shadow pass.
+class ShadowMap
+{
+public:
+	// surfaces are lit if they are at most this many texels behind the caster stored in the map (shadow acne)
+	static constexpr float DEPTH_BIAS_TEXELS = 2.f;
+
+	explicit ShadowMap(int size = 1024);
+
+	int size() const { return n; }
+	// from world space to the light NDC cube (an orthographic projection: w is always 1)
+	const glm::mat4& lightViewProjection() const { return lightVP; }
+
+	// renders the map if lightDir (towards the light) or the casters changed since the last render
+	// returns true if it rendered
+	bool update(const std::vector<Mesh>& casters, const glm::vec3& lightDir);
+	// forces the next update() to render
+	void invalidate() { valid = false; }
+
+	// fraction of the 3x3 texels around a light NDC position that see the light (percentage closer filtering):
+	// 0 is fully shadowed, positions outside the map are lit
+	float visibility(const glm::vec3& lightNDC) const;
+	// same for SIMD_WIDTH positions, the inactive lanes are lit
+	vfloat visibility(const vvec3& lightNDC, const vfloat& active) const;
+
+	// number of times the map has been rendered
+	int renders = 0;
+
+private:
+	void render(const std::vector<Mesh>& casters, const glm::vec3& lightDir);
+
+	int n;
+	float bias;
+	DepthBuffer depth;
+	glm::mat4 lightVP{1.f};
+
+	// what the current map was rendered from
+	bool valid = false;
+	glm::vec3 cachedLightDir{0.f};
+	std::vector<const Mesh*> cachedCasters;
+	std::vector<unsigned> cachedVersions;
+	// light space positions of the vertices of a caster, reused across meshes
+	std::vector<glm::vec4> lightSpace;
+};
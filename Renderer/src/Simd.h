@@ -0,0 +1,319 @@
+#pragma once
+#include <cstdint>
+#include <immintrin.h>
+#include <glm/glm.hpp>
+
+// Thin wrappers over SSE/AVX2 registers used by the packet (SPMD) fragment shaders:
+// every lane of a vfloat/vint holds the value of one pixel of a SIMD_WIDTH pixel packet.
+// Builds with AVX2 enabled (/arch:AVX2, -mavx2) shade 8 pixels at a time, the others 4 (SSE2 only).
+// Masks are vfloat with all bits of the active lanes set, like the results of the comparison operators.
+
+#if defined(__AVX2__)
+#define SIMD_WIDTH 8
+#else
+#define SIMD_WIDTH 4
+#endif
+
+// only the types are brought into the global namespace: the functions (min, max, floor, pow...) are found through
+// them by argument dependent lookup and do not sit beside the std:: and glm functions of the same names
+namespace simd
+{
+#if SIMD_WIDTH == 8
+
+	struct vfloat
+	{
+		__m256 v;
+
+		vfloat() = default;
+		vfloat(__m256 v) : v(v) {}
+		vfloat(float f) : v(_mm256_set1_ps(f)) {}
+
+		// lane i holds base + i
+		static vfloat ramp(float base) { return _mm256_add_ps(_mm256_set1_ps(base), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7)); }
+		// p must be 32-byte aligned
+		static vfloat load(const float* p) { return _mm256_load_ps(p); }
+		void store(float* p) const { _mm256_store_ps(p, v); }
+	};
+
+	struct vint
+	{
+		__m256i v;
+
+		vint() = default;
+		vint(__m256i v) : v(v) {}
+		vint(int32_t i) : v(_mm256_set1_epi32(i)) {}
+
+		// p must be 32-byte aligned
+		static vint load(const uint32_t* p) { return _mm256_load_si256(reinterpret_cast<const __m256i*>(p)); }
+		void store(uint32_t* p) const { _mm256_store_si256(reinterpret_cast<__m256i*>(p), v); }
+		// zero-extended 16-bit values, p must be 16-byte aligned
+		static vint load(const uint16_t* p) { return _mm256_cvtepu16_epi32(_mm_load_si128(reinterpret_cast<const __m128i*>(p))); }
+		// lanes must hold values in [0, 65535]
+		void store(uint16_t* p) const
+		{
+			__m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+			_mm_store_si128(reinterpret_cast<__m128i*>(p), packed);
+		}
+	};
+
+	inline vfloat operator+(const vfloat& a, const vfloat& b) { return _mm256_add_ps(a.v, b.v); }
+	inline vfloat operator-(const vfloat& a, const vfloat& b) { return _mm256_sub_ps(a.v, b.v); }
+	inline vfloat operator*(const vfloat& a, const vfloat& b) { return _mm256_mul_ps(a.v, b.v); }
+	inline vfloat operator/(const vfloat& a, const vfloat& b) { return _mm256_div_ps(a.v, b.v); }
+	inline vfloat operator-(const vfloat& a) { return _mm256_xor_ps(a.v, _mm256_set1_ps(-0.f)); }
+	inline vfloat operator<(const vfloat& a, const vfloat& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+	inline vfloat operator<=(const vfloat& a, const vfloat& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+	inline vfloat operator>(const vfloat& a, const vfloat& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+	inline vfloat operator>=(const vfloat& a, const vfloat& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+	inline vfloat operator==(const vfloat& a, const vfloat& b) { return _mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ); }
+	inline vfloat operator&(const vfloat& a, const vfloat& b) { return _mm256_and_ps(a.v, b.v); }
+	inline vfloat operator|(const vfloat& a, const vfloat& b) { return _mm256_or_ps(a.v, b.v); }
+	// a & ~b
+	inline vfloat andnot(const vfloat& a, const vfloat& b) { return _mm256_andnot_ps(b.v, a.v); }
+	inline vfloat min(const vfloat& a, const vfloat& b) { return _mm256_min_ps(a.v, b.v); }
+	inline vfloat max(const vfloat& a, const vfloat& b) { return _mm256_max_ps(a.v, b.v); }
+	inline vfloat sqrt(const vfloat& a) { return _mm256_sqrt_ps(a.v); }
+	inline vfloat floor(const vfloat& a) { return _mm256_floor_ps(a.v); }
+	// mask ? a : b
+	inline vfloat select(const vfloat& mask, const vfloat& a, const vfloat& b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+	// bit i is set if lane i of the mask is active
+	inline int movemask(const vfloat& mask) { return _mm256_movemask_ps(mask.v); }
+
+	inline vint operator+(const vint& a, const vint& b) { return _mm256_add_epi32(a.v, b.v); }
+	inline vint operator*(const vint& a, const vint& b) { return _mm256_mullo_epi32(a.v, b.v); }
+	inline vint operator&(const vint& a, const vint& b) { return _mm256_and_si256(a.v, b.v); }
+	inline vint operator|(const vint& a, const vint& b) { return _mm256_or_si256(a.v, b.v); }
+	inline vint operator<<(const vint& a, int n) { return _mm256_slli_epi32(a.v, n); }
+	inline vint operator>>(const vint& a, int n) { return _mm256_srli_epi32(a.v, n); }
+	inline vint select(const vfloat& mask, const vint& a, const vint& b)
+	{
+		return _mm256_blendv_epi8(b.v, a.v, _mm256_castps_si256(mask.v));
+	}
+
+	// conversions: toInt truncates toward zero like a C++ cast
+	inline vint toInt(const vfloat& a) { return _mm256_cvttps_epi32(a.v); }
+	inline vfloat toFloat(const vint& a) { return _mm256_cvtepi32_ps(a.v); }
+	inline vint asInt(const vfloat& a) { return _mm256_castps_si256(a.v); }
+	inline vfloat asFloat(const vint& a) { return _mm256_castsi256_ps(a.v); }
+
+	// loads base[index] for the lanes of mask, 0 for the others
+	inline vint gather(const uint32_t* base, const vint& index, const vfloat& mask)
+	{
+		return _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), reinterpret_cast<const int*>(base), index.v,
+		                                   _mm256_castps_si256(mask.v), 4);
+	}
+	// loads the byte base[index] (zero-extended) for the lanes of mask, 0 for the others.
+	// 4 bytes are read per lane: base must stay readable 3 bytes past the last index
+	inline vint gather(const uint8_t* base, const vint& index, const vfloat& mask)
+	{
+		__m256i dwords = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), reinterpret_cast<const int*>(base), index.v,
+		                                             _mm256_castps_si256(mask.v), 1);
+		return _mm256_and_si256(dwords, _mm256_set1_epi32(0xff));
+	}
+
+#else
+
+	struct vfloat
+	{
+		__m128 v;
+
+		vfloat() = default;
+		vfloat(__m128 v) : v(v) {}
+		vfloat(float f) : v(_mm_set1_ps(f)) {}
+
+		// lane i holds base + i
+		static vfloat ramp(float base) { return _mm_add_ps(_mm_set1_ps(base), _mm_setr_ps(0, 1, 2, 3)); }
+		// p must be 16-byte aligned
+		static vfloat load(const float* p) { return _mm_load_ps(p); }
+		void store(float* p) const { _mm_store_ps(p, v); }
+	};
+
+	struct vint
+	{
+		__m128i v;
+
+		vint() = default;
+		vint(__m128i v) : v(v) {}
+		vint(int32_t i) : v(_mm_set1_epi32(i)) {}
+
+		// p must be 16-byte aligned
+		static vint load(const uint32_t* p) { return _mm_load_si128(reinterpret_cast<const __m128i*>(p)); }
+		void store(uint32_t* p) const { _mm_store_si128(reinterpret_cast<__m128i*>(p), v); }
+		// zero-extended 16-bit values, p must be 8-byte aligned
+		static vint load(const uint16_t* p)
+		{
+			return _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)), _mm_setzero_si128());
+		}
+		// lanes must hold values in [0, 65535]
+		void store(uint16_t* p) const
+		{
+			// SSE2 only has a signed saturating pack: move the range to [-32768, 32767] and back
+			__m128i bias = _mm_set1_epi32(32768);
+			__m128i packed = _mm_packs_epi32(_mm_sub_epi32(v, bias), _mm_sub_epi32(v, bias));
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(p), _mm_xor_si128(packed, _mm_set1_epi16(-32768)));
+		}
+	};
+
+	inline vfloat operator+(const vfloat& a, const vfloat& b) { return _mm_add_ps(a.v, b.v); }
+	inline vfloat operator-(const vfloat& a, const vfloat& b) { return _mm_sub_ps(a.v, b.v); }
+	inline vfloat operator*(const vfloat& a, const vfloat& b) { return _mm_mul_ps(a.v, b.v); }
+	inline vfloat operator/(const vfloat& a, const vfloat& b) { return _mm_div_ps(a.v, b.v); }
+	inline vfloat operator-(const vfloat& a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.f)); }
+	inline vfloat operator<(const vfloat& a, const vfloat& b) { return _mm_cmplt_ps(a.v, b.v); }
+	inline vfloat operator<=(const vfloat& a, const vfloat& b) { return _mm_cmple_ps(a.v, b.v); }
+	inline vfloat operator>(const vfloat& a, const vfloat& b) { return _mm_cmpgt_ps(a.v, b.v); }
+	inline vfloat operator>=(const vfloat& a, const vfloat& b) { return _mm_cmpge_ps(a.v, b.v); }
+	inline vfloat operator==(const vfloat& a, const vfloat& b) { return _mm_cmpeq_ps(a.v, b.v); }
+	inline vfloat operator&(const vfloat& a, const vfloat& b) { return _mm_and_ps(a.v, b.v); }
+	inline vfloat operator|(const vfloat& a, const vfloat& b) { return _mm_or_ps(a.v, b.v); }
+	// a & ~b
+	inline vfloat andnot(const vfloat& a, const vfloat& b) { return _mm_andnot_ps(b.v, a.v); }
+	inline vfloat min(const vfloat& a, const vfloat& b) { return _mm_min_ps(a.v, b.v); }
+	inline vfloat max(const vfloat& a, const vfloat& b) { return _mm_max_ps(a.v, b.v); }
+	inline vfloat sqrt(const vfloat& a) { return _mm_sqrt_ps(a.v); }
+	// mask ? a : b
+	inline vfloat select(const vfloat& mask, const vfloat& a, const vfloat& b)
+	{
+		return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v));
+	}
+	inline vfloat floor(const vfloat& a)
+	{
+		// SSE2 has no floor: truncate, then step down the negative lanes that were rounded up
+		vfloat t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a.v));
+		return t - (vfloat(1.f) & (a < t));
+	}
+	// bit i is set if lane i of the mask is active
+	inline int movemask(const vfloat& mask) { return _mm_movemask_ps(mask.v); }
+
+	inline vint operator+(const vint& a, const vint& b) { return _mm_add_epi32(a.v, b.v); }
+	inline vint operator*(const vint& a, const vint& b)
+	{
+		// SSE2 has no 32-bit mullo: multiply the even and odd lanes separately and interleave the low halves
+		__m128i even = _mm_mul_epu32(a.v, b.v);
+		__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a.v, 32), _mm_srli_epi64(b.v, 32));
+		return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+		                          _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+	}
+	inline vint operator&(const vint& a, const vint& b) { return _mm_and_si128(a.v, b.v); }
+	inline vint operator|(const vint& a, const vint& b) { return _mm_or_si128(a.v, b.v); }
+	inline vint operator<<(const vint& a, int n) { return _mm_slli_epi32(a.v, n); }
+	inline vint operator>>(const vint& a, int n) { return _mm_srli_epi32(a.v, n); }
+	inline vint select(const vfloat& mask, const vint& a, const vint& b)
+	{
+		__m128i m = _mm_castps_si128(mask.v);
+		return _mm_or_si128(_mm_and_si128(m, a.v), _mm_andnot_si128(m, b.v));
+	}
+
+	// conversions: toInt truncates toward zero like a C++ cast
+	inline vint toInt(const vfloat& a) { return _mm_cvttps_epi32(a.v); }
+	inline vfloat toFloat(const vint& a) { return _mm_cvtepi32_ps(a.v); }
+	inline vint asInt(const vfloat& a) { return _mm_castps_si128(a.v); }
+	inline vfloat asFloat(const vint& a) { return _mm_castsi128_ps(a.v); }
+
+	// loads base[index] for the lanes of mask, 0 for the others (SSE has no gather instruction)
+	inline vint gather(const uint32_t* base, const vint& index, const vfloat& mask)
+	{
+		alignas(16) int32_t idx[4];
+		alignas(16) uint32_t out[4];
+		_mm_store_si128(reinterpret_cast<__m128i*>(idx), index.v);
+		int m = movemask(mask);
+		for (int i = 0; i < 4; i++)
+			out[i] = (m >> i & 1) ? base[idx[i]] : 0;
+		return vint::load(out);
+	}
+	// loads the byte base[index] (zero-extended) for the lanes of mask, 0 for the others
+	inline vint gather(const uint8_t* base, const vint& index, const vfloat& mask)
+	{
+		alignas(16) int32_t idx[4];
+		alignas(16) uint32_t out[4];
+		_mm_store_si128(reinterpret_cast<__m128i*>(idx), index.v);
+		int m = movemask(mask);
+		for (int i = 0; i < 4; i++)
+			out[i] = (m >> i & 1) ? base[idx[i]] : 0;
+		return vint::load(out);
+	}
+
+#endif
+
+	inline vfloat& operator+=(vfloat& a, const vfloat& b) { return a = a + b; }
+	inline vfloat& operator*=(vfloat& a, const vfloat& b) { return a = a * b; }
+	inline vfloat& operator&=(vfloat& a, const vfloat& b) { return a = a & b; }
+	inline vfloat clamp(const vfloat& a, const vfloat& lo, const vfloat& hi) { return min(max(a, lo), hi); }
+	inline vfloat abs(const vfloat& a) { return andnot(a, vfloat(-0.f)); }
+
+	// 2^x (polynomial approximation, relative error ~2e-7)
+	inline vfloat exp2(const vfloat& x)
+	{
+		vfloat xc = clamp(x, -126.f, 126.f);
+		vfloat ipart = floor(xc);
+		vfloat f = xc - ipart;
+		vfloat p = ((((1.8775767e-3f * f + 8.9893397e-3f) * f + 5.5826318e-2f) * f + 2.4015361e-1f) * f
+			+ 6.9315308e-1f) * f + 9.9999994e-1f;
+		// 2^ipart is built directly in the exponent bits
+		return p * asFloat((toInt(ipart) + vint(127)) << 23);
+	}
+
+	// log2(x) for x > 0 (polynomial approximation, absolute error ~1e-5)
+	inline vfloat log2(const vfloat& x)
+	{
+		vint bits = asInt(x);
+		vfloat e = toFloat(((bits >> 23) & vint(0xff)) + vint(-127));
+		// mantissa in [1, 2)
+		vfloat m = asFloat((bits & vint(0x007fffff)) | vint(0x3f800000));
+		vfloat p = ((((-3.4436006e-2f * m + 3.1821337e-1f) * m - 1.2315303f) * m + 2.5988452f) * m - 3.3241990f) * m
+			+ 3.1157899f;
+		// multiplying by (m - 1) guarantees log2(1) == 0
+		return p * (m - 1.f) + e;
+	}
+
+	// x^y with the std::pow conventions the shaders rely on: 0^0 = 1, 0^y = 0 for y > 0
+	inline vfloat pow(const vfloat& x, const vfloat& y)
+	{
+		vfloat r = exp2(y * log2(max(x, 1e-30f)));
+		return select(x > 0.f, r, select(y == 0.f, vfloat(1.f), vfloat(0.f)));
+	}
+
+	// packet of SIMD_WIDTH 3d vectors stored as 3 registers (structure of arrays)
+	struct vvec3
+	{
+		vfloat x, y, z;
+
+		vvec3() = default;
+		vvec3(const vfloat& x, const vfloat& y, const vfloat& z) : x(x), y(y), z(z) {}
+		// the same vector in every lane (e.g. a uniform)
+		vvec3(const glm::vec3& v) : x(v.x), y(v.y), z(v.z) {}
+	};
+
+	inline vvec3 operator+(const vvec3& a, const vvec3& b) { return vvec3(a.x + b.x, a.y + b.y, a.z + b.z); }
+	inline vvec3 operator-(const vvec3& a, const vvec3& b) { return vvec3(a.x - b.x, a.y - b.y, a.z - b.z); }
+	inline vvec3 operator*(const vvec3& a, const vfloat& s) { return vvec3(a.x * s, a.y * s, a.z * s); }
+	inline vvec3 operator-(const vvec3& a) { return vvec3(-a.x, -a.y, -a.z); }
+	// upper-left 3x3 of m times the direction v
+	inline vvec3 operator*(const glm::mat4& m, const vvec3& v)
+	{
+		return vvec3(m[0][0] * v.x + m[1][0] * v.y + m[2][0] * v.z,
+		             m[0][1] * v.x + m[1][1] * v.y + m[2][1] * v.z,
+		             m[0][2] * v.x + m[1][2] * v.y + m[2][2] * v.z);
+	}
+
+	inline vfloat dot(const vvec3& a, const vvec3& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+	inline vvec3 normalize(const vvec3& v) { return v * (1.f / sqrt(dot(v, v))); }
+	// same as glm::reflect: I - 2 * dot(N, I) * N
+	inline vvec3 reflect(const vvec3& I, const vvec3& N) { return I - N * (2.f * dot(N, I)); }
+
+	// unpacks channel c (0: B, 1: G, 2: R, 3: A) of packed BGRA colors to [0, 255] floats
+	inline vfloat channel(const vint& color, int c)
+	{
+		return toFloat((color >> (8 * c)) & vint(0xff));
+	}
+
+	// packs [0, 255] floats (already clamped) to BGRA colors
+	inline vint packColor(const vfloat& b, const vfloat& g, const vfloat& r, const vfloat& a = 0.f)
+	{
+		return toInt(b) | toInt(g) << 8 | toInt(r) << 16 | toInt(a) << 24;
+	}
+}
+
+using simd::vfloat;
+using simd::vint;
+using simd::vvec3;
@@ -0,0 +1,79 @@
+#include "Skinning.h"
+
+#include <xmmintrin.h>
+
+#include "Parallel.h"
+
+// number of vertices a worker skins at once
+static const uint32_t SKINNING_BATCH = 256;
+
+// glm::mat4 columns are 4 contiguous floats: one SSE register per column
+static inline void loadColumns(const glm::mat4& m, __m128 cols[4])
+{
+	for (int c = 0; c < 4; c++)
+		cols[c] = _mm_loadu_ps(&m[c][0]);
+}
+
+static inline __m128 transform(const __m128 cols[4], float x, float y, float z, float w)
+{
+	__m128 r = _mm_mul_ps(cols[0], _mm_set1_ps(x));
+	r = _mm_add_ps(r, _mm_mul_ps(cols[1], _mm_set1_ps(y)));
+	r = _mm_add_ps(r, _mm_mul_ps(cols[2], _mm_set1_ps(z)));
+	if (w != 0.f)
+		r = _mm_add_ps(r, _mm_mul_ps(cols[3], _mm_set1_ps(w)));
+	return r;
+}
+
+static inline glm::vec3 toVec3(__m128 v)
+{
+	alignas(16) float f[4];
+	_mm_store_ps(f, v);
+	return glm::vec3(f[0], f[1], f[2]);
+}
+
+void skinMesh(Mesh& mesh, const std::vector<glm::mat4>& bonePalette)
+{
+	const std::vector<Vertex>& in = mesh.vertices;
+	std::vector<Vertex>& out = mesh.skinnedVertices;
+	// the scratch buffer keeps its capacity, so only the first frame allocates
+	out.resize(in.size());
+
+	const uint32_t count = static_cast<uint32_t>(in.size());
+	const int paletteSize = static_cast<int>(bonePalette.size());
+	parallelFor((count + SKINNING_BATCH - 1) / SKINNING_BATCH, [&](uint32_t batch)
+	{
+		uint32_t end = std::min(count, (batch + 1) * SKINNING_BATCH);
+		for (uint32_t i = batch * SKINNING_BATCH; i < end; i++)
+		{
+			const Vertex& v = in[i];
+			Vertex& s = out[i];
+			s = v;
+
+			// blend the bone matrices column by column: skin = sum(weight * bonePalette[boneID])
+			__m128 skin[4] = {_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps()};
+			float totalWeight = 0.f;
+			for (int b = 0; b < MAX_BONE_INFLUENCE; b++)
+			{
+				int id = v.m_BoneIDs[b];
+				if (id < 0 || id >= paletteSize || v.m_Weights[b] == 0.f)
+					continue;
+				__m128 cols[4];
+				loadColumns(bonePalette[id], cols);
+				__m128 w = _mm_set1_ps(v.m_Weights[b]);
+				for (int c = 0; c < 4; c++)
+					skin[c] = _mm_add_ps(skin[c], _mm_mul_ps(cols[c], w));
+				totalWeight += v.m_Weights[b];
+			}
+			// vertices without influences keep their bind pose
+			if (totalWeight == 0.f)
+				continue;
+
+			s.Position = toVec3(transform(skin, v.Position.x, v.Position.y, v.Position.z, 1.f));
+			// directions ignore the translation; like most skinning shaders we assume bones do not scale non-uniformly
+			s.Normal = toVec3(transform(skin, v.Normal.x, v.Normal.y, v.Normal.z, 0.f));
+			s.Tangent = toVec3(transform(skin, v.Tangent.x, v.Tangent.y, v.Tangent.z, 0.f));
+			s.Bitangent = toVec3(transform(skin, v.Bitangent.x, v.Bitangent.y, v.Bitangent.z, 0.f));
+		}
+	});
+	mesh.geometryVersion++;
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include <vector>
+
+#include "Mesh.h"
+
+// Skinning is a pre-pass of the vertex stage: all vertices of a skinned mesh are transformed once per frame
+// by the weighted sum of their bone matrices and written to Mesh::skinnedVertices, which the draw loop then
+// reads through Mesh::drawVertices(). Shared vertices are skinned once instead of once per triangle.
+
+// bonePalette is the per-frame bone palette uniform: bonePalette[BoneInfo::id] takes a vertex from mesh space
+// (bind pose) to its posed position, i.e. the global transform of the bone times BoneInfo::offset.
+// An identity palette keeps the bind pose.
+void skinMesh(Mesh& mesh, const std::vector<glm::mat4>& bonePalette);
@@ -0,0 +1,423 @@
+#include "VirtualTexture.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+#include "ImageLoader.h"
+#include "Mesh.h"
+#include "PackedVertex.h"
+
+// page file layout (native endianness):
+// uint32 page bytes, uint32 format, uint32 width, uint32 height, uint32 size of the image file,
+// then the pages of every level, finest level first, each level in rows of pages
+static const std::streamoff HEADER_BYTES = 5 * sizeof(uint32_t);
+
+static uint32_t fileSize(const std::string& filename)
+{
+	std::ifstream in(filename, std::ios::binary | std::ios::ate);
+	return in.is_open() ? static_cast<uint32_t>(in.tellg()) : 0;
+}
+
+// reads the size of the texture if the page file matches the format and the image file
+static bool readPageHeader(const std::string& pageFile, PreparedTexture::Format format, uint32_t sourceBytes,
+                           uint32_t& width, uint32_t& height)
+{
+	std::ifstream in(pageFile, std::ios::binary);
+	if (!in.is_open())
+		return false;
+	uint32_t header[5] = {};
+	in.read(reinterpret_cast<char*>(header), sizeof(header));
+	width = header[2];
+	height = header[3];
+	// the page file is stale if the image file changed
+	return in.good() && header[0] == PageCache::PAGE_BYTES && header[1] == static_cast<uint32_t>(format) &&
+		width > 0 && height > 0 && header[4] == sourceBytes;
+}
+
+// the next level of the mip chain: 2x2 box filter (the last row or column is repeated for odd sizes)
+static TGAImage downsample(const TGAImage& img)
+{
+	const int w = std::max(img.width() / 2, 1), h = std::max(img.height() / 2, 1);
+	const int bpp = img.bytespp();
+	TGAImage out(w, h, bpp);
+	for (int y = 0; y < h; y++)
+	{
+		const std::uint8_t* row0 = img.buffer() + std::min(2 * y, img.height() - 1) * img.width() * bpp;
+		const std::uint8_t* row1 = img.buffer() + std::min(2 * y + 1, img.height() - 1) * img.width() * bpp;
+		for (int x = 0; x < w; x++)
+		{
+			const int x0 = std::min(2 * x, img.width() - 1) * bpp, x1 = std::min(2 * x + 1, img.width() - 1) * bpp;
+			for (int c = 0; c < bpp; c++)
+				out.buffer()[(y * w + x) * bpp + c] =
+					static_cast<std::uint8_t>((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) / 4);
+		}
+	}
+	return out;
+}
+
+static std::uint32_t load32(const std::uint8_t* p)
+{
+	std::uint32_t v;
+	std::memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+VirtualTexture::VirtualTexture(PageCache& cache, PreparedTexture::Format format, int width, int height)
+	: cache(cache), fmt(format), texelBytes(format == PreparedTexture::R8 ? 1 : 4),
+	  pageShift(format == PreparedTexture::R8 ? 7 : 6)
+{
+	// down to the first level that fits in a single page
+	const int pageSize = 1 << pageShift;
+	uint32_t pages = 0;
+	for (;;)
+	{
+		Level level;
+		level.width = width;
+		level.height = height;
+		level.pagesX = (width + pageSize - 1) >> pageShift;
+		level.pagesY = (height + pageSize - 1) >> pageShift;
+		level.firstPage = pages;
+		levels.push_back(level);
+		pages += level.pagesX * level.pagesY;
+		if (width <= pageSize && height <= pageSize)
+			break;
+		width = std::max(width / 2, 1);
+		height = std::max(height / 2, 1);
+	}
+	pageSlots.assign(pages, -1);
+	requested.reset(new std::atomic<std::uint8_t>[pages]());
+}
+
+bool VirtualTexture::writePages(const TGAImage& image, const std::string& pageFile, uint32_t sourceBytes) const
+{
+	std::ofstream out(pageFile, std::ios::binary);
+	if (!out.is_open())
+		return false;
+	const uint32_t header[5] = {static_cast<uint32_t>(PageCache::PAGE_BYTES), static_cast<uint32_t>(fmt),
+	                            static_cast<uint32_t>(width()), static_cast<uint32_t>(height()), sourceBytes};
+	out.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+	const int pageSize = 1 << pageShift;
+	std::vector<char> page(PageCache::PAGE_BYTES);
+	TGAImage mip = image;
+	for (size_t m = 0; m < levels.size(); m++)
+	{
+		if (m > 0)
+			mip = downsample(mip);
+		// the texels of the level in the format of the texture
+		PreparedTexture prepared(mip, fmt);
+		const Level& level = levels[m];
+		for (int py = 0; py < level.pagesY; py++)
+		{
+			for (int px = 0; px < level.pagesX; px++)
+			{
+				// the texels past the edges of the level are black
+				std::fill(page.begin(), page.end(), 0);
+				const int rows = std::min(pageSize, level.height - py * pageSize);
+				const int columns = std::min(pageSize, level.width - px * pageSize);
+				for (int r = 0; r < rows; r++)
+				{
+					const size_t texel = static_cast<size_t>(py * pageSize + r) * level.width + px * pageSize;
+					std::memcpy(page.data() + r * pageSize * texelBytes, prepared.data() + texel * texelBytes,
+					            columns * texelBytes);
+				}
+				out.write(page.data(), page.size());
+			}
+		}
+	}
+	return out.good();
+}
+
+int VirtualTexture::mipFor(float uvPerPixel) const
+{
+	float texels = uvPerPixel * std::max(width(), height());
+	int mip = texels > 1.f ? static_cast<int>(std::log2(texels)) : 0;
+	return std::min(mip, mipCount() - 1);
+}
+
+const std::uint8_t* VirtualTexture::texel(const glm::vec2& uv, int mip) const
+{
+	// same truncation as PreparedTexture
+	const Level* level = &levels[mip];
+	int x = static_cast<int>(uv[0] * level->width), y = static_cast<int>(uv[1] * level->height);
+	if (x < 0 || y < 0 || x >= level->width || y >= level->height)
+		return nullptr;
+	uint32_t page = level->firstPage + (y >> pageShift) * level->pagesX + (x >> pageShift);
+	request(page);
+
+	// fall back to coarser levels until one is resident (the mip tail always is)
+	while (pageSlots[page] < 0 && mip + 1 < mipCount())
+	{
+		level = &levels[++mip];
+		x = static_cast<int>(uv[0] * level->width);
+		y = static_cast<int>(uv[1] * level->height);
+		page = level->firstPage + (y >> pageShift) * level->pagesX + (x >> pageShift);
+	}
+	const int pageMask = (1 << pageShift) - 1;
+	return cache.page(pageSlots[page]) + (((y & pageMask) << pageShift) + (x & pageMask)) * texelBytes;
+}
+
+vint VirtualTexture::fetch(const vfloat& u, const vfloat& v, const vfloat& active, int mip, vfloat& mask) const
+{
+	const Level& level = levels[mip];
+	vfloat xf = u * static_cast<float>(level.width);
+	vfloat yf = v * static_cast<float>(level.height);
+	mask = active & (xf > -1.f) & (xf < static_cast<float>(level.width)) & (yf > -1.f) &
+		(yf < static_cast<float>(level.height));
+	const int lanes = movemask(mask);
+	if (!lanes)
+		return vint(0);
+
+	vint x = toInt(xf), y = toInt(yf);
+	vint px = x >> pageShift, py = y >> pageShift;
+	alignas(32) uint32_t pxs[SIMD_WIDTH], pys[SIMD_WIDTH];
+	px.store(pxs);
+	py.store(pys);
+	int first = 0;
+	while (!(lanes >> first & 1))
+		first++;
+
+	// usually all the lanes are in the same page: one request, one gather
+	vfloat samePage = mask & (toFloat(px) == static_cast<float>(pxs[first])) &
+		(toFloat(py) == static_cast<float>(pys[first]));
+	if (movemask(samePage) == lanes)
+	{
+		uint32_t page = level.firstPage + pys[first] * level.pagesX + pxs[first];
+		request(page);
+		int32_t slot = pageSlots[page];
+		if (slot >= 0)
+		{
+			const int pageMask = (1 << pageShift) - 1;
+			vint index = ((y & vint(pageMask)) << pageShift) + (x & vint(pageMask));
+			if (texelBytes == 1)
+				return gather(cache.page(slot), index, mask);
+			return gather(reinterpret_cast<const uint32_t*>(cache.page(slot)), index, mask);
+		}
+	}
+
+	// lanes spread over several pages, or a page that is not resident: one lookup per lane
+	alignas(32) float us[SIMD_WIDTH], vs[SIMD_WIDTH];
+	alignas(32) uint32_t texels[SIMD_WIDTH];
+	u.store(us);
+	v.store(vs);
+	for (int i = 0; i < SIMD_WIDTH; i++)
+	{
+		texels[i] = 0;
+		if (lanes >> i & 1)
+		{
+			const std::uint8_t* t = texel(glm::vec2(us[i], vs[i]), mip);
+			texels[i] = texelBytes == 1 ? *t : load32(t);
+		}
+	}
+	return vint::load(texels);
+}
+
+TGAColor VirtualTexture::color(const glm::vec2& uv, int mip) const
+{
+	const std::uint8_t* t = texel(uv, mip);
+	return t ? Framebuffer::unpack(load32(t)) : TGAColor();
+}
+
+vint VirtualTexture::color(const vfloat& u, const vfloat& v, const vfloat& active, int mip) const
+{
+	vfloat mask;
+	return fetch(u, v, active, mip, mask);
+}
+
+std::uint8_t VirtualTexture::r8(const glm::vec2& uv, int mip) const
+{
+	const std::uint8_t* t = texel(uv, mip);
+	return t ? *t : 0;
+}
+
+vfloat VirtualTexture::r8(const vfloat& u, const vfloat& v, const vfloat& active, int mip) const
+{
+	vfloat mask;
+	return toFloat(fetch(u, v, active, mip, mask));
+}
+
+glm::vec3 VirtualTexture::normal(const glm::vec2& uv, int mip) const
+{
+	const std::uint8_t* t = texel(uv, mip);
+	// a texel outside the image is black, which decodes to (-1, -1, -1)
+	if (!t)
+		return glm::vec3(-1.f);
+	std::int16_t oct[2];
+	std::memcpy(oct, t, sizeof(oct));
+	return packing::octDecode(oct);
+}
+
+vvec3 VirtualTexture::normal(const vfloat& u, const vfloat& v, const vfloat& active, int mip) const
+{
+	vfloat mask;
+	vint t = fetch(u, v, active, mip, mask);
+	return PreparedTexture::decodeNormals(t, mask);
+}
+
+PageCache::PageCache(size_t budget)
+	: memory(budget / PAGE_BYTES * PAGE_BYTES + 3), slots(budget / PAGE_BYTES)
+{
+}
+
+const VirtualTexture* PageCache::open(const std::string& imageFile, PreparedTexture::Format format,
+                                      const TGAImage* decoded)
+{
+	const std::string pageFile = imageFile + ".pages";
+	const uint32_t sourceBytes = fileSize(imageFile);
+	std::unique_ptr<VirtualTexture> texture;
+	uint32_t width, height;
+	if (readPageHeader(pageFile, format, sourceBytes, width, height))
+	{
+		texture.reset(new VirtualTexture(*this, format, width, height));
+		// a truncated file is stale too
+		if (fileSize(pageFile) != HEADER_BYTES + texture->pageCount() * PAGE_BYTES)
+			texture.reset();
+	}
+	if (!texture)
+	{
+		// the image is only decoded to build its page file
+		TGAImage image;
+		if (!decoded || decoded->width() == 0)
+		{
+			if (!loadImage(imageFile, image))
+				return nullptr;
+			decoded = &image;
+		}
+		texture.reset(new VirtualTexture(*this, format, decoded->width(), decoded->height()));
+		if (!texture->writePages(*decoded, pageFile, sourceBytes))
+		{
+			std::cerr << "can't write the page file " << pageFile << "\n";
+			return nullptr;
+		}
+		std::cout << "page file " << pageFile << ": " << texture->pageCount() << " pages" << std::endl;
+	}
+	texture->file.open(pageFile, std::ios::binary);
+
+	// the mip tail is loaded once and for all
+	auto free = std::find_if(slots.begin(), slots.end(), [](const Slot& slot) { return !slot.texture; });
+	const uint32_t tail = texture->levels.back().firstPage;
+	if (free == slots.end() || !load(*texture, tail, static_cast<int32_t>(free - slots.begin())))
+	{
+		std::cerr << "no page left for the mip tail of " << imageFile << "\n";
+		return nullptr;
+	}
+	free->pinned = true;
+	textures.push_back(std::move(texture));
+	return textures.back().get();
+}
+
+bool PageCache::load(VirtualTexture& texture, uint32_t page, int32_t slot)
+{
+	Slot& s = slots[slot];
+	if (s.texture)
+	{
+		s.texture->pageSlots[s.page] = -1;
+		s.texture = nullptr;
+		nEvictions++;
+	}
+	texture.file.seekg(HEADER_BYTES + static_cast<std::streamoff>(page) * PAGE_BYTES);
+	texture.file.read(reinterpret_cast<char*>(memory.data() + slot * PAGE_BYTES), PAGE_BYTES);
+	if (!texture.file.good())
+	{
+		texture.file.clear();
+		return false;
+	}
+	s.texture = &texture;
+	s.page = page;
+	s.lastUsed = frame;
+	texture.pageSlots[page] = slot;
+	nLoads++;
+	return true;
+}
+
+size_t PageCache::update()
+{
+	frame++;
+
+	// gather the requests (and clear them for the next frame), the resident pages are used by this frame
+	wanted.clear();
+	for (size_t t = 0; t < textures.size(); t++)
+	{
+		VirtualTexture* texture = textures[t].get();
+		for (int m = 0; m < texture->mipCount(); m++)
+		{
+			const VirtualTexture::Level& level = texture->levels[m];
+			const uint32_t end = level.firstPage + level.pagesX * level.pagesY;
+			for (uint32_t page = level.firstPage; page < end; page++)
+			{
+				if (!texture->requested[page].exchange(0, std::memory_order_relaxed))
+					continue;
+				int32_t slot = texture->pageSlots[page];
+				if (slot >= 0)
+					slots[slot].lastUsed = frame;
+				else
+					wanted.push_back(Request{static_cast<uint32_t>(t), page, m});
+			}
+		}
+	}
+	// a coarse page stands in for all the missing finer pages it covers: load them first. Ties keep the order of the
+	// gathering: a total order makes std::sort deterministic without the heap buffer of std::stable_sort
+	std::sort(wanted.begin(), wanted.end(), [](const Request& a, const Request& b)
+	{
+		if (a.mip != b.mip)
+			return a.mip > b.mip;
+		return a.texture != b.texture ? a.texture < b.texture : a.page < b.page;
+	});
+
+	// free slots first (lastUsed 0), then the least recently requested pages; the pages of this frame stay
+	victims.clear();
+	for (size_t i = 0; i < slots.size(); i++)
+	{
+		if (!slots[i].pinned && (!slots[i].texture || slots[i].lastUsed < frame))
+			victims.push_back(static_cast<int32_t>(i));
+	}
+	std::sort(victims.begin(), victims.end(), [this](int32_t a, int32_t b)
+	{
+		uint64_t usedA = slots[a].texture ? slots[a].lastUsed : 0, usedB = slots[b].texture ? slots[b].lastUsed : 0;
+		return usedA != usedB ? usedA < usedB : a < b;
+	});
+
+	size_t loaded = 0;
+	const size_t n = std::min(wanted.size(), victims.size());
+	for (size_t i = 0; i < n; i++)
+	{
+		if (load(*textures[wanted[i].texture], wanted[i].page, victims[i]))
+			loaded++;
+	}
+	nDropped += wanted.size() - n;
+	return loaded;
+}
+
+size_t PageCache::missing() const
+{
+	size_t count = 0;
+	for (const std::unique_ptr<VirtualTexture>& texture : textures)
+	{
+		for (size_t page = 0; page < texture->pageCount(); page++)
+		{
+			if (texture->requested[page].load(std::memory_order_relaxed) && texture->pageSlots[page] < 0)
+				count++;
+		}
+	}
+	return count;
+}
+
+size_t PageCache::resident() const
+{
+	return std::count_if(slots.begin(), slots.end(), [](const Slot& slot) { return slot.texture != nullptr; });
+}
+
+float uvPerPixel(const Mesh& mesh, const glm::mat4& mvp, float modelScale, float pixelScale)
+{
+	// same distance as selectLOD
+	glm::vec3 center = (mesh.aabbMin + mesh.aabbMax) * 0.5f;
+	float radius = glm::length(mesh.aabbMax - mesh.aabbMin) * 0.5f * modelScale;
+	float distance = (mvp * glm::vec4(center, 1.f)).w - radius;
+	if (distance <= 0.f)
+		return 0.f;
+	// pixels covered by a mesh space unit at that distance
+	float pixels = modelScale * pixelScale / distance;
+	return mesh.uvDensity / pixels;
+}
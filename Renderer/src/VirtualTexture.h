@@ -0,0 +1,163 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "Framebuffer.h"
+#include "PreparedTexture.h"
+#include "Simd.h"
+#include "tgaimage.h"
+
+class Mesh;
+class PageCache;
+
+// Virtual texturing: instead of keeping every texture decoded in memory, each mip level of a texture is split into
+// pages of PageCache::PAGE_BYTES (64x64 texels of 4 bytes, 128x128 for R8), stored once in a page file next to the
+// image (<image>.pages, in the formats of PreparedTexture.h) and read on demand:
+// - the shaders sample a VirtualTexture at the mip of their draw (see mipFor) and record the page each sample wanted
+// - PageCache::update() loads the requested pages that are not resident into a fixed budget of page slots,
+//   evicting the least recently requested ones
+// - a sample whose page is not resident falls back to the closest coarser mip that is; the coarsest level (the mip
+//   tail, the first level that fits in a single page) stays resident
+// A feedback pass (a low resolution render of the frame) is enough to know which pages a frame needs before drawing it.
+// Lookups follow the rules of PreparedTexture: coordinates are truncated and texels outside the image are black.
+class VirtualTexture
+{
+public:
+	int width() const { return levels[0].width; }
+	int height() const { return levels[0].height; }
+	PreparedTexture::Format format() const { return fmt; }
+	int mipCount() const { return static_cast<int>(levels.size()); }
+	size_t pageCount() const { return pageSlots.size(); }
+
+	// the mip to sample when a pixel covers uvPerPixel texture coordinate units (see uvPerPixel()): the finest level
+	// where a pixel covers less than 2 texels, clamped to the mip tail
+	int mipFor(float uvPerPixel) const;
+
+	// RGBA8
+	TGAColor color(const glm::vec2& uv, int mip) const;
+	vint color(const vfloat& u, const vfloat& v, const vfloat& active, int mip) const;
+	// R8
+	std::uint8_t r8(const glm::vec2& uv, int mip) const;
+	vfloat r8(const vfloat& u, const vfloat& v, const vfloat& active, int mip) const;
+	// OCT16
+	glm::vec3 normal(const glm::vec2& uv, int mip) const;
+	vvec3 normal(const vfloat& u, const vfloat& v, const vfloat& active, int mip) const;
+
+private:
+	friend class PageCache;
+
+	struct Level
+	{
+		int width, height;
+		// pages per row and column, index of the first page of the level
+		int pagesX, pagesY;
+		uint32_t firstPage;
+	};
+
+	VirtualTexture(PageCache& cache, PreparedTexture::Format format, int width, int height);
+
+	// writes the page file of image (whose file has sourceBytes bytes) for the levels of this texture
+	bool writePages(const TGAImage& image, const std::string& pageFile, uint32_t sourceBytes) const;
+
+	// first byte of the texel at uv, from the finest resident level at or above mip (nullptr outside the image);
+	// records the page of mip as requested
+	const std::uint8_t* texel(const glm::vec2& uv, int mip) const;
+	// texels of the lanes of mask (0 for the others); records the requested pages
+	vint fetch(const vfloat& u, const vfloat& v, const vfloat& active, int mip, vfloat& mask) const;
+
+	void request(uint32_t page) const
+	{
+		if (!requested[page].load(std::memory_order_relaxed))
+			requested[page].store(1, std::memory_order_relaxed);
+	}
+
+	PageCache& cache;
+	PreparedTexture::Format fmt;
+	// bytes per texel, texels per page side (1 << pageShift)
+	int texelBytes;
+	int pageShift;
+	std::vector<Level> levels;
+	// slot of each page in the cache, -1 when it is not resident (only changed by PageCache::update)
+	std::vector<int32_t> pageSlots;
+	// pages sampled since the last PageCache::update (written by the shading threads)
+	std::unique_ptr<std::atomic<std::uint8_t>[]> requested;
+	// the page file, read by PageCache::update
+	std::ifstream file;
+};
+
+// the page slots shared by all the virtual textures it opens (and owns), allocated once: the memory used by
+// resident pages never exceeds the budget
+class PageCache
+{
+public:
+	static constexpr size_t PAGE_BYTES = 16 * 1024;
+
+	// budget: bytes of page slots
+	explicit PageCache(size_t budget);
+
+	// the virtual texture of an image file in a given format. Its page file (imageFile + ".pages") is built first
+	// if it is missing or stale, from decoded when the image is already in memory, otherwise by decoding the file
+	// (see ImageLoader.h). Returns nullptr if the image cannot be read or the budget cannot hold its mip tail
+	const VirtualTexture* open(const std::string& imageFile, PreparedTexture::Format format,
+	                           const TGAImage* decoded = nullptr);
+
+	// loads the pages requested since the last update that are not resident (coarsest levels first), in slots that
+	// are free or whose page was not requested, least recently requested first. Returns the number of pages loaded;
+	// the requests that do not fit in the budget are dropped (their samples keep falling back to coarser levels)
+	size_t update();
+	// pages requested since the last update that are not resident
+	size_t missing() const;
+
+	size_t capacity() const { return slots.size(); }
+	size_t resident() const;
+	size_t loads() const { return nLoads; }
+	size_t evictions() const { return nEvictions; }
+	size_t dropped() const { return nDropped; }
+
+	const std::uint8_t* page(int32_t slot) const { return memory.data() + slot * PAGE_BYTES; }
+
+private:
+	struct Slot
+	{
+		VirtualTexture* texture = nullptr;
+		uint32_t page = 0;
+		// update() that last saw the page requested
+		uint64_t lastUsed = 0;
+		// mip tails are never evicted
+		bool pinned = false;
+	};
+
+	// a non-resident page requested since the last update (texture: index in textures)
+	struct Request
+	{
+		uint32_t texture;
+		uint32_t page;
+		int mip;
+	};
+
+	// reads a page into a slot, evicting the page it held
+	bool load(VirtualTexture& texture, uint32_t page, int32_t slot);
+
+	// slots.size() pages (+ 3 bytes: gather(const uint8_t*, ...) reads 4 bytes per lane)
+	AlignedBuffer<std::uint8_t> memory;
+	std::vector<Slot> slots;
+	std::vector<std::unique_ptr<VirtualTexture>> textures;
+	// scratch of update(): the requests to load and the slots that may take them, kept from one update to the next
+	// so that they keep their capacity
+	std::vector<Request> wanted;
+	std::vector<int32_t> victims;
+	uint64_t frame = 0;
+	size_t nLoads = 0;
+	size_t nEvictions = 0;
+	size_t nDropped = 0;
+};
+
+// texture coordinate units covered by a pixel at the closest point of the mesh bounding sphere, for a mesh drawn
+// with mvp (modelScale, pixelScale: see selectLOD() in Lod.h). 0 when the mesh reaches the camera
+float uvPerPixel(const Mesh& mesh, const glm::mat4& mvp, float modelScale, float pixelScale);
@@ -0,0 +1,152 @@
+#include "VisibilityBuffer.h"
+
+#include <chrono>
+
+#include "Parallel.h"
+
+extern RasterDiagnostics* Diagnostics;
+
+// std::fill() and the vector constructors take it by reference
+constexpr uint32_t VisibilityBuffer::EMPTY;
+
+VisibilityBuffer::VisibilityBuffer(int w, int h)
+	: width(w), height(h), zbuffer(w, h)
+{
+	ids = AlignedBuffer<std::uint32_t>(zbuffer.pitch() * h);
+	clear();
+}
+
+void VisibilityBuffer::clear()
+{
+	std::fill(ids.data(), ids.data() + ids.size(), EMPTY);
+	zbuffer.clear();
+}
+
+void triangleVisibility(glm::vec4* hcp, uint32_t id, VisibilityBuffer& vb, const std::uint8_t* tileMask)
+{
+	RasterTriangle tri;
+	if (!tri.setup(hcp, vb.width, vb.height))
+	{
+		return;
+	}
+
+	// rasterize the pixels in [rx0, rx1] x [ry0, ry1] (inclusive)
+	auto rasterizeRect = [&](uint32_t rx0, uint32_t rx1, uint32_t ry0, uint32_t ry1)
+	{
+		// the depth buffer is cleared lazily, tile by tile
+		vb.zbuffer.prepare(rx0, rx1, ry0, ry1);
+
+		for (uint32_t y = ry0; y <= ry1; ++y)
+		{
+			float* depthRow = vb.zbuffer.row(y);
+			uint32_t* idRow = vb.row(y);
+			// step the planes along the row exactly like triangle() does
+			float px = rx0 + 0.5f, py = y + 0.5f;
+			float w0 = RasterTriangle::eval(tri.edge[0], px, py);
+			float w1 = RasterTriangle::eval(tri.edge[1], px, py);
+			float w2 = RasterTriangle::eval(tri.edge[2], px, py);
+			float z = RasterTriangle::eval(tri.depthPlane, px, py);
+			for (uint32_t x = rx0; x <= rx1; ++x, w0 += tri.edge[0].x, w1 += tri.edge[1].x, w2 += tri.edge[2].x,
+			     z += tri.depthPlane.x)
+			{
+				if (w0 < 0 || w1 < 0 || w2 < 0)
+				{
+					continue;
+				}
+				if (Diagnostics)
+					Diagnostics->depthTests[y * vb.width + x]++;
+				// Depth-buffer test: no shading here, only remember which triangle won
+				if (z < depthRow[x])
+				{
+					depthRow[x] = z;
+					idRow[x] = id;
+				}
+			}
+		}
+	};
+
+	if (!tileMask)
+	{
+		rasterizeRect(tri.x0, tri.x1, tri.y0, tri.y1);
+		return;
+	}
+	const uint32_t tileSize = VisibilityBuffer::TILE_SIZE;
+	const uint32_t tilesX = (vb.width + tileSize - 1) / tileSize;
+	for (uint32_t ty = tri.y0 / tileSize; ty <= tri.y1 / tileSize; ++ty)
+	{
+		for (uint32_t tx = tri.x0 / tileSize; tx <= tri.x1 / tileSize; ++tx)
+		{
+			if (tileMask[ty * tilesX + tx])
+				rasterizeRect(std::max(tri.x0, tx * tileSize), std::min(tri.x1, tx * tileSize + tileSize - 1),
+				              std::max(tri.y0, ty * tileSize), std::min(tri.y1, ty * tileSize + tileSize - 1));
+		}
+	}
+}
+
+void shadeVisibility(const VisibilityBuffer& vb, const std::vector<Mesh>& meshes,
+                     const ShaderPool& shaders, Framebuffer& image, const std::uint8_t* pixelMask)
+{
+	const uint32_t tilesX = (vb.width + VisibilityBuffer::TILE_SIZE - 1) / VisibilityBuffer::TILE_SIZE;
+	const uint32_t tilesY = (vb.height + VisibilityBuffer::TILE_SIZE - 1) / VisibilityBuffer::TILE_SIZE;
+
+	// each worker shades with its own shaders (the vertex stage runs again at the first pixel of every tile)
+	parallelForWorkers(tilesX * tilesY, [&](uint32_t tile, uint32_t worker)
+	{
+		auto start = std::chrono::steady_clock::now();
+		uint32_t tx = tile % tilesX;
+		uint32_t ty = tile / tilesX;
+		uint32_t x0 = tx * VisibilityBuffer::TILE_SIZE;
+		uint32_t y0 = ty * VisibilityBuffer::TILE_SIZE;
+		uint32_t x1 = std::min<uint32_t>(x0 + VisibilityBuffer::TILE_SIZE, vb.width);
+		uint32_t y1 = std::min<uint32_t>(y0 + VisibilityBuffer::TILE_SIZE, vb.height);
+
+		uint32_t currentID = VisibilityBuffer::EMPTY;
+		IShader* shader = nullptr;
+		RasterTriangle tri;
+		Vertex scratch;
+
+		for (uint32_t y = y0; y < y1; ++y)
+		{
+			const uint32_t* idRow = vb.row(y);
+			const std::uint8_t* maskRow = pixelMask ? pixelMask + y * vb.zbuffer.pitch() : nullptr;
+			uint32_t* colorRow = image.row(y);
+			for (uint32_t x = x0; x < x1; ++x)
+			{
+				uint32_t id = idRow[x];
+				if (id == VisibilityBuffer::EMPTY || (maskRow && !maskRow[x]))
+				{
+					continue;
+				}
+				if (id != currentID)
+				{
+					// neighboring pixels mostly share a triangle, so the vertex stage only runs again on ID changes
+					uint32_t m = VisibilityBuffer::meshOf(id);
+					uint32_t t = VisibilityBuffer::triangleOf(id);
+					shader = &shaders.get(worker, m);
+					glm::vec4 hcp[3];
+					for (int j = 0; j < 3; j++)
+						shader->vertex(meshes[m].fetch(meshes[m].indices[3 * t + j], scratch), j, hcp[j]);
+					tri.setup(hcp, vb.width, vb.height, shader->v_Varyings, shader->nVaryings);
+					currentID = id;
+				}
+
+				glm::vec4 gl_FragCoord = tri.fragCoord(x, y);
+				float varyings[MAX_VARYINGS];
+				tri.interpolate(gl_FragCoord, varyings);
+				TGAColor color;
+				if (Diagnostics)
+					Diagnostics->shadeCount[y * vb.width + x]++;
+				// discarded fragments cannot reveal what is behind them in this mode
+				if (!shader->fragment(gl_FragCoord, varyings, color))
+					colorRow[x] = Framebuffer::pack(color);
+			}
+		}
+
+		if (Diagnostics)
+		{
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			Diagnostics->tileTime[(y0 / RasterDiagnostics::TILE_SIZE) * Diagnostics->tilesX
+				+ x0 / RasterDiagnostics::TILE_SIZE] += elapsed.count();
+		}
+	});
+}
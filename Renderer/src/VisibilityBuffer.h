@@ -0,0 +1,65 @@
+#pragma once
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+#include "ShaderPool.h"
+#include "tinyOpenGL.h"
+
+// Visibility buffer (deferred) shading renders a frame in two phases:
+// 1) triangleVisibility() only rasterizes depth and a packed (mesh, triangle) ID per pixel
+// 2) shadeVisibility() reconstructs the plane equations of the visible triangle
+//    and runs the fragment shader exactly once per covered pixel
+// so shading cost depends on the resolution only, not on how many layers the scene has.
+struct VisibilityBuffer
+{
+	// ID of the pixels not covered by any triangle
+	static constexpr uint32_t EMPTY = 0xffffffff;
+	// the upper MESH_BITS bits of an ID store the mesh index, the rest the triangle index within the mesh
+	static constexpr uint32_t MESH_BITS = 10;
+	static constexpr uint32_t TRIANGLE_MASK = (1u << (32 - MESH_BITS)) - 1;
+	// meshes and triangles per mesh an ID can tell apart: the triangle index TRIANGLE_MASK is reserved, so that no
+	// (mesh, triangle) pair packs to EMPTY
+	static constexpr uint32_t MAX_MESHES = 1u << MESH_BITS;
+	static constexpr uint32_t MAX_TRIANGLES = TRIANGLE_MASK;
+	// phase two shades the screen in TILE_SIZE x TILE_SIZE tiles in parallel
+	static constexpr uint32_t TILE_SIZE = 16;
+
+	VisibilityBuffer(int w, int h);
+
+	// resets all IDs to EMPTY and the depth to the far plane
+	void clear();
+
+	// whether the triangles of a mesh can be packed into IDs (the deferred paths skip the meshes that cannot)
+	static bool canPack(size_t mesh, size_t triangleCount)
+	{
+		return mesh < MAX_MESHES && triangleCount <= MAX_TRIANGLES;
+	}
+	static uint32_t packID(uint32_t mesh, uint32_t triangle)
+	{
+		assert(mesh < MAX_MESHES && triangle < MAX_TRIANGLES);
+		return mesh << (32 - MESH_BITS) | triangle;
+	}
+	static uint32_t meshOf(uint32_t id) { return id >> (32 - MESH_BITS); }
+	static uint32_t triangleOf(uint32_t id) { return id & TRIANGLE_MASK; }
+
+	std::uint32_t* row(int y) { return ids.data() + y * zbuffer.pitch(); }
+	const std::uint32_t* row(int y) const { return ids.data() + y * zbuffer.pitch(); }
+
+	int width;
+	int height;
+	// one ID per pixel, rows are laid out like the depth buffer
+	AlignedBuffer<std::uint32_t> ids;
+	DepthBuffer zbuffer;
+};
+
+// phase one: depth test the triangle and store its ID (see VisibilityBuffer::packID) in the covered pixels.
+// tileMask (optional): one flag per TILE_SIZE x TILE_SIZE tile, only the pixels of the flagged tiles are written
+void triangleVisibility(glm::vec4* hcp, uint32_t id, VisibilityBuffer& vb, const std::uint8_t* tileMask = nullptr);
+
+// phase two: for every visible pixel, re-run the vertex shader of its triangle (once per run of equal IDs),
+// recompute its plane equations and run the fragment shader with the interpolated varyings.
+// shaders: the shaders of the meshes for each worker (see ShaderPool), with their uniforms set.
+// pixelMask (optional): one flag per pixel, rows laid out like the IDs, only the flagged pixels are shaded
+void shadeVisibility(const VisibilityBuffer& vb, const std::vector<Mesh>& meshes,
+                     const ShaderPool& shaders, Framebuffer& image, const std::uint8_t* pixelMask = nullptr);
@@ -1,6 +1,23 @@
-﻿#include "Model.h"
+﻿#include "AllocationCounter.h"
+#include "FrameArena.h"
+#include "FramePipeline.h"
+#include "GBuffer.h"
+#include "Lod.h"
+#include "Model.h"
+#include "Multisample.h"
+#include "Occlusion.h"
+#include "Reprojection.h"
+#include "ShaderPool.h"
+#include "ShadowMap.h"
+#include "Skinning.h"
 #include "tinyOpenGL.h"
+#include "VirtualTexture.h"
+#include "VisibilityBuffer.h"
+#include <glm/gtc/type_ptr.hpp>
 #include <glm/gtx/string_cast.hpp>
+#include <chrono>
+#include <iostream>
+#include <numeric>
 
 #include "tgaimage.h"
 
@@ -8,6 +25,54 @@
 const glm::vec3 eye(1, 1, 3);
 const glm::vec3 center(0, 0, 0);
 const glm::vec3 up(0, 1, 0);
+// direction towards the (directional) light
+const glm::vec3 lightDir(1.f, 1.f, 0.5f);
+
+// write overdraw/depth complexity/tile time heatmaps next to the rendered image
+const bool diagnosticMode = false;
+// rasterize depth + triangle IDs first, then shade every visible pixel exactly once
+const bool deferredShading = false;
+// deferred path through a G-buffer (see GBuffer.h), then turn the light around the model a few times
+// re-running only the lighting (2_light<i>.tga, without shadows)
+const bool gbufferRelighting = false;
+// shade SIMD_WIDTH pixels at a time with Shader::fragmentPacket (forward path only)
+const bool packetShading = true;
+// draw a row of tinted copies of the model with drawElementsInstanced (forward path only)
+const int instanceCount = 0;
+// when > 0, draw each mesh (instance) with the coarsest level of detail whose error stays under this many pixels
+const float lodPixelError = 0.f;
+// rasterize the occluders into a small depth buffer first and skip the meshes (instances) hidden behind them
+const bool occlusionCulling = false;
+// storage of the depth buffer: FLOAT32, REVERSED_Z, UNORM24 or UNORM16 (forward path only)
+const DepthBuffer::Format depthFormat = DepthBuffer::FLOAT32;
+// anti-alias with 2, 4 or 8 samples per pixel, shaded once per pixel (0: off; forward path without instances)
+const int msaaSamples = 0;
+// shadow the light with a shadow map (3x3 PCF), rendered once and reused while the light and the meshes do not change
+const bool shadowMapping = false;
+// keep the (non skinned) meshes in the compact vertex format of PackedVertex.h, decoded by the vertex stage
+const bool compactVertices = false;
+// convert the textures of the model to the formats of PreparedTexture.h when it is loaded (normal maps: octahedral
+// 2x16-bit, specular maps: 8-bit) instead of decoding the TGA texels in the fragment shader
+const bool preparedTextures = false;
+// render a turntable of this many frames (the camera orbits the model) to 2_<i>.tga instead of 2.tga (forward path);
+// up to framesInFlight frames are encoded and written in the background while the next ones are rendered
+const int turntableFrames = 0;
+const int framesInFlight = 3;
+// render the turntable through the deferred path, reusing the shading of the previous frame for the pixels that are
+// still visible (see Reprojection.h): only disocclusions and pixels that fail the depth/ID check are shaded
+const bool reprojectionCache = false;
+// render the model from this many cameras around it (like the turntable) in a single multi-view submission
+// (drawElementsMultiView) to 2_view<i>.tga instead of 2.tga, without the heatmaps and the variable rate shading
+const int multiViewCount = 0;
+// stream the textures as pages (see VirtualTexture.h) through a cache of this many KB: the images are only decoded to
+// build their page files, and a low resolution feedback pass before each frame loads the pages it samples (0: off)
+const size_t pageBudgetKB = 0;
+// when > 0, variable rate shading (see ShadingRate.h): the tiles where a 2x2 or 4x4 block of pixels spans at most this
+// many texels of the diffuse map are shaded once per block (forward path with packet shading)
+const float coarseShadingTexels = 0.f;
+// turn the first child node of the model hierarchy a little more at every frame of the turntable and at every light of
+// the G-buffer look-dev loop: only the meshes of its subtree move, the shadow map and their G-buffer tiles are rebuilt
+const bool animateNode = false;
 
 extern glm::mat4 View; // "OpenGL" state matrices
 extern glm::mat4 Projection;
@@ -55,6 +120,16 @@ struct Shader : IShader
 #endif
 
 
+// size in texels (largest side) of a texture, in whichever form it is kept
+static int textureSize(const Texture& tex)
+{
+	if (tex.paged)
+		return std::max(tex.paged->width(), tex.paged->height());
+	if (!tex.prepared.empty())
+		return std::max(tex.prepared.width(), tex.prepared.height());
+	return std::max(tex.data.width(), tex.data.height());
+}
+
 struct Shader : IShader
 {
 	const Mesh& mesh;
@@ -64,79 +139,293 @@ struct Shader : IShader
 	glm::mat4 u_NormalMat;
 	glm::mat4 u_View;
 	glm::mat4 u_Projection;
+	// u_Projection * u_View * u_Model, computed once per draw (or per instance) instead of once per vertex
+	glm::mat4 u_MVP;
 	glm::vec3 u_LightDir;
+	// normalize(u_Model * u_LightDir), computed once per draw (or per instance) instead of once per pixel
+	glm::vec3 u_ModelLightDir;
+	// material: constant ambient term (0..255) and weight of the specular highlight
+	float u_Ambient = 5.f;
+	float u_SpecularStrength = 1.5f;
+	// per-instance color multiplier (rgba)
+	glm::vec4 u_Tint{1.f};
+	// shadow map of u_LightDir (nullptr: no shadows) and the matrix from model space to its light NDC space
+	const ShadowMap* u_ShadowMap = nullptr;
+	glm::mat4 u_LightMVP;
 
 	// texture unit number
 	unsigned texture_diffuse1;
 
-	// all varying attributes are written by the vertex shader, read by the fragment shader
+	// varyings slots: 0, 1 hold the texture coordinates, 2, 3, 4 the light NDC position (only with a shadow map)
+	static constexpr int v_TexCoord = 0;
+	static constexpr int v_ShadowCoord = 2;
 
-	// triangle vertex: v1, v2, v3 has the following uv structure
-	// [ v1.u v2.u v3.u ]
-	// [ v1.v v2.v v3.v ]
-	glm::mat3x2 v_TexCoord;
+	// the textures of the mesh by type (the last one of each type, nullptr if there is none), bound once per draw
+	// instead of being looked up by name per fragment
+	const Texture* diffuseMap = nullptr;
+	const Texture* normalMap = nullptr;
+	const Texture* specularMap = nullptr;
+	// the mip level each paged texture is sampled at (see bindMips)
+	int diffuseMip = 0;
+	int normalMip = 0;
+	int specularMip = 0;
 
 	Shader(const Mesh& m) : mesh(m)
 	{
+		nVaryings = 2;
+		for (const auto& tex : mesh.textures)
+		{
+			if (tex.type == "texture_diffuse")
+				diffuseMap = &tex;
+			else if (tex.type == "texture_normal")
+				normalMap = &tex;
+			else if (tex.type == "texture_specular")
+				specularMap = &tex;
+		}
+		// the shading rate follows the texel footprint of the diffuse map
+		if (diffuseMap)
+		{
+			rateVarying = v_TexCoord;
+			rateTexels = static_cast<float>(textureSize(*diffuseMap));
+		}
+	}
+
+	// picks the mip of the paged textures for a draw whose pixels cover uvPerPixel texture coordinate units
+	void bindMips(float uvPerPixel)
+	{
+		if (diffuseMap && diffuseMap->paged)
+			diffuseMip = diffuseMap->paged->mipFor(uvPerPixel);
+		if (normalMap && normalMap->paged)
+			normalMip = normalMap->paged->mipFor(uvPerPixel);
+		if (specularMap && specularMap->paged)
+			specularMip = specularMap->paged->mipFor(uvPerPixel);
 	}
 
-	// a_XXX represents vertex attribute that differs for each vertex
+	// vertex attributes differ for each vertex
 	// they only applies to vertex shader, thus we set them as parameters of vertex() function 
 	// nthVertex is needed for varying attributes
-	void vertex(const glm::vec3& a_Position, const glm::vec2& a_TexCoord, const int nthVert,
-	            glm::vec4& gl_Position)
+	void vertex(const Vertex& v, const int nthVert, glm::vec4& gl_Position) override
 	{
 		// receive the tex coords in the vertex shader and then pass them to the fragment shader 
-		v_TexCoord[nthVert] = a_TexCoord;
-		gl_Position = u_Projection * u_View * u_Model * glm::vec4(a_Position, 1.f);
+		varying(nthVert, v_TexCoord, v.TexCoords);
+		if (u_ShadowMap)
+			varying(nthVert, v_ShadowCoord, glm::vec3(u_LightMVP * glm::vec4(v.Position, 1.f)));
+		gl_Position = u_MVP * glm::vec4(v.Position, 1.f);
 	}
 
-	bool fragment(const glm::vec4& bar, TGAColor& gl_FragColor, float r0z, float r1z, float r2z) override
+	// none of the varyings depends on the camera: the views of a multi-view draw share them
+	bool worldVertex(const Vertex& v, const int nthVert, WorldVertex& out) override
 	{
-		// compute interpolated attributes (In real OpenGL, these attributes are interpolated before fragment shader executes)
-		glm::vec2 uv = bar.w * (v_TexCoord[0] * r0z * bar[0]
-			+ v_TexCoord[1] * r1z * bar[1]
-			+ v_TexCoord[2] * r2z * bar[2]);
+		varying(nthVert, v_TexCoord, v.TexCoords);
+		if (u_ShadowMap)
+			varying(nthVert, v_ShadowCoord, glm::vec3(u_LightMVP * glm::vec4(v.Position, 1.f)));
+		out.position = glm::vec3(u_Model * glm::vec4(v.Position, 1.f));
+		out.normal = glm::vec3(u_NormalMat * glm::vec4(v.Normal, 0.f));
+		out.tangent = glm::vec3(u_Model * glm::vec4(v.Tangent, 0.f));
+		out.bitangent = glm::vec3(u_Model * glm::vec4(v.Bitangent, 0.f));
+		return true;
+	}
+
+	bool surface(const glm::vec4& gl_FragCoord, const float* varyings, Surface& out) override
+	{
+		// the rasterizer already interpolated the attributes (like in real OpenGL)
+		glm::vec2 uv = glm::make_vec2(varyings + v_TexCoord);
 
 		TGAColor diffuseValue{};
-		TGAColor specularValue{};
-		TGAColor normalValue{};
+		std::uint8_t specularValue = 0;
 		glm::vec3 n{};
-		for (const auto& tex : mesh.textures)
+		if (diffuseMap)
 		{
-			if (tex.type == "texture_diffuse")
+			const PreparedTexture& tex = diffuseMap->prepared;
+			if (diffuseMap->paged)
+				diffuseValue = diffuseMap->paged->color(uv, diffuseMip);
+			else
+				diffuseValue = tex.empty() ? sample2D(diffuseMap->data, uv) : tex.color(uv);
+		}
+		if (normalMap)
+		{
+			const PreparedTexture& tex = normalMap->prepared;
+			if (normalMap->paged)
 			{
-				diffuseValue = sample2D(tex.data, uv);
+				n = normalMap->paged->normal(uv, normalMip);
 			}
-			else if (tex.type == "texture_normal")
+			else if (tex.empty())
 			{
-				normalValue = sample2D(tex.data, uv);
+				TGAColor normalValue = sample2D(normalMap->data, uv);
 				// convert normal from [0, 255] to [-1,1]
 				n = glm::vec3(normalValue[0], normalValue[1], normalValue[2]) * 2.f / 255.f -
 					glm::vec3(1.f, 1.f, 1.f);
 			}
-			else if (tex.type == "texture_specular")
+			else
 			{
-				specularValue = sample2D(tex.data, uv);
+				n = tex.normal(uv);
 			}
 		}
+		if (specularMap)
+		{
+			const PreparedTexture& tex = specularMap->prepared;
+			if (specularMap->paged)
+				specularValue = specularMap->paged->r8(uv, specularMip);
+			else
+				specularValue = tex.empty() ? sample2D(specularMap->data, uv)[0] : tex.r8(uv);
+		}
+
+		out.albedo = diffuseValue;
+		out.normal = glm::normalize(u_NormalMat * glm::vec4(n, 0.f));
+		out.specular = specularValue;
+		return false; // the pixel is not discarded
+	}
+
+	void lighting(const Surface& surface, TGAColor& gl_FragColor) const override
+	{
+		shade(surface, 1.f, gl_FragColor);
+	}
 
+	bool fragment(const glm::vec4& gl_FragCoord, const float* varyings, TGAColor& gl_FragColor) override
+	{
+		Surface s;
+		surface(gl_FragCoord, varyings, s);
+		float visibility = u_ShadowMap ? u_ShadowMap->visibility(glm::make_vec3(varyings + v_ShadowCoord)) : 1.f;
+		shade(s, visibility, gl_FragColor);
+		return false; // the pixel is not discarded
+	}
+
+	// diffuse and specular lighting of a surface, scaled by the fraction of the light that reaches it
+	// (the ambient term stays in the shadow)
+	void shade(const Surface& s, float visibility, TGAColor& gl_FragColor) const
+	{
 		// diffuse
-		glm::vec3 norm = glm::normalize(u_NormalMat * glm::vec4(n, 0.f));
-		glm::vec3 lightDir = glm::normalize(u_Model * glm::vec4(u_LightDir, 0.f));
-		float diff = std::max(glm::dot(norm, lightDir), 0.f);
+		const glm::vec3& lightDir = u_ModelLightDir;
+		float diff = std::max(glm::dot(s.normal, lightDir), 0.f) * visibility;
 
-		// specular
-		glm::vec3 r = glm::reflect(-lightDir, norm);
-		float spec = std::pow(std::max(r.z, 0.f), specularValue[0]);
-		TGAColor c = diffuseValue;
+		// specular (pow(0, n) is 0, or 1 for n = 0)
+		glm::vec3 r = glm::reflect(-lightDir, s.normal);
+		float spec = (r.z > 0.f ? std::pow(r.z, s.specular) : s.specular == 0) * visibility;
+
+		// TGAColor is BGRA, u_Tint is RGBA
 		for (int i : {0, 1, 2})
-			gl_FragColor[i] = std::min<int>(5 + c[i] * (diff + 1.5f * spec), 255);
+			gl_FragColor[i] = std::min<int>(
+				u_Ambient + s.albedo.bgra[i] * u_Tint[2 - i] * (diff + u_SpecularStrength * spec), 255);
+	}
 
-		return false; // the pixel is not discarded
+	bool packetShading() const override
+	{
+		return ::packetShading;
+	}
+
+	void instance(const glm::mat4& mvp, const glm::mat4& model, const glm::vec4& tint) override
+	{
+		u_MVP = mvp;
+		u_Model = model;
+		u_NormalMat = glm::transpose(glm::inverse(model));
+		u_Tint = tint;
+		u_ModelLightDir = glm::normalize(u_Model * glm::vec4(u_LightDir, 0.f));
+		if (u_ShadowMap)
+			u_LightMVP = u_ShadowMap->lightViewProjection() * model;
+	}
+
+	// same lighting as fragment(), for SIMD_WIDTH pixels at once
+	void fragmentPacket(FragmentPacket& packet, vint& gl_FragColor) override
+	{
+		const vfloat& u = packet.varyings[v_TexCoord];
+		const vfloat& v = packet.varyings[v_TexCoord + 1];
+
+		vint diffuseValue(0);
+		vfloat specularValue(0.f);
+		vvec3 n(0.f, 0.f, 0.f);
+		if (diffuseMap)
+		{
+			const PreparedTexture& tex = diffuseMap->prepared;
+			if (diffuseMap->paged)
+				diffuseValue = diffuseMap->paged->color(u, v, packet.active, diffuseMip);
+			else
+				diffuseValue = tex.empty() ? sample2D(diffuseMap->data, u, v, packet.active) : tex.color(u, v, packet.active);
+		}
+		if (normalMap)
+		{
+			const PreparedTexture& tex = normalMap->prepared;
+			if (normalMap->paged)
+			{
+				n = normalMap->paged->normal(u, v, packet.active, normalMip);
+			}
+			else if (tex.empty())
+			{
+				vint normalValue = sample2D(normalMap->data, u, v, packet.active);
+				// convert normal from [0, 255] to [-1,1]
+				n = vvec3(channel(normalValue, 0), channel(normalValue, 1), channel(normalValue, 2)) * (2.f / 255.f)
+					- vvec3(glm::vec3(1.f, 1.f, 1.f));
+			}
+			else
+			{
+				n = tex.normal(u, v, packet.active);
+			}
+		}
+		if (specularMap)
+		{
+			const PreparedTexture& tex = specularMap->prepared;
+			if (specularMap->paged)
+				specularValue = specularMap->paged->r8(u, v, packet.active, specularMip);
+			else
+				specularValue = tex.empty() ? channel(sample2D(specularMap->data, u, v, packet.active), 0)
+				                            : tex.r8(u, v, packet.active);
+		}
+
+		// diffuse
+		vvec3 norm = normalize(u_NormalMat * n);
+		const glm::vec3& lightDir = u_ModelLightDir;
+		vfloat diff = max(dot(norm, vvec3(lightDir)), 0.f);
+
+		// specular
+		vvec3 r = reflect(vvec3(-lightDir), norm);
+		vfloat spec = pow(max(r.z, 0.f), specularValue);
+		vfloat intensity = diff + u_SpecularStrength * spec;
+		if (u_ShadowMap)
+		{
+			vvec3 shadowCoord(packet.varyings[v_ShadowCoord], packet.varyings[v_ShadowCoord + 1],
+			                  packet.varyings[v_ShadowCoord + 2]);
+			intensity *= u_ShadowMap->visibility(shadowCoord, packet.active);
+		}
+		vfloat rgb[3];
+		for (int i : {0, 1, 2})
+			rgb[i] = min(u_Ambient + channel(diffuseValue, i) * u_Tint[2 - i] * intensity, 255.f);
+		gl_FragColor = packColor(rgb[0], rgb[1], rgb[2]);
 	}
 };
 
+// the eye turned by angle (radians) around the up axis through center
+static glm::vec3 orbit(float angle)
+{
+	return center + glm::vec3(glm::rotate(glm::mat4(1.f), angle, up) * glm::vec4(eye - center, 0.f));
+}
+
+// pixels covered by one world unit at distance 1 (see lodPixelScale), set by main() with the projection
+static float PixelScale = 0.f;
+
+// set the uniforms shared by every draw of this frame
+// light: direction towards the light, view: camera of the frame
+static void setUniforms(Shader& shader, const ShadowMap* shadowMap = nullptr, const glm::vec3& light = lightDir,
+                        const glm::mat4& view = View)
+{
+	// the mesh goes where its node of the model hierarchy puts it (skinned meshes: the identity, their bone palette
+	// already placed them)
+	glm::mat4 Model = shader.mesh.transform;
+	shader.u_Model = Model;
+	shader.u_NormalMat = glm::transpose(glm::inverse(Model));
+	shader.u_View = view;
+	shader.u_Projection = Projection;
+	shader.u_MVP = Projection * view * Model;
+	shader.u_LightDir = light;
+	shader.u_ModelLightDir = glm::normalize(Model * glm::vec4(light, 0.f));
+	shader.u_ShadowMap = shadowMap;
+	if (shadowMap)
+	{
+		shader.u_LightMVP = shadowMap->lightViewProjection() * Model;
+		shader.nVaryings = 5;
+	}
+	// paged textures are sampled at the mip of the closest point of the mesh
+	shader.bindMips(uvPerPixel(shader.mesh, shader.u_MVP, maxScale(Model), PixelScale));
+}
+
 // Rendering Pipeline:
 // (1第一步) Vertex Data
 // (2第二步) Primitive Processing
@@ -155,7 +444,9 @@ int main()
 {
 	// (1第一步) Vertex Data
 	// (2第二步) Primitive Processing
-	Model ourModel("assets/obj/african_head/african_head.obj"); // use "/" for file path
+	const std::string modelPath = "assets/obj/african_head/african_head.obj"; // use "/" for file path
+	// paged textures are only decoded if their page files have to be built
+	Model ourModel(modelPath, false, pageBudgetKB == 0);
 
 	uint32_t imageWidth = 800;
 	uint32_t imageHeight = 800;
@@ -166,42 +457,511 @@ int main()
 	// initialize lookat and projecton matrix
 	lookat(eye, center);
 	projection(fovy, aspect, near, far);
+	PixelScale = lodPixelScale(Projection, imageHeight);
+
+	Framebuffer framebuffer(imageWidth, imageHeight);
+	DepthBuffer zbuffer(imageWidth, imageHeight, depthFormat);
+
+	// bone palette uniform of this frame (identity: bind pose); skin every skinned mesh once before drawing
+	std::vector<glm::mat4> bonePalette(ourModel.boneCounter, glm::mat4(1.f));
+	for (Mesh& mesh : ourModel.meshes)
+	{
+		if (mesh.skinned)
+			skinMesh(mesh, bonePalette);
+	}
+
+	// the simplified index buffers are cached next to the model
+	if (lodPixelError > 0.f)
+		buildLODs(ourModel.meshes, modelPath + ".lod");
 
-	TGAImage framebuffer(imageWidth, imageHeight, TGAImage::RGB);
-	std::vector<float> zbuffer(imageWidth * imageHeight, std::numeric_limits<float>::max());
+	if (compactVertices)
+	{
+		size_t before = 0, after = 0;
+		for (Mesh& mesh : ourModel.meshes)
+		{
+			before += mesh.vertexCount() * sizeof(Vertex);
+			after += mesh.pack() ? mesh.vertexCount() * sizeof(PackedVertex) : mesh.vertexCount() * sizeof(Vertex);
+		}
+		std::cout << "vertices: " << before / 1024 << " KB -> " << after / 1024 << " KB" << std::endl;
+	}
 
+	// the deferred paths identify a pixel's triangle by a 32-bit ID (see VisibilityBuffer::packID)
+	if (deferredShading || gbufferRelighting || (reprojectionCache && turntableFrames > 0))
+	{
+		for (size_t m = 0; m < ourModel.meshes.size(); m++)
+		{
+			if (!VisibilityBuffer::canPack(m, ourModel.meshes[m].indices.size() / 3))
+				std::cerr << "mesh " << m << " is skipped: too many meshes or triangles for a visibility buffer ID\n";
+		}
+	}
+
+	// the pages are owned by the cache, which the meshes outlive
+	PageCache pageCache(pageBudgetKB * 1024);
+	if (pageBudgetKB > 0)
+	{
+		size_t paged = ourModel.pageTextures(pageCache);
+		std::cout << "virtual textures: " << paged << " textures paged, " << pageCache.capacity() << " pages of "
+			<< PageCache::PAGE_BYTES / 1024 << " KB" << std::endl;
+	}
 
-	// iterate through all meshes
-	for (size_t m = 0; m < ourModel.meshes.size(); m++)
+	if (preparedTextures)
 	{
-		Shader shader(ourModel.meshes[m]);
-		// we want our mesh to be where it is originally 
-		glm::mat4 Model = glm::mat4(1.f);
-		shader.u_Model = Model;
-		shader.u_NormalMat = glm::transpose(glm::inverse(Model));
-		shader.u_View = View;
-		shader.u_Projection = Projection;
-		shader.u_LightDir = glm::vec3(1.f, 1.f, 0.5f);
-		// iterate through each triangle in the mesh
-		for (size_t i = 0; i < ourModel.meshes[m].indices.size(); i += 3)
+		size_t before = 0, after = 0;
+		for (Mesh& mesh : ourModel.meshes)
 		{
-			glm::vec4 homogeneousClipSpace[3];
-			for (int j = 0; j < 3; j++)
+			for (const Texture& tex : mesh.textures)
+				before += static_cast<size_t>(tex.data.width()) * tex.data.height() * tex.data.bytespp();
+			after += mesh.prepareTextures();
+		}
+		// the model keeps a copy of every image it loaded to share them between its meshes
+		std::vector<Texture>().swap(ourModel.textures_loaded);
+		std::cout << "textures: " << before / 1024 << " KB -> " << after / 1024 << " KB" << std::endl;
+	}
+
+	// the shadow map is only rendered again when the light or the posed meshes change
+	ShadowMap shadowMap;
+	if (shadowMapping)
+	{
+		bool rendered = shadowMap.update(ourModel.meshes, lightDir);
+		std::cout << "shadow map: " << (rendered ? "rendered" : "cached") << std::endl;
+	}
+	const ShadowMap* shadows = shadowMapping ? &shadowMap : nullptr;
+
+	// the node turned by animateNode (-1: the hierarchy has no child node) and its pose at load time
+	int posedNode = -1;
+	for (size_t n = 0; n < ourModel.hierarchy.size() && posedNode < 0; n++)
+	{
+		if (ourModel.hierarchy.parent(static_cast<int>(n)) >= 0)
+			posedNode = static_cast<int>(n);
+	}
+	const glm::mat4 restPose = posedNode >= 0 ? ourModel.hierarchy.local(posedNode) : glm::mat4(1.f);
+	size_t posedNodes = 0, poses = 0, shadowRenders = 0;
+	// poses the model for frame i: nodes moved since the last pose take their meshes with them
+	auto poseFrame = [&](int i)
+	{
+		if (animateNode && posedNode >= 0)
+		{
+			ourModel.hierarchy.setLocal(posedNode, restPose * glm::rotate(glm::mat4(1.f), 0.25f * i, up));
+			poses++;
+		}
+		posedNodes += ourModel.hierarchy.update(ourModel.meshes);
+	};
+
+	RasterDiagnostics diagnostics(imageWidth, imageHeight);
+	if (diagnosticMode)
+		setDiagnostics(&diagnostics);
+
+	// its counters give the shading rate distribution of the forward draws
+	ShadingRate shadingRate;
+	shadingRate.maxTexels = coarseShadingTexels;
+	if (coarseShadingTexels > 0.f)
+		setShadingRate(&shadingRate);
+
+	// transient data of the frame (see FrameArena.h), reset after every frame of a sequence
+	FrameArena arena;
+	setFrameArena(&arena);
+
+	// the instances are spread along the x axis, every other one is tinted red
+	std::vector<Instance> instances(instanceCount);
+	for (int i = 0; i < instanceCount; i++)
+	{
+		instances[i].model = glm::translate(glm::mat4(1.f), glm::vec3(2.f * (i - instanceCount / 2), 0.f, -2.f * i));
+		instances[i].tint = i % 2 ? glm::vec4(1.f, 0.5f, 0.5f, 1.f) : glm::vec4(1.f);
+	}
+	// allocated once, cleared by every frame
+	OcclusionBuffer occlusion;
+	std::unique_ptr<MultisampleBuffer> multisample;
+	if (msaaSamples > 0)
+		multisample.reset(new MultisampleBuffer(imageWidth, imageHeight, msaaSamples, depthFormat));
+
+	// draws per level of detail selected by the forward path (the last one counts the coarser levels too)
+	std::vector<size_t> lodDraws(4);
+
+	// forward path: draws every mesh (instance) into target, the depth buffer must be cleared
+	auto drawForward = [&](Framebuffer& target)
+	{
+		if (occlusionCulling)
+		{
+			occlusion.clear();
+			for (const Mesh& mesh : ourModel.meshes)
+			{
+				if (instanceCount == 0 && occlusion.isOccluder(mesh, Projection * View * mesh.transform))
+					occlusion.drawOccluder(mesh, Projection * View * mesh.transform);
+				for (const Instance& instance : instances)
+				{
+					glm::mat4 mvp = Projection * View * instance.model * mesh.transform;
+					if (occlusion.isOccluder(mesh, mvp))
+						occlusion.drawOccluder(mesh, mvp);
+				}
+			}
+			setOcclusion(&occlusion);
+		}
+
+		if (multisample)
+			multisample->clear();
+
+		// iterate through all meshes
+		for (size_t m = 0; m < ourModel.meshes.size(); m++)
+		{
+			Shader shader(ourModel.meshes[m]);
+			setUniforms(shader, shadows);
+			if (instanceCount > 0)
+				drawElementsInstanced(ourModel.meshes[m], shader, Projection * View, instances, target, zbuffer,
+				                      lodPixelError, PixelScale);
+			else if (!occlusionCulling || occlusion.testBox(shader.u_MVP, ourModel.meshes[m].aabbMin, ourModel.meshes[m].aabbMax))
+			{
+				int lod = 0;
+				if (lodPixelError > 0.f)
+				{
+					lod = selectLOD(ourModel.meshes[m], shader.u_MVP, maxScale(shader.u_Model), PixelScale, lodPixelError);
+					lodDraws[std::min<size_t>(lod, lodDraws.size() - 1)]++;
+				}
+				if (multisample)
+					drawElements(ourModel.meshes[m], shader, *multisample, lod);
+				else
+					drawElements(ourModel.meshes[m], shader, target, zbuffer, lod);
+			}
+		}
+
+		if (multisample)
+		{
+			multisample->resolve(target);
+			std::cout << "MSAA " << multisample->samples() << "x: " << multisample->compressedTiles()
+				<< " compressed tiles" << std::endl;
+		}
+
+		if (occlusionCulling)
+		{
+			std::cout << "occlusion culling: " << occlusion.culled << " of " << occlusion.tested << " objects culled" << std::endl;
+			setOcclusion(nullptr);
+		}
+	};
+
+	// deferred and multi-view paths: the shaders of shadeVisibility(), of the G-buffer and of drawElementsMultiView(),
+	// made once per mesh and worker (see ShaderPool); setPoolUniforms() gives them the uniforms of a frame
+	const ShaderPool::Factory makeShader = [&](size_t m)
+	{
+		return std::unique_ptr<IShader>(new Shader(ourModel.meshes[m]));
+	};
+	auto setPoolUniforms = [&](ShaderPool& pool, const ShadowMap* shadowMap, const glm::vec3& light)
+	{
+		pool.forEach([&](size_t, IShader& shader) { setUniforms(static_cast<Shader&>(shader), shadowMap, light); });
+	};
+	// deferred path: rasterizes the depth and triangle IDs of every mesh into visibility, which must be cleared
+	auto drawVisibility = [&](VisibilityBuffer& visibility)
+	{
+		Vertex scratch;
+		for (size_t m = 0; m < ourModel.meshes.size(); m++)
+		{
+			if (!VisibilityBuffer::canPack(m, ourModel.meshes[m].indices.size() / 3))
+				continue;
+			Shader shader(ourModel.meshes[m]);
+			setUniforms(shader, shadows);
+			for (size_t i = 0; i < ourModel.meshes[m].indices.size(); i += 3)
 			{
-				const Vertex& v = ourModel.meshes[m].vertices[ourModel.meshes[m].indices[i + j]];
-				// (3第三步) Vertex Shader: how many times vertex shader is invoked depends on the third parameter of gl.drawArrays
-				shader.vertex(v.Position, v.TexCoords, j,
-				              homogeneousClipSpace[j]);
+				glm::vec4 homogeneousClipSpace[3];
+				for (int j = 0; j < 3; j++)
+					shader.vertex(ourModel.meshes[m].fetch(ourModel.meshes[m].indices[i + j], scratch), j,
+					              homogeneousClipSpace[j]);
+				triangleVisibility(homogeneousClipSpace,
+				                   VisibilityBuffer::packID(static_cast<uint32_t>(m), static_cast<uint32_t>(i / 3)),
+				                   visibility);
 			}
-			// (4第四步) Primitive Assembly (which primitive to use? In WebGL, the first parameter of gl.drawArrays specifies the primitive to draw like gl.TRIANGLES)
-			// (5第五步) Rasterizer
-			// (6第六步) Fragment Shader
-			triangle(homogeneousClipSpace, shader, framebuffer, zbuffer);
 		}
+	};
+
+	// feedback pass of the paged textures: a 1/4 resolution render of the meshes from the current camera samples (and
+	// so requests) the pages its frame will need, then they are loaded before the frame is drawn
+	Framebuffer feedbackImage(imageWidth / 4, imageHeight / 4);
+	DepthBuffer feedbackDepth(imageWidth / 4, imageHeight / 4);
+	auto requestPages = [&]()
+	{
+		setDiagnostics(nullptr);
+		setShadingRate(nullptr);
+		feedbackImage.clear();
+		feedbackDepth.clear();
+		for (const Mesh& mesh : ourModel.meshes)
+		{
+			Shader shader(mesh);
+			setUniforms(shader);
+			drawElements(mesh, shader, feedbackImage, feedbackDepth);
+		}
+		if (diagnosticMode)
+			setDiagnostics(&diagnostics);
+		if (coarseShadingTexels > 0.f)
+			setShadingRate(&shadingRate);
+	};
+	if (pageBudgetKB > 0)
+	{
+		requestPages();
+		size_t loaded = pageCache.update();
+		std::cout << "virtual textures: " << loaded << " pages loaded" << std::endl;
+	}
+
+	// the sequence branches (turntable, multi-view) write their own images instead of 2.tga
+	bool wroteFrames = false;
+	if (gbufferRelighting)
+	{
+		// lit by lightDir, then by the light of each step of the look-dev loop below
+		ShaderPool shaders(ourModel.meshes.size(), makeShader);
+		setPoolUniforms(shaders, nullptr, lightDir);
+		GBuffer gbuffer(imageWidth, imageHeight);
+		gbuffer.update(ourModel.meshes, Projection * View, shaders);
+		gbuffer.relight(shaders, framebuffer);
+		// every relight is a frame of the arena
+		arena.reset();
+
+		Framebuffer relit(imageWidth, imageHeight);
+		for (int i = 1; i <= 4; i++)
+		{
+			auto start = std::chrono::steady_clock::now();
+			float angle = i * 1.5707963f;
+			poseFrame(i);
+			setPoolUniforms(shaders, nullptr, glm::vec3(std::cos(angle), 1.f, std::sin(angle)));
+			// only the tiles of the meshes that moved are rasterized again, the rest of the G-buffer is reused as is
+			int tiles = gbuffer.update(ourModel.meshes, Projection * View, shaders);
+			relit.clear();
+			gbuffer.relight(shaders, relit);
+			std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+			std::cout << "light " << i << ": " << tiles << " tiles rebuilt, " << elapsed.count() << " ms" << std::endl;
+			relit.write_tga_file("2_light" + std::to_string(i) + ".tga", false);
+			arena.reset();
+		}
+	}
+	else if (deferredShading)
+	{
+		// phase one: depth and triangle IDs only
+		VisibilityBuffer visibility(imageWidth, imageHeight);
+		drawVisibility(visibility);
+		// phase two: shade each visible pixel once
+		ShaderPool shaders(ourModel.meshes.size(), makeShader);
+		setPoolUniforms(shaders, shadows, lightDir);
+		shadeVisibility(visibility, ourModel.meshes, shaders, framebuffer);
+	}
+	else if (turntableFrames > 0)
+	{
+		// allocated once when the frames reuse the shading of the previous one
+		std::unique_ptr<VisibilityBuffer> visibility;
+		std::unique_ptr<ReprojectionCache> reprojection;
+		std::unique_ptr<ShaderPool> deferredShaders;
+		if (reprojectionCache)
+		{
+			visibility.reset(new VisibilityBuffer(imageWidth, imageHeight));
+			reprojection.reset(new ReprojectionCache(imageWidth, imageHeight));
+			deferredShaders.reset(new ShaderPool(ourModel.meshes.size(), makeShader));
+		}
+		size_t reusedPixels = 0, visiblePixels = 0;
+		// the frames are written in the background while the next ones are rendered
+		FramePipeline frames(imageWidth, imageHeight, framesInFlight);
+		const float step = 6.2831853f / std::max(turntableFrames, 1);
+
+		// the plain forward path runs the vertex stage of the next frame on the geometry thread of the pipeline while
+		// the current one is rasterized (instances, occlusion culling and MSAA go through drawForward): two sets of
+		// shaders and prepared draws, frame i uses set i % 2. A re-posed model renders its shadow map again before
+		// each frame, which the rasterization of the previous one still reads
+		const bool pipelined = !reprojection && instanceCount == 0 && !occlusionCulling && !multisample
+			&& !(animateNode && shadowMapping);
+		std::vector<std::unique_ptr<Shader>> frameShaders[2];
+		std::vector<PreparedDraw> frameDraws[2];
+		if (pipelined)
+		{
+			for (int set = 0; set < 2; set++)
+			{
+				for (const Mesh& mesh : ourModel.meshes)
+					frameShaders[set].emplace_back(new Shader(mesh));
+				frameDraws[set].resize(ourModel.meshes.size());
+			}
+		}
+		// geometry stage of frame i: only reads the meshes (their transforms are set before it starts) and writes its set
+		auto prepareFrame = [&](int i)
+		{
+			const glm::mat4 view = viewMatrix(orbit(step * i), center);
+			for (size_t m = 0; m < ourModel.meshes.size(); m++)
+			{
+				Shader& shader = *frameShaders[i % 2][m];
+				setUniforms(shader, shadows, lightDir, view);
+				int lod = 0;
+				if (lodPixelError > 0.f)
+					lod = selectLOD(ourModel.meshes[m], shader.u_MVP, maxScale(shader.u_Model), PixelScale, lodPixelError);
+				prepareElements(ourModel.meshes[m], shader, imageWidth, imageHeight, frameDraws[i % 2][m], lod);
+			}
+		};
+
+		auto start = std::chrono::steady_clock::now();
+		if (pipelined)
+		{
+			poseFrame(0);
+			frames.prepare([&]() { prepareFrame(0); });
+		}
+		// heap allocations of the steady state (when they are counted, see AllocationCounter.h): every frame after the
+		// first two, which fill the arena and the caches
+		const int warmupFrames = 2;
+		size_t warmAllocations = heapAllocationCount();
+		for (int i = 0; i < turntableFrames; i++)
+		{
+			if (i == warmupFrames)
+				warmAllocations = heapAllocationCount();
+			lookat(orbit(step * i), center);
+			if (pipelined)
+			{
+				// the geometry of frame i is ready and the geometry thread is idle until the next prepare()
+				frames.waitPrepared();
+			}
+			else
+			{
+				poseFrame(i);
+				if (shadowMapping && shadowMap.update(ourModel.meshes, lightDir))
+					shadowRenders++;
+			}
+			if (pageBudgetKB > 0)
+			{
+				requestPages();
+				pageCache.update();
+			}
+			if (pipelined && i + 1 < turntableFrames)
+			{
+				// the rasterization of frame i only reads the uniforms of its shaders, not the meshes' transforms
+				poseFrame(i + 1);
+				frames.prepare([&prepareFrame, i]() { prepareFrame(i + 1); });
+			}
+			Framebuffer& target = frames.acquire();
+			if (pipelined)
+			{
+				zbuffer.clear();
+				for (size_t m = 0; m < ourModel.meshes.size(); m++)
+				{
+					const PreparedDraw& draw = frameDraws[i % 2][m];
+					if (lodPixelError > 0.f)
+						lodDraws[std::min<size_t>(draw.lod, lodDraws.size() - 1)]++;
+					drawPrepared(draw, *frameShaders[i % 2][m], target, zbuffer);
+				}
+			}
+			else if (reprojection)
+			{
+				visibility->clear();
+				drawVisibility(*visibility);
+				reprojection->reproject(*visibility, Projection * View, target);
+				setPoolUniforms(*deferredShaders, shadows, lightDir);
+				shadeVisibility(*visibility, ourModel.meshes, *deferredShaders, target, reprojection->invalid());
+				reprojection->store(*visibility, target);
+				reusedPixels += reprojection->reused();
+				visiblePixels += reprojection->visible();
+				std::cout << "frame " << i << ": " << reprojection->reuseRate() << "% of "
+					<< reprojection->visible() << " pixels reused" << std::endl;
+			}
+			else
+			{
+				zbuffer.clear();
+				drawForward(target);
+			}
+			frames.submit("2_" + std::to_string(i) + ".tga");
+			arena.reset();
+		}
+		frames.finish();
+		wroteFrames = true;
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		std::cout << "turntable: " << turntableFrames << " frames in " << elapsed.count() << " ms ("
+			<< frames.encodedMs() << " ms encoding, " << frames.waitedMs() << " ms waiting for a framebuffer)"
+			<< std::endl;
+		if (pipelined)
+		{
+			std::cout << "geometry stage: " << frames.preparedMs() << " ms on the geometry thread, "
+				<< frames.waitedPreparedMs() << " ms waiting for it" << std::endl;
+		}
+		if (reprojection)
+		{
+			std::cout << "reprojection: " << (visiblePixels ? 100.f * reusedPixels / visiblePixels : 0.f)
+				<< "% of the pixels reused" << std::endl;
+		}
+		std::cout << "frame arena: " << arena.highWaterMark() / 1024 << " KB per frame at most, "
+			<< arena.heapAllocations() << " heap blocks" << std::endl;
+		if (heapAllocationsCounted() && turntableFrames > warmupFrames)
+		{
+			std::cout << "heap allocations: " << (heapAllocationCount() - warmAllocations) / double(turntableFrames - warmupFrames)
+				<< " per frame after the first " << warmupFrames << " (all threads)" << std::endl;
+		}
+	}
+	else if (multiViewCount > 0)
+	{
+		std::vector<Framebuffer> images;
+		std::vector<DepthBuffer> depths;
+		std::vector<RenderView> views(multiViewCount);
+		images.reserve(multiViewCount);
+		depths.reserve(multiViewCount);
+		const float step = 6.2831853f / std::max(multiViewCount, 1);
+		for (int i = 0; i < multiViewCount; i++)
+		{
+			images.emplace_back(imageWidth, imageHeight);
+			depths.emplace_back(imageWidth, imageHeight, depthFormat);
+			lookat(orbit(step * i), center);
+			views[i].viewProjection = Projection * View;
+			views[i].image = &images[i];
+			views[i].zbuffer = &depths[i];
+			// the pages of all the views are loaded at once
+			if (pageBudgetKB > 0)
+				requestPages();
+		}
+		if (pageBudgetKB > 0)
+			pageCache.update();
+
+		// the counters of the diagnostics and of the shading rate are not supported by drawElementsMultiView()
+		setDiagnostics(nullptr);
+		setShadingRate(nullptr);
+		ShaderPool shaders(ourModel.meshes.size(), makeShader);
+		setPoolUniforms(shaders, shadows, lightDir);
+
+		auto start = std::chrono::steady_clock::now();
+		for (size_t m = 0; m < ourModel.meshes.size(); m++)
+		{
+			drawElementsMultiView(ourModel.meshes[m], m, ourModel.meshes[m].transform, shaders, views, lodPixelError,
+			                      PixelScale);
+		}
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		std::cout << "multi-view: " << multiViewCount << " views in " << elapsed.count() << " ms" << std::endl;
+		for (int i = 0; i < multiViewCount; i++)
+			images[i].write_tga_file("2_view" + std::to_string(i) + ".tga", false);
+		wroteFrames = true;
+	}
+	else
+	{
+		drawForward(framebuffer);
+	}
+
+	if (pageBudgetKB > 0)
+	{
+		std::cout << "virtual textures: " << pageCache.resident() << " of " << pageCache.capacity()
+			<< " pages resident, " << pageCache.loads() << " loaded, " << pageCache.evictions() << " evicted, "
+			<< pageCache.dropped() << " requests over budget, " << pageCache.missing()
+			<< " pages missing in the last frame" << std::endl;
+	}
+
+	// only the draws of the forward path are counted
+	if (std::accumulate(lodDraws.begin(), lodDraws.end(), size_t(0)) > 0)
+	{
+		std::cout << "LOD draws:";
+		for (size_t i = 0; i < lodDraws.size(); i++)
+			std::cout << " " << lodDraws[i] << " at level " << i << (i + 1 < lodDraws.size() ? "," : "");
+		std::cout << std::endl;
+	}
+
+	if (coarseShadingTexels > 0.f)
+		std::cout << "shading rate: " << shadingRate.report() << std::endl;
+
+	if (poses > 0)
+	{
+		std::cout << "re-pose of node " << ourModel.hierarchy.name(posedNode) << " (subtree of "
+			<< ourModel.hierarchy.subtreeEnd(posedNode) - posedNode << " of " << ourModel.hierarchy.size() << " nodes): "
+			<< posedNodes / double(poses) << " nodes updated per pose";
+		if (shadowMapping)
+			std::cout << ", shadow map rendered " << shadowRenders << " times";
+		std::cout << std::endl;
 	}
 
 	// (10第十步,最后一步) Frame buffer
-	framebuffer.write_tga_file("2.tga", false);
+	if (!wroteFrames)
+		framebuffer.write_tga_file("2.tga", false);
+	if (diagnosticMode)
+		diagnostics.write_heatmaps("2");
 	return 0;
 }
 
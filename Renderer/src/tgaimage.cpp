@@ -139,6 +139,9 @@ bool TGAImage::write_tga_file(const std::string filename, const bool vflip, cons
 		'T', 'R', 'U', 'E', 'V', 'I', 'S', 'I', 'O', 'N', '-', 'X', 'F', 'I', 'L', 'E', '.', '\0'
 	};
 	std::ofstream out;
+	// the stream buffer is given before open(), which would otherwise take one from the heap for every file written
+	char buffer[8192];
+	out.rdbuf()->pubsetbuf(buffer, sizeof(buffer));
 	out.open(filename, std::ios::binary);
 	if (!out.is_open())
 	{
@@ -286,3 +289,18 @@ int TGAImage::height() const
 {
 	return h;
 }
+
+int TGAImage::bytespp() const
+{
+	return bpp;
+}
+
+std::uint8_t* TGAImage::buffer()
+{
+	return data.data();
+}
+
+const std::uint8_t* TGAImage::buffer() const
+{
+	return data.data();
+}
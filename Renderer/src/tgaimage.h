@@ -63,6 +63,9 @@ struct TGAImage
 	void set(const int x, const int y, const TGAColor& c);
 	int width() const;
 	int height() const;
+	int bytespp() const;
+	std::uint8_t* buffer();
+	const std::uint8_t* buffer() const;
 private:
 	bool load_rle_data(std::ifstream& in);
 	bool unload_rle_data(std::ofstream& out) const;
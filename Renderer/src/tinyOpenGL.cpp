@@ -1,16 +1,57 @@
 ﻿#include "tinyOpenGL.h"
 
+#include "FrameArena.h"
+#include "Lod.h"
+#include "Occlusion.h"
+#include "Parallel.h"
+#include "ShaderPool.h"
+
+#include <algorithm>
+#include <bitset>
+#include <cassert>
+#include <chrono>
+#include <cmath>
 #include <glm/ext/scalar_constants.hpp>
+#include <xmmintrin.h>
 
 
 glm::mat4 View;
 glm::mat4 Projection;
+RasterDiagnostics* Diagnostics = nullptr;
+OcclusionBuffer* Occlusion = nullptr;
+ShadingRate* VariableRate = nullptr;
 
 IShader::~IShader()
 {
 }
 
-void lookat(const glm::vec3& eye, const glm::vec3& center, const glm::vec3& tmp)
+vint IShader::sample2D(const TGAImage& img, const vfloat& u, const vfloat& v, const vfloat& active)
+{
+	vfloat xf = u * static_cast<float>(img.width());
+	vfloat yf = v * static_cast<float>(img.height());
+	// same rules as TGAImage::get: coordinates are truncated and texels outside the image are black
+	vfloat mask = active & (xf > -1.f) & (xf < static_cast<float>(img.width()))
+		& (yf > -1.f) & (yf < static_cast<float>(img.height()));
+	vint x = toInt(xf);
+	vint y = toInt(yf);
+	if (img.bytespp() == TGAImage::RGBA)
+	{
+		return gather(reinterpret_cast<const uint32_t*>(img.buffer()), y * vint(img.width()) + x, mask);
+	}
+
+	// GRAYSCALE and RGB texels are not 4-byte aligned, fetch them one lane at a time
+	alignas(32) int32_t xs[SIMD_WIDTH];
+	alignas(32) int32_t ys[SIMD_WIDTH];
+	alignas(32) uint32_t texels[SIMD_WIDTH];
+	x.store(reinterpret_cast<uint32_t*>(xs));
+	y.store(reinterpret_cast<uint32_t*>(ys));
+	int lanes = movemask(mask);
+	for (int i = 0; i < SIMD_WIDTH; i++)
+		texels[i] = (lanes >> i & 1) ? Framebuffer::pack(img.get(xs[i], ys[i])) : 0;
+	return vint::load(texels);
+}
+
+glm::mat4 viewMatrix(const glm::vec3& eye, const glm::vec3& center, const glm::vec3& tmp)
 {
 	glm::vec3 forward = glm::normalize((eye - center));
 	glm::vec3 right = glm::cross(glm::normalize(tmp), forward);
@@ -33,7 +74,12 @@ void lookat(const glm::vec3& eye, const glm::vec3& center, const glm::vec3& tmp)
 		{eye.x, eye.y, eye.z, 1.f},
 	};
 
-	View = glm::inverse(camToWorld);
+	return glm::inverse(camToWorld);
+}
+
+void lookat(const glm::vec3& eye, const glm::vec3& center, const glm::vec3& tmp)
+{
+	View = viewMatrix(eye, center, tmp);
 }
 
 
@@ -60,6 +106,21 @@ void projection(const float& fovy, const float& aspect, const float& near, const
 	Projection = persp;
 }
 
+void setDiagnostics(RasterDiagnostics* diag)
+{
+	Diagnostics = diag;
+}
+
+void setOcclusion(OcclusionBuffer* occlusion)
+{
+	Occlusion = occlusion;
+}
+
+void setShadingRate(ShadingRate* rate)
+{
+	VariableRate = rate;
+}
+
 static float min3(const float& a, const float& b, const float& c)
 {
 	return std::min(a, std::min(b, c));
@@ -75,10 +136,15 @@ static float edgeFunction(const glm::vec3& a, const glm::vec3& b, const glm::vec
 	return (c[0] - a[0]) * (b[1] - a[1]) - (c[1] - a[1]) * (b[0] - a[0]);
 }
 
-void triangle(glm::vec4* hcp, IShader& shader, TGAImage& image, std::vector<float>& zbuffer)
+// edgeFunction(a, b, c) as a plane equation of the point c = (x, y)
+static glm::vec3 edgePlane(const glm::vec3& a, const glm::vec3& b)
+{
+	return glm::vec3(b[1] - a[1], -(b[0] - a[0]), -a[0] * (b[1] - a[1]) + a[1] * (b[0] - a[0]));
+}
+
+bool RasterTriangle::setup(const glm::vec4* hcp, uint32_t imageWidth, uint32_t imageHeight,
+                           const float (*varyings)[MAX_VARYINGS], int nVaryings, bool multisample)
 {
-	uint32_t imageWidth = image.width();
-	uint32_t imageHeight = image.height();
 	// clipping (ignore)
 	// perspective divide 
 	glm::vec3 ndc[3] = {
@@ -88,18 +154,9 @@ void triangle(glm::vec4* hcp, IShader& shader, TGAImage& image, std::vector<floa
 	};
 	// viewport transform
 	// note: we set the raster depth to be NDC depth
-	glm::vec3 raster[3] = {
-		{(ndc[0].x + 1) / 2 * imageWidth, (1 - ndc[0].y) / 2 * imageHeight, ndc[0].z},
-		{(ndc[1].x + 1) / 2 * imageWidth, (1 - ndc[1].y) / 2 * imageHeight, ndc[1].z},
-		{(ndc[2].x + 1) / 2 * imageWidth, (1 - ndc[2].y) / 2 * imageHeight, ndc[2].z},
-	};
-
-	// precompute reciprocal of vertex z-coordinate
-	raster[0].z = 1 / raster[0].z;
-	raster[1].z = 1 / raster[1].z;
-	raster[2].z = 1 / raster[2].z;
-
-	// prepare vertex attributes: divide them by their vertex z-coordinate   
+	raster[0] = {(ndc[0].x + 1) / 2 * imageWidth, (1 - ndc[0].y) / 2 * imageHeight, ndc[0].z};
+	raster[1] = {(ndc[1].x + 1) / 2 * imageWidth, (1 - ndc[1].y) / 2 * imageHeight, ndc[1].z};
+	raster[2] = {(ndc[2].x + 1) / 2 * imageWidth, (1 - ndc[2].y) / 2 * imageHeight, ndc[2].z};
 
 	// compute bounding box of this triangle
 	float xmin = min3(raster[0].x, raster[1].x, raster[2].x);
@@ -110,53 +167,722 @@ void triangle(glm::vec4* hcp, IShader& shader, TGAImage& image, std::vector<floa
 	// the triangle is out of screen
 	if (xmin > imageWidth - 1 || xmax < 0 || ymin > imageHeight - 1 || ymax < 0)
 	{
-		return;
+		return false;
 	}
 
+	// only the pixels whose center (x + 0.5, y + 0.5) is inside the bounding box can be covered
+	// (with multisampling: the pixels whose square [x, x + 1) x [y, y + 1) overlaps it)
 	// be careful xmin/xmax/ymin/ymax can be negative. Don't cast to uint32_t
 	// some bounding box coordinates may be outside the range, clamp them if necessary
-	uint32_t x0 = std::max(0, static_cast<int32_t>(std::floor(xmin)));
-	uint32_t x1 = std::min(static_cast<int32_t>(imageWidth) - 1, static_cast<int32_t>(std::floor(xmax)));
-	uint32_t y0 = std::max(0, static_cast<int32_t>(std::floor(ymin)));
-	uint32_t y1 = std::min(static_cast<int32_t>(imageHeight) - 1, static_cast<int32_t>(std::floor(ymax)));
+	const float before = multisample ? 1.f : 0.5f, after = multisample ? 0.f : 0.5f;
+	int32_t bx0 = std::max(0, static_cast<int32_t>(std::ceil(xmin - before)));
+	int32_t bx1 = std::min(static_cast<int32_t>(imageWidth) - 1, static_cast<int32_t>(std::floor(xmax - after)));
+	int32_t by0 = std::max(0, static_cast<int32_t>(std::ceil(ymin - before)));
+	int32_t by1 = std::min(static_cast<int32_t>(imageHeight) - 1, static_cast<int32_t>(std::floor(ymax - after)));
+	// small triangle fast path: most triangles of dense meshes fall between pixel centers,
+	// reject them before computing any plane equation
+	if (bx0 > bx1 || by0 > by1)
+	{
+		return false;
+	}
 
+	// only counter-clockwise (in raster space) triangles can cover a pixel center, the others are back facing
 	float area = edgeFunction(raster[0], raster[1], raster[2]);
+	if (area <= 0)
+	{
+		return false;
+	}
+	x0 = bx0;
+	x1 = bx1;
+	y0 = by0;
+	y1 = by1;
+
+	// barycentric coordinates as planes: any per-vertex quantity q interpolates to q0 * edge[0] + q1 * edge[1] + q2 * edge[2]
+	edge[0] = edgePlane(raster[1], raster[2]) / area;
+	edge[1] = edgePlane(raster[2], raster[0]) / area;
+	edge[2] = edgePlane(raster[0], raster[1]) / area;
+
+	depthPlane = raster[0].z * edge[0] + raster[1].z * edge[1] + raster[2].z * edge[2];
+
+	// varyings are not linear in screen space, but varying / w and 1 / w are
+	float oneOverW[3] = {1 / hcp[0].w, 1 / hcp[1].w, 1 / hcp[2].w};
+	oneOverWPlane = oneOverW[0] * edge[0] + oneOverW[1] * edge[1] + oneOverW[2] * edge[2];
+
+	this->nVaryings = nVaryings;
+	for (int i = 0; i < nVaryings; i++)
+	{
+		varyingPlanes[i] = varyings[0][i] * oneOverW[0] * edge[0]
+			+ varyings[1][i] * oneOverW[1] * edge[1]
+			+ varyings[2][i] * oneOverW[2] * edge[2];
+	}
+	return true;
+}
+
+// triangle() only tests the farthest depth of a tile when the triangle overlaps at least this many of its pixels
+static const uint32_t HIERARCHICAL_Z_MIN_PIXELS = 64;
+
+// RasterTriangle::eval for a packet of pixels
+static vfloat evalPacket(const glm::vec3& plane, const vfloat& x, const vfloat& y)
+{
+	return plane.x * x + plane.y * y + plane.z;
+}
+
+// diagnostics: increment the counters of the active lanes
+static void countLanes(uint32_t* counters, const vfloat& mask)
+{
+	int lanes = movemask(mask);
+	for (int i = 0; i < SIMD_WIDTH; i++)
+		if (lanes >> i & 1)
+			counters[i]++;
+}
+
+static int countBits(int bits)
+{
+	return static_cast<int>(std::bitset<32>(bits).count());
+}
+
+// mask of the lanes whose bit is set
+static vfloat laneMask(int bits)
+{
+	alignas(32) static const uint32_t laneBits[SIMD_WIDTH] = {1, 2, 4, 8
+#if SIMD_WIDTH == 8
+	                                                          , 16, 32, 64, 128
+#endif
+	};
+	return toFloat(vint(bits) & vint::load(laneBits)) > 0.f;
+}
+
+// bit i is set if one of the bits [i * rate, (i + 1) * rate) of lanes is (lanes of a packet -> the blocks they belong to)
+static int mergeLanes(int lanes, uint32_t rate)
+{
+	const int group = (1 << rate) - 1;
+	int merged = 0;
+	for (uint32_t i = 0; i * rate < SIMD_WIDTH; i++)
+		merged |= (lanes >> (i * rate) & group ? 1 : 0) << i;
+	return merged;
+}
+
+// bit j is bit j / rate of blocks (inverse of mergeLanes)
+static int expandLanes(int blocks, uint32_t rate)
+{
+	const int group = (1 << rate) - 1;
+	int lanes = 0;
+	for (uint32_t i = 0; i * rate < SIMD_WIDTH; i++)
+		lanes |= (blocks >> i & 1 ? group : 0) << (i * rate);
+	return lanes;
+}
 
-	for (uint32_t y = y0; y <= y1; ++y)
+// largest region of coarse pixels triangle() shades at once (rows x packets per row)
+static const int MAX_REGION_ROWS = 8;
+static const int MAX_REGION_CHUNKS = 4;
+
+void triangle(glm::vec4* hcp, IShader& shader, Framebuffer& image, DepthBuffer& zbuffer)
+{
+	uint32_t imageWidth = image.width();
+	uint32_t imageHeight = image.height();
+
+	RasterTriangle tri;
+	if (!tri.setup(hcp, imageWidth, imageHeight, shader.v_Varyings, shader.nVaryings))
 	{
-		for (uint32_t x = x0; x <= x1; ++x)
+		return;
+	}
+	// the depth buffer compares keys of the NDC depth, or of 1/w for reversed-Z
+	const bool reversedZ = zbuffer.reversed();
+
+	// rasterize the pixels in [rx0, rx1] x [ry0, ry1] (inclusive)
+	auto rasterizeRect = [&](uint32_t rx0, uint32_t rx1, uint32_t ry0, uint32_t ry1)
+	{
+		float varyings[MAX_VARYINGS];
+		float rowVaryings[MAX_VARYINGS];
+		for (uint32_t y = ry0; y <= ry1; ++y)
 		{
-			glm::vec3 pixelSample(x + 0.5, y + 0.5, 0);
+			uint32_t* colorRow = image.row(y);
+
+			// evaluate the planes at the first pixel center of the row, then step them by their x slope
+			float px = rx0 + 0.5f, py = y + 0.5f;
+			float w0 = RasterTriangle::eval(tri.edge[0], px, py);
+			float w1 = RasterTriangle::eval(tri.edge[1], px, py);
+			float w2 = RasterTriangle::eval(tri.edge[2], px, py);
+			float z = RasterTriangle::eval(tri.depthPlane, px, py);
+			float oneOverW = RasterTriangle::eval(tri.oneOverWPlane, px, py);
+			for (int i = 0; i < tri.nVaryings; i++)
+				rowVaryings[i] = RasterTriangle::eval(tri.varyingPlanes[i], px, py);
 
-			float w0 = edgeFunction(raster[1], raster[2], pixelSample);
-			float w1 = edgeFunction(raster[2], raster[0], pixelSample);
-			float w2 = edgeFunction(raster[0], raster[1], pixelSample);
-			// test if this pixel sample covers this triangle
-			if (w0 >= 0 && w1 >= 0 && w2 >= 0)
+			for (uint32_t x = rx0; x <= rx1; ++x, w0 += tri.edge[0].x, w1 += tri.edge[1].x, w2 += tri.edge[2].x,
+			     z += tri.depthPlane.x, oneOverW += tri.oneOverWPlane.x)
 			{
-				// compute the pixel barycentric coordinates
-				w0 /= area;
-				w1 /= area;
-				w2 /= area;
-				// compute the (1/depth) of this pixel by linearly interpolating\
-				// the reciprocal of 3 vertices' depth (precomputed outside the loop)
-				// and then take the reciprocal to get the resulting depth
-				float oneOverZ = raster[0].z * w0 + raster[1].z * w1 + raster[2].z * w2;
-				float z = 1 / oneOverZ;
+				// test if this pixel sample covers this triangle
+				if (w0 < 0 || w1 < 0 || w2 < 0)
+				{
+					continue;
+				}
+				if (Diagnostics)
+					Diagnostics->depthTests[y * imageWidth + x]++;
 				// Depth-buffer test
-				if (z < zbuffer[y * imageWidth + x])
+				float key = zbuffer.key(reversedZ ? oneOverW : z);
+				if (key < zbuffer.get(x, y))
 				{
+					// perspective-correct varyings: (varying / w) / (1 / w)
+					float w = 1 / oneOverW;
+					float dx = static_cast<float>(x - rx0);
+					for (int i = 0; i < tri.nVaryings; i++)
+						varyings[i] = (rowVaryings[i] + tri.varyingPlanes[i].x * dx) * w;
+
 					TGAColor color;
-					glm::vec4 baryCoordAndPixeldepth = glm::vec4(w0, w1, w2, z);
-					if (shader.fragment(baryCoordAndPixeldepth, color, raster[0].z, raster[1].z, raster[2].z))
+					if (Diagnostics)
+						Diagnostics->shadeCount[y * imageWidth + x]++;
+					if (shader.fragment(glm::vec4(x + 0.5f, py, z, oneOverW), varyings, color))
 					{
 						// fragment shader can discard this pixel
 						continue;
 					}
-					zbuffer[y * imageWidth + x] = z;
-					image.set(x, y, color);
+					zbuffer.set(x, y, key);
+					colorRow[x] = Framebuffer::pack(color);
 				}
 			}
 		}
+	};
+
+
+	// runs the packet fragment shader on the lanes of mask (pixel centers px, py at depth z)
+	// returns the lanes that were not discarded
+	FragmentPacket packet;
+	auto shadePacket = [&](const vfloat& px, const vfloat& py, const vfloat& z, const vfloat& mask, vint& color)
+	{
+		// perspective-correct varyings: (varying / w) / (1 / w)
+		vfloat oneOverW = evalPacket(tri.oneOverWPlane, px, py);
+		vfloat w = 1.f / oneOverW;
+		for (int i = 0; i < tri.nVaryings; i++)
+			packet.varyings[i] = evalPacket(tri.varyingPlanes[i], px, py) * w;
+		packet.fragCoord[0] = px;
+		packet.fragCoord[1] = py;
+		packet.fragCoord[2] = z;
+		packet.fragCoord[3] = oneOverW;
+		packet.active = mask;
+		shader.fragmentPacket(packet, color);
+		// fragment shader can discard lanes
+		return packet.active;
+	};
+
+	// same as rasterizeRect, but evaluates SIMD_WIDTH pixels of a row at once and calls the packet fragment shader
+	auto rasterizePacketRect = [&](uint32_t rx0, uint32_t rx1, uint32_t ry0, uint32_t ry1)
+	{
+		for (uint32_t y = ry0; y <= ry1; ++y)
+		{
+			uint32_t* colorRow = image.row(y);
+			vfloat py = y + 0.5f;
+
+			// packets start on a multiple of SIMD_WIDTH so that depth and color rows are accessed with aligned loads/stores;
+			// the lanes outside [rx0, rx1] are masked out
+			for (uint32_t x = rx0 & ~(SIMD_WIDTH - 1); x <= rx1; x += SIMD_WIDTH)
+			{
+				vfloat px = vfloat::ramp(x + 0.5f);
+				vfloat mask = (px > static_cast<float>(rx0)) & (px < rx1 + 1.f);
+				// test if these pixel samples cover this triangle
+				mask &= (evalPacket(tri.edge[0], px, py) >= 0.f) & (evalPacket(tri.edge[1], px, py) >= 0.f)
+					& (evalPacket(tri.edge[2], px, py) >= 0.f);
+				if (!movemask(mask))
+				{
+					continue;
+				}
+				vfloat z = evalPacket(tri.depthPlane, px, py);
+				vfloat key = zbuffer.key(reversedZ ? evalPacket(tri.oneOverWPlane, px, py) : z);
+				vfloat depth = zbuffer.load(x, y);
+				if (Diagnostics)
+					countLanes(Diagnostics->depthTests.data() + y * imageWidth + x, mask);
+				// Depth-buffer test
+				mask &= key < depth;
+				if (!movemask(mask))
+				{
+					continue;
+				}
+
+				if (Diagnostics)
+					countLanes(Diagnostics->shadeCount.data() + y * imageWidth + x, mask);
+				vint color;
+				int shaded = movemask(mask);
+				mask = shadePacket(px, py, z, mask, color);
+				if (VariableRate)
+					VariableRate->count(1, countBits(movemask(mask)), countBits(shaded));
+				zbuffer.store(x, y, select(mask, key, depth));
+				select(mask, color, vint::load(colorRow + x)).store(colorRow + x);
+			}
+		}
+	};
+
+	// small triangle fast path: when all candidate pixels of the bounding box fit in a single packet,
+	// gather them into its lanes (instead of one mostly empty packet per row), then scatter the results back
+	auto rasterizeSmallPacket = [&]()
+	{
+		alignas(32) float xs[SIMD_WIDTH], ys[SIMD_WIDTH], depths[SIMD_WIDTH];
+		int n = 0;
+		for (uint32_t y = tri.y0; y <= tri.y1; ++y)
+		{
+			for (uint32_t x = tri.x0; x <= tri.x1; ++x, ++n)
+			{
+				xs[n] = x + 0.5f;
+				ys[n] = y + 0.5f;
+				depths[n] = zbuffer.get(x, y);
+			}
+		}
+		for (int i = n; i < SIMD_WIDTH; i++)
+		{
+			xs[i] = xs[0];
+			ys[i] = ys[0];
+			depths[i] = depths[0];
+		}
+
+		vfloat px = vfloat::load(xs), py = vfloat::load(ys);
+		vfloat mask = vfloat::ramp(0.f) < static_cast<float>(n);
+		mask &= (evalPacket(tri.edge[0], px, py) >= 0.f) & (evalPacket(tri.edge[1], px, py) >= 0.f)
+			& (evalPacket(tri.edge[2], px, py) >= 0.f);
+		vfloat z = evalPacket(tri.depthPlane, px, py);
+		vfloat key = zbuffer.key(reversedZ ? evalPacket(tri.oneOverWPlane, px, py) : z);
+		mask &= key < vfloat::load(depths);
+		if (!movemask(mask))
+		{
+			return;
+		}
+
+		vint color;
+		int lanes = movemask(shadePacket(px, py, z, mask, color));
+		if (VariableRate)
+			VariableRate->count(1, countBits(lanes), countBits(movemask(mask)));
+		alignas(32) float keys[SIMD_WIDTH];
+		alignas(32) uint32_t colors[SIMD_WIDTH];
+		key.store(keys);
+		color.store(colors);
+		for (int i = 0; i < n; i++)
+		{
+			if (lanes >> i & 1)
+			{
+				uint32_t x = static_cast<uint32_t>(xs[i]), y = static_cast<uint32_t>(ys[i]);
+				zbuffer.set(x, y, keys[i]);
+				image.row(y)[x] = colors[i];
+			}
+		}
+	};
+
+	// same as rasterizePacketRect, but each lane of the fragment shader is a coarse pixel: a block of rate x rate pixels
+	// (see ShadingRate.h). A packet covers a region of blocksX x blocksY blocks whose pixels are tested first, in full
+	// rate packets (chunks of SIMD_WIDTH pixels of a row); then the blocks with at least one visible pixel are shaded
+	// once, at their center, and their colors are written to their visible pixels
+	auto rasterizeCoarseRect = [&](uint32_t rx0, uint32_t rx1, uint32_t ry0, uint32_t ry1, uint32_t rate)
+	{
+		const uint32_t blocksX = std::min<uint32_t>(SIMD_WIDTH, DepthBuffer::TILE_SIZE / rate);
+		const uint32_t blocksY = SIMD_WIDTH / blocksX;
+		const uint32_t regionWidth = blocksX * rate, regionHeight = blocksY * rate;
+		const uint32_t chunks = regionWidth / SIMD_WIDTH;
+		vfloat masks[MAX_REGION_ROWS][MAX_REGION_CHUNKS];
+		vfloat keys[MAX_REGION_ROWS][MAX_REGION_CHUNKS];
+		vfloat depths[MAX_REGION_ROWS][MAX_REGION_CHUNKS];
+		alignas(32) float centerX[SIMD_WIDTH], centerY[SIMD_WIDTH];
+		alignas(32) uint32_t blockColors[SIMD_WIDTH], laneColors[SIMD_WIDTH];
+
+		for (uint32_t y = ry0 & ~(regionHeight - 1); y <= ry1; y += regionHeight)
+		{
+			for (uint32_t x = rx0 & ~(regionWidth - 1); x <= rx1; x += regionWidth)
+			{
+				// coverage and depth test of every pixel of the region, bit b of blocks: block b has a visible pixel
+				int blocks = 0;
+				for (uint32_t r = 0; r < regionHeight; r++)
+				{
+					for (uint32_t k = 0; k < chunks; k++)
+					{
+						const uint32_t cx = x + k * SIMD_WIDTH, cy = y + r;
+						vfloat& mask = masks[r][k];
+						mask = vfloat(0.f);
+						if (cy < ry0 || cy > ry1 || cx > rx1 || cx + SIMD_WIDTH <= rx0)
+							continue;
+						vfloat px = vfloat::ramp(cx + 0.5f), py = cy + 0.5f;
+						mask = (px > static_cast<float>(rx0)) & (px < rx1 + 1.f);
+						mask &= (evalPacket(tri.edge[0], px, py) >= 0.f) & (evalPacket(tri.edge[1], px, py) >= 0.f)
+							& (evalPacket(tri.edge[2], px, py) >= 0.f);
+						if (!movemask(mask))
+							continue;
+						keys[r][k] = zbuffer.key(reversedZ ? evalPacket(tri.oneOverWPlane, px, py)
+						                                   : evalPacket(tri.depthPlane, px, py));
+						depths[r][k] = zbuffer.load(cx, cy);
+						if (Diagnostics)
+							countLanes(Diagnostics->depthTests.data() + cy * imageWidth + cx, mask);
+						mask &= keys[r][k] < depths[r][k];
+						blocks |= mergeLanes(movemask(mask), rate) << ((r / rate) * blocksX + k * SIMD_WIDTH / rate);
+					}
+				}
+				if (!blocks)
+					continue;
+
+				for (uint32_t b = 0; b < SIMD_WIDTH; b++)
+				{
+					centerX[b] = x + (b % blocksX) * rate + rate * 0.5f;
+					centerY[b] = y + (b / blocksX) * rate + rate * 0.5f;
+				}
+				vfloat px = vfloat::load(centerX), py = vfloat::load(centerY);
+				vint color;
+				int shaded = movemask(shadePacket(px, py, evalPacket(tri.depthPlane, px, py), laneMask(blocks), color));
+				color.store(blockColors);
+
+				// each visible pixel takes the color of its block, unless the fragment shader discarded the block
+				int written = 0;
+				for (uint32_t r = 0; r < regionHeight; r++)
+				{
+					for (uint32_t k = 0; k < chunks; k++)
+					{
+						int lanes = movemask(masks[r][k]);
+						if (!lanes)
+							continue;
+						const uint32_t first = (r / rate) * blocksX + k * SIMD_WIDTH / rate;
+						for (int j = 0; j < SIMD_WIDTH; j++)
+							laneColors[j] = blockColors[first + j / rate];
+						const int keep = lanes & expandLanes(shaded >> first, rate);
+						const uint32_t cx = x + k * SIMD_WIDTH, cy = y + r;
+						vfloat mask = laneMask(keep);
+						zbuffer.store(cx, cy, select(mask, keys[r][k], depths[r][k]));
+						uint32_t* colorRow = image.row(cy);
+						select(mask, vint::load(laneColors), vint::load(colorRow + cx)).store(colorRow + cx);
+						if (Diagnostics)
+							countLanes(Diagnostics->shadeCount.data() + cy * imageWidth + cx, mask);
+						written += countBits(keep);
+					}
+				}
+				if (VariableRate)
+					VariableRate->count(rate, written, countBits(blocks));
+			}
+		}
+	};
+
+	// shading rate of the part [rx0, rx1] x [ry0, ry1] of a tile: the rate of the draw, or the rate the installed
+	// ShadingRate picks for the texel footprint of the texture coordinates at its center
+	auto tileRate = [&](uint32_t rx0, uint32_t rx1, uint32_t ry0, uint32_t ry1) -> uint32_t
+	{
+		if (shader.shadingRate > 0)
+			return shader.shadingRate >= 4 ? 4 : shader.shadingRate >= 2 ? 2 : 1;
+		if (!VariableRate || shader.rateVarying < 0 || shader.rateVarying + 1 >= tri.nVaryings)
+			return 1;
+		float cx = (rx0 + rx1 + 1) * 0.5f, cy = (ry0 + ry1 + 1) * 0.5f;
+		// derivatives of the perspective-correct coordinates c = p / q (p = c / w and q = 1 / w are linear):
+		// dc = (dp - c * dq) / q
+		const glm::vec3& q = tri.oneOverWPlane;
+		float qc = RasterTriangle::eval(q, cx, cy);
+		if (qc <= 0.f)
+			return 1;
+		const glm::vec3& pu = tri.varyingPlanes[shader.rateVarying];
+		const glm::vec3& pv = tri.varyingPlanes[shader.rateVarying + 1];
+		float u = RasterTriangle::eval(pu, cx, cy) / qc, v = RasterTriangle::eval(pv, cx, cy) / qc;
+		float dudx = (pu.x - u * q.x) / qc, dudy = (pu.y - u * q.y) / qc;
+		float dvdx = (pv.x - v * q.x) / qc, dvdy = (pv.y - v * q.y) / qc;
+		float footprint = std::max(std::sqrt(dudx * dudx + dvdx * dvdx), std::sqrt(dudy * dudy + dvdy * dvdy));
+		return VariableRate->select(footprint * shader.rateTexels);
+	};
+
+	const bool packetShading = shader.packetShading();
+	if (!Diagnostics && packetShading && (tri.x1 - tri.x0 + 1) * (tri.y1 - tri.y0 + 1) <= SIMD_WIDTH)
+	{
+		zbuffer.prepare(tri.x0, tri.x1, tri.y0, tri.y1);
+		rasterizeSmallPacket();
+		return;
+	}
+
+	// walk the bounding box one depth buffer tile at a time: the parts of the triangle behind the farthest depth of
+	// their tile are skipped, and in diagnostic mode the time spent can be charged to each tile
+	static_assert(RasterDiagnostics::TILE_SIZE == DepthBuffer::TILE_SIZE, "diagnostic tiles are depth buffer tiles");
+	const uint32_t tileSize = DepthBuffer::TILE_SIZE;
+	const glm::vec3& keyPlane = reversedZ ? tri.oneOverWPlane : tri.depthPlane;
+	for (uint32_t ty = tri.y0 / tileSize; ty <= tri.y1 / tileSize; ++ty)
+	{
+		for (uint32_t tx = tri.x0 / tileSize; tx <= tri.x1 / tileSize; ++tx)
+		{
+			std::chrono::steady_clock::time_point start;
+			if (Diagnostics)
+				start = std::chrono::steady_clock::now();
+			uint32_t rx0 = std::max(tri.x0, tx * tileSize), rx1 = std::min(tri.x1, tx * tileSize + tileSize - 1);
+			uint32_t ry0 = std::max(tri.y0, ty * tileSize), ry1 = std::min(tri.y1, ty * tileSize + tileSize - 1);
+
+			// hierarchical depth test, only worth the (occasional) rescan of the tile for big enough parts:
+			// the key plane is extremal at a corner of the pixel centers of the rectangle
+			if ((rx1 - rx0 + 1) * (ry1 - ry0 + 1) >= HIERARCHICAL_Z_MIN_PIXELS)
+			{
+				float px0 = rx0 + 0.5f, px1 = rx1 + 0.5f, py0 = ry0 + 0.5f, py1 = ry1 + 0.5f;
+				float c0 = RasterTriangle::eval(keyPlane, px0, py0), c1 = RasterTriangle::eval(keyPlane, px1, py0);
+				float c2 = RasterTriangle::eval(keyPlane, px0, py1), c3 = RasterTriangle::eval(keyPlane, px1, py1);
+				float nearest = std::min(zbuffer.key(std::min(std::min(c0, c1), std::min(c2, c3))),
+				                         zbuffer.key(std::max(std::max(c0, c1), std::max(c2, c3))));
+				if (nearest >= zbuffer.farthest(tx, ty))
+					continue;
+			}
+
+			zbuffer.prepare(rx0, rx1, ry0, ry1);
+			const uint32_t rate = packetShading ? tileRate(rx0, rx1, ry0, ry1) : 1;
+			if (rate > 1)
+				rasterizeCoarseRect(rx0, rx1, ry0, ry1, rate);
+			else if (packetShading)
+				rasterizePacketRect(rx0, rx1, ry0, ry1);
+			else
+				rasterizeRect(rx0, rx1, ry0, ry1);
+			if (Diagnostics)
+			{
+				std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+				Diagnostics->tileTime[ty * Diagnostics->tilesX + tx] += elapsed.count();
+			}
+		}
+	}
+}
+
+void triangleDepth(const glm::vec4* hcp, DepthBuffer& zbuffer)
+{
+	RasterTriangle tri;
+	if (!tri.setup(hcp, zbuffer.width(), zbuffer.height()))
+	{
+		return;
+	}
+	const bool reversedZ = zbuffer.reversed();
+	const glm::vec3& keyPlane = reversedZ ? tri.oneOverWPlane : tri.depthPlane;
+	zbuffer.prepare(tri.x0, tri.x1, tri.y0, tri.y1);
+	// same packet walk as rasterizePacketRect in triangle(), the depth test is the only per-pixel work
+	for (uint32_t y = tri.y0; y <= tri.y1; ++y)
+	{
+		vfloat py = y + 0.5f;
+		for (uint32_t x = tri.x0 & ~(SIMD_WIDTH - 1); x <= tri.x1; x += SIMD_WIDTH)
+		{
+			vfloat px = vfloat::ramp(x + 0.5f);
+			vfloat mask = (px > static_cast<float>(tri.x0)) & (px < tri.x1 + 1.f);
+			mask &= (evalPacket(tri.edge[0], px, py) >= 0.f) & (evalPacket(tri.edge[1], px, py) >= 0.f)
+				& (evalPacket(tri.edge[2], px, py) >= 0.f);
+			if (!movemask(mask))
+			{
+				continue;
+			}
+			vfloat key = zbuffer.key(evalPacket(keyPlane, px, py));
+			vfloat depth = zbuffer.load(x, y);
+			zbuffer.store(x, y, select(mask & (key < depth), key, depth));
+		}
+	}
+}
+
+void drawElements(const Mesh& mesh, IShader& shader, Framebuffer& image, DepthBuffer& zbuffer, int lod)
+{
+	const vector<unsigned int>& indices = mesh.lodIndices(lod);
+	// packed meshes decode their vertices here
+	Vertex scratch;
+	// iterate through each triangle in the mesh
+	for (size_t i = 0; i < indices.size(); i += 3)
+	{
+		glm::vec4 homogeneousClipSpace[3];
+		for (int j = 0; j < 3; j++)
+		{
+			// (3第三步) Vertex Shader: how many times vertex shader is invoked depends on the third parameter of gl.drawArrays
+			shader.vertex(mesh.fetch(indices[i + j], scratch), j, homogeneousClipSpace[j]);
+		}
+		// (4第四步) Primitive Assembly (which primitive to use? In WebGL, the first parameter of gl.drawArrays specifies the primitive to draw like gl.TRIANGLES)
+		// (5第五步) Rasterizer
+		// (6第六步) Fragment Shader
+		triangle(homogeneousClipSpace, shader, image, zbuffer);
+	}
+}
+
+void prepareElements(const Mesh& mesh, IShader& shader, uint32_t imageWidth, uint32_t imageHeight, PreparedDraw& out,
+                     int lod)
+{
+	out.mesh = &mesh;
+	out.lod = lod;
+	out.nVaryings = shader.nVaryings;
+	const size_t nVertices = mesh.vertexCount();
+	out.clip.resize(nVertices);
+	out.varyings.resize(nVertices * out.nVaryings);
+	Vertex scratch;
+	for (size_t k = 0; k < nVertices; k++)
+	{
+		// every vertex is shaded once (the varyings do not depend on the other vertices of a triangle)
+		shader.vertex(mesh.fetch(k, scratch), 0, out.clip[k]);
+		std::copy(shader.v_Varyings[0], shader.v_Varyings[0] + out.nVaryings, out.varyings.data() + k * out.nVaryings);
 	}
+
+	const vector<unsigned int>& indices = mesh.lodIndices(lod);
+	out.triangles.clear();
+	for (size_t i = 0; i + 2 < indices.size(); i += 3)
+	{
+		glm::vec4 homogeneousClipSpace[3] = {out.clip[indices[i]], out.clip[indices[i + 1]], out.clip[indices[i + 2]]};
+		// the same test triangle() starts with, without the varyings
+		RasterTriangle tri;
+		if (tri.setup(homogeneousClipSpace, imageWidth, imageHeight))
+			out.triangles.push_back(static_cast<uint32_t>(i));
+	}
+}
+
+void drawPrepared(const PreparedDraw& draw, IShader& shader, Framebuffer& image, DepthBuffer& zbuffer)
+{
+	const vector<unsigned int>& indices = draw.mesh->lodIndices(draw.lod);
+	const int nVaryings = draw.nVaryings;
+	for (uint32_t i : draw.triangles)
+	{
+		glm::vec4 homogeneousClipSpace[3];
+		for (int j = 0; j < 3; j++)
+		{
+			homogeneousClipSpace[j] = draw.clip[indices[i + j]];
+			const float* out = draw.varyings.data() + indices[i + j] * nVaryings;
+			std::copy(out, out + nVaryings, shader.v_Varyings[j]);
+		}
+		triangle(homogeneousClipSpace, shader, image, zbuffer);
+	}
+}
+
+// out[i] = a * b[i] for n matrices, one SSE register per column
+static void multiplyMatrices(const glm::mat4& a, const glm::mat4* b, glm::mat4* out, size_t n)
+{
+	__m128 aCols[4];
+	for (int c = 0; c < 4; c++)
+		aCols[c] = _mm_loadu_ps(&a[c][0]);
+	for (size_t i = 0; i < n; i++)
+	{
+		for (int c = 0; c < 4; c++)
+		{
+			// column c of the product is a * (column c of b)
+			__m128 r = _mm_mul_ps(aCols[0], _mm_set1_ps(b[i][c][0]));
+			r = _mm_add_ps(r, _mm_mul_ps(aCols[1], _mm_set1_ps(b[i][c][1])));
+			r = _mm_add_ps(r, _mm_mul_ps(aCols[2], _mm_set1_ps(b[i][c][2])));
+			r = _mm_add_ps(r, _mm_mul_ps(aCols[3], _mm_set1_ps(b[i][c][3])));
+			_mm_storeu_ps(&out[i][c][0], r);
+		}
+	}
+}
+
+bool insideFrustum(const glm::mat4& mvp, const glm::vec3& aabbMin, const glm::vec3& aabbMax)
+{
+	// the box is outside if all its 8 corners are outside of the same clip plane (-w <= x, y, z <= w)
+	int outside[6] = {0, 0, 0, 0, 0, 0};
+	for (int corner = 0; corner < 8; corner++)
+	{
+		glm::vec4 p = mvp * glm::vec4(corner & 1 ? aabbMax.x : aabbMin.x,
+		                              corner & 2 ? aabbMax.y : aabbMin.y,
+		                              corner & 4 ? aabbMax.z : aabbMin.z, 1.f);
+		outside[0] += p.x < -p.w;
+		outside[1] += p.x > p.w;
+		outside[2] += p.y < -p.w;
+		outside[3] += p.y > p.w;
+		outside[4] += p.z < -p.w;
+		outside[5] += p.z > p.w;
+	}
+	for (int plane = 0; plane < 6; plane++)
+	{
+		if (outside[plane] == 8)
+			return false;
+	}
+	return true;
+}
+
+size_t drawElementsInstanced(const Mesh& mesh, IShader& shader, const glm::mat4& viewProjection,
+                             const std::vector<Instance>& instances, Framebuffer& image, DepthBuffer& zbuffer,
+                             float lodPixelError, float pixelScale)
+{
+	// batch all model-view-projection matrices, so the vertex shader only does one matrix-vector product per vertex
+	// an instance places the whole model: the mesh keeps its place in the model (Mesh::transform)
+	FrameVector<glm::mat4> models(instances.size());
+	for (size_t i = 0; i < instances.size(); i++)
+		models[i] = instances[i].model * mesh.transform;
+	FrameVector<glm::mat4> mvps(instances.size());
+	multiplyMatrices(viewProjection, models.data(), mvps.data(), instances.size());
+
+	size_t drawn = 0;
+	for (size_t i = 0; i < instances.size(); i++)
+	{
+		if (!insideFrustum(mvps[i], mesh.aabbMin, mesh.aabbMax)
+			|| (Occlusion && !Occlusion->testBox(mvps[i], mesh.aabbMin, mesh.aabbMax)))
+		{
+			continue;
+		}
+		int lod = 0;
+		if (lodPixelError > 0.f && pixelScale > 0.f)
+		{
+			lod = selectLOD(mesh, mvps[i], maxScale(models[i]), pixelScale, lodPixelError);
+		}
+		shader.instance(mvps[i], models[i], instances[i].tint);
+		drawElements(mesh, shader, image, zbuffer, lod);
+		drawn++;
+	}
+	return drawn;
+}
+
+size_t drawElementsMultiView(const Mesh& mesh, size_t m, const glm::mat4& model, const ShaderPool& shaders,
+                             const std::vector<RenderView>& views, float lodPixelError, float pixelScale)
+{
+	// their counters belong to a single image (and the views are drawn in parallel)
+	assert(!Diagnostics && !VariableRate);
+
+	// views whose frustum contains the mesh, and the level of detail each one draws
+	FrameVector<uint32_t> visible;
+	FrameVector<int> lods;
+	visible.reserve(views.size());
+	lods.reserve(views.size());
+	for (size_t v = 0; v < views.size(); v++)
+	{
+		glm::mat4 mvp = views[v].viewProjection * model;
+		if (!insideFrustum(mvp, mesh.aabbMin, mesh.aabbMax))
+			continue;
+		visible.push_back(static_cast<uint32_t>(v));
+		int lod = 0;
+		if (lodPixelError > 0.f && pixelScale > 0.f)
+			lod = selectLOD(mesh, mvp, maxScale(model), pixelScale, lodPixelError);
+		lods.push_back(lod);
+	}
+	if (visible.empty())
+		return 0;
+
+	// world space pre-pass, once for all the views (on the calling thread, worker 0 of the loop below)
+	const size_t nVertices = mesh.vertexCount();
+	IShader& prepass = shaders.get(0, m);
+	prepass.instance(views[visible[0]].viewProjection * model, model, glm::vec4(1.f));
+	const int nVaryings = prepass.nVaryings;
+	FrameVector<WorldVertex> world(nVertices);
+	FrameVector<float> varyings(nVertices * nVaryings);
+	bool shared = true;
+	Vertex scratch;
+	for (size_t k = 0; k < nVertices && shared; k++)
+	{
+		shared = prepass.worldVertex(mesh.fetch(k, scratch), 0, world[k]);
+		std::copy(prepass.v_Varyings[0], prepass.v_Varyings[0] + nVaryings, varyings.data() + k * nVaryings);
+	}
+	// the clip space positions of every view (and its varyings when they depend on the camera), allocated here so
+	// that the workers do not allocate
+	FrameVector<glm::vec4> clip(nVertices * visible.size());
+	if (!shared)
+		varyings.resize(nVertices * nVaryings * visible.size());
+
+	parallelForWorkers(static_cast<uint32_t>(visible.size()), [&](uint32_t i, uint32_t worker)
+	{
+		const RenderView& view = views[visible[i]];
+		IShader& shader = shaders.get(worker, m);
+		shader.instance(view.viewProjection * model, model, glm::vec4(1.f));
+		glm::vec4* viewClip = clip.data() + i * nVertices;
+		const float* viewVaryings = varyings.data();
+		if (shared)
+		{
+			for (size_t k = 0; k < nVertices; k++)
+				viewClip[k] = view.viewProjection * glm::vec4(world[k].position, 1.f);
+		}
+		else
+		{
+			float* out = varyings.data() + i * nVertices * nVaryings;
+			Vertex decoded;
+			for (size_t k = 0; k < nVertices; k++)
+			{
+				shader.vertex(mesh.fetch(k, decoded), 0, viewClip[k]);
+				std::copy(shader.v_Varyings[0], shader.v_Varyings[0] + nVaryings, out + k * nVaryings);
+			}
+			viewVaryings = out;
+		}
+
+		const vector<unsigned int>& indices = mesh.lodIndices(lods[i]);
+		for (size_t t = 0; t + 2 < indices.size(); t += 3)
+		{
+			glm::vec4 homogeneousClipSpace[3];
+			for (int j = 0; j < 3; j++)
+			{
+				homogeneousClipSpace[j] = viewClip[indices[t + j]];
+				const float* out = viewVaryings + indices[t + j] * nVaryings;
+				std::copy(out, out + nVaryings, shader.v_Varyings[j]);
+			}
+			triangle(homogeneousClipSpace, shader, *view.image, *view.zbuffer);
+		}
+	});
+	return visible.size();
 }
@@ -1,31 +1,129 @@
 ﻿#pragma once
 #include <glm/glm.hpp>
 
+#include "DepthBuffer.h"
+#include "Diagnostics.h"
+#include "Framebuffer.h"
 #include "Mesh.h"
+#include "ShadingRate.h"
+#include "Simd.h"
 #include <tgaimage.h>
 #include <unordered_map>
 
+class OcclusionBuffer;
+class ShaderPool;
 
 // from world to camera space (equivalent to glm::lookAt)
+glm::mat4 viewMatrix(const glm::vec3& eye, const glm::vec3& center, const glm::vec3& tmp = glm::vec3(0.f, 1.f, 0.f));
+// sets View to viewMatrix(eye, center, tmp)
 void lookat(const glm::vec3& eye, const glm::vec3& center, const glm::vec3& tmp = glm::vec3(0.f, 1.f, 0.f));
 // from camera to homogeneous clip space (equivalent to glm::perspective) 
 void projection(const float& fovy, const float& aspect, const float& near, const float& far);
+// install (or remove with nullptr) the counters that triangle() fills for overdraw/depth complexity/tile time heatmaps
+void setDiagnostics(RasterDiagnostics* diag);
+// install (or remove with nullptr) the occlusion buffer drawElementsInstanced() tests the instances against
+void setOcclusion(OcclusionBuffer* occlusion);
+// install (or remove with nullptr) the heuristic and counters of variable rate shading (see ShadingRate.h)
+void setShadingRate(ShadingRate* rate);
+
+// maximum number of float varyings a shader can pass from the vertex to the fragment stage
+#define MAX_VARYINGS 16
+
+// input of the packet fragment shader: SIMD_WIDTH horizontally adjacent pixels of one triangle
+struct FragmentPacket
+{
+	// gl_FragCoord of each lane (see IShader::fragment)
+	vfloat fragCoord[4];
+	// the interpolated varyings of each lane
+	vfloat varyings[MAX_VARYINGS];
+	// lanes covered by the triangle that passed the depth test; the shader clears lanes to discard them
+	vfloat active;
+};
+
+// a vertex placed in world space by IShader::worldVertex() (see drawElementsMultiView)
+struct WorldVertex
+{
+	glm::vec3 position;
+	glm::vec3 normal;
+	glm::vec3 tangent;
+	glm::vec3 bitangent;
+};
+
+// the material of a fragment once its textures have been sampled, before any lighting (see IShader::surface)
+struct Surface
+{
+	TGAColor albedo;
+	// normalized, in the space of the light direction
+	glm::vec3 normal;
+	// specular exponent (8 bits, like the specular map it comes from)
+	std::uint8_t specular;
+};
 
 // IShader encapsulates tinyOpenGL System 
 struct IShader
 {
+	// number of floats of v_Varyings written by vertex(): the rasterizer only interpolates that many
+	int nVaryings = 0;
+	// all varying attributes are written by the vertex shader (one row per triangle vertex),
+	// the rasterizer interpolates them (perspective-correct) and hands them to the fragment shader
+	float v_Varyings[3][MAX_VARYINGS];
+
+	// variable rate shading of packet shaders (see ShadingRate.h): 0 lets the installed ShadingRate pick the rate of
+	// each tile (full rate without one), 1, 2 or 4 shades 1x1, 2x2 or 4x4 blocks of pixels for the whole draw
+	int shadingRate = 0;
+	// the texture coordinates the rate heuristic measures: varyings slot of u, v (-1: none, full rate) and the size
+	// in texels of the texture they address
+	int rateVarying = -1;
+	float rateTexels = 0.f;
+
 	virtual ~IShader();
-	virtual bool fragment(const glm::vec4& bar, TGAColor& gl_FragColor, float r0z, float r1z, float r2z) = 0;
+	// runs for each vertex of a triangle; nthVert (0, 1 or 2) tells which varyings slot to write
+	virtual void vertex(const Vertex& v, const int nthVert, glm::vec4& gl_Position) = 0;
+	// the part of vertex() that does not depend on the camera, for drawElementsMultiView(): writes the varyings slot
+	// nthVert like vertex() and the vertex in world space, which each view then only projects with its view-projection.
+	// Shaders whose varyings depend on the camera return false (the default): every view then runs vertex()
+	virtual bool worldVertex(const Vertex& v, const int nthVert, WorldVertex& out) { return false; }
+	// gl_FragCoord: pixel center (x, y), NDC depth (z) and 1/w (w)
+	// varyings: the nVaryings interpolated varyings of this fragment
+	// return true to discard the fragment
+	virtual bool fragment(const glm::vec4& gl_FragCoord, const float* varyings, TGAColor& gl_FragColor) = 0;
+
+	// shaders that implement fragmentPacket() return true: triangle() then shades SIMD_WIDTH pixels at a time
+	virtual bool packetShading() const { return false; }
+	// SPMD version of fragment(): one lane per pixel, gl_FragColor receives packed BGRA colors
+	virtual void fragmentPacket(FragmentPacket& packet, vint& gl_FragColor) {}
 
-	static TGAColor sample2D(const TGAImage& img, glm::vec2& uvf)
+	// deferred lighting (see GBuffer.h) splits fragment() in two:
+	// surface() samples the textures of a fragment (returns true to discard it, like fragment()),
+	// lighting() lights a surface. lighting() must not change the shader: the worker threads share it
+	virtual bool surface(const glm::vec4& gl_FragCoord, const float* varyings, Surface& out) { return true; }
+	virtual void lighting(const Surface& surface, TGAColor& gl_FragColor) const {}
+
+	// drawElementsInstanced() calls it before drawing each instance with its precomputed per-instance uniforms
+	virtual void instance(const glm::mat4& mvp, const glm::mat4& model, const glm::vec4& tint) {}
+
+	// write the varyings slot..slot+N of vertex nthVert
+	void varying(const int nthVert, const int slot, float v) { v_Varyings[nthVert][slot] = v; }
+
+	template <int N>
+	void varying(const int nthVert, const int slot, const glm::vec<N, float>& v)
+	{
+		for (int i = 0; i < N; i++)
+			v_Varyings[nthVert][slot + i] = v[i];
+	}
+
+	static TGAColor sample2D(const TGAImage& img, const glm::vec2& uvf)
 	{
 		return img.get(uvf[0] * img.width(), uvf[1] * img.height());
 	}
 
+	// packet version of sample2D: gathers the packed BGRA texels of the active lanes (0 for the others)
+	static vint sample2D(const TGAImage& img, const vfloat& u, const vfloat& v, const vfloat& active);
+
 	// textUnit: specifies the texture unit number
 	// uvf: specifies the texture coordinates
 	// return: the texel color for the coordinates
-	static TGAColor texture2D(unsigned textUnit, glm::vec2& uvf)
+	static TGAColor texture2D(unsigned textUnit, const glm::vec2& uvf)
 	{
 		const TGAImage& img = tinyOpenGLTextures[textUnit];
 		return img.get(uvf[0] * img.width(), uvf[1] * img.height());
@@ -34,8 +132,138 @@ struct IShader
 	static std::unordered_map<unsigned, TGAImage> tinyOpenGLTextures;
 };
 
+// screen space setup of a triangle: perspective divide, viewport transform, bounding box
+// and the plane equations of everything interpolated across it.
+// A plane p stores a quantity that is linear in raster space: value(x, y) = p.x * x + p.y * y + p.z,
+// so each pixel only evaluates (or steps) planes computed once per triangle.
+// It is shared by triangle() and the visibility buffer, which has to recompute the attributes
+// of a triangle after rasterization (see VisibilityBuffer.h)
+struct RasterTriangle
+{
+	// x, y are raster coordinates, z is the vertex NDC depth
+	glm::vec3 raster[3];
+	// bounding box clamped to the screen (inclusive)
+	uint32_t x0, x1, y0, y1;
+
+	// edge functions divided by the triangle area: they evaluate to the barycentric coordinates
+	glm::vec3 edge[3];
+	// NDC depth (linear in screen space)
+	glm::vec3 depthPlane;
+	// 1/w (linear in screen space), used to undo the perspective of the varyings
+	glm::vec3 oneOverWPlane;
+	// varying / w of each varying
+	int nVaryings;
+	glm::vec3 varyingPlanes[MAX_VARYINGS];
+
+	// returns false if the triangle is out of screen or back facing
+	// varyings: nVaryings floats per vertex (IShader::v_Varyings) to set up the plane equations for
+	// multisample: keep every pixel the triangle overlaps, not only the ones whose center it may cover
+	bool setup(const glm::vec4* hcp, uint32_t imageWidth, uint32_t imageHeight,
+	           const float (*varyings)[MAX_VARYINGS] = nullptr, int nVaryings = 0, bool multisample = false);
+
+	static float eval(const glm::vec3& plane, float x, float y)
+	{
+		return plane.x * x + plane.y * y + plane.z;
+	}
+
+	// is the pixel center of (x, y) covered by this triangle?
+	bool covers(uint32_t x, uint32_t y) const
+	{
+		float px = x + 0.5f, py = y + 0.5f;
+		return eval(edge[0], px, py) >= 0 && eval(edge[1], px, py) >= 0 && eval(edge[2], px, py) >= 0;
+	}
+
+	// gl_FragCoord at the center of pixel (x, y) (see IShader::fragment)
+	glm::vec4 fragCoord(uint32_t x, uint32_t y) const
+	{
+		float px = x + 0.5f, py = y + 0.5f;
+		return glm::vec4(px, py, eval(depthPlane, px, py), eval(oneOverWPlane, px, py));
+	}
+
+	// perspective-correct varyings for a fragment (gl_FragCoord.w holds its 1/w)
+	void interpolate(const glm::vec4& gl_FragCoord, float* out) const
+	{
+		float w = 1 / gl_FragCoord.w;
+		for (int i = 0; i < nVaryings; i++)
+			out[i] = eval(varyingPlanes[i], gl_FragCoord.x, gl_FragCoord.y) * w;
+	}
+};
+
+// per-instance data of drawElementsInstanced()
+struct Instance
+{
+	glm::mat4 model{1.f};
+	glm::vec4 tint{1.f};
+};
+
+// draws all triangles of the mesh (like gl.drawElements(gl.TRIANGLES, ...)): runs the vertex shader and calls triangle()
+// lod selects a simplified index buffer of the mesh (0: full detail, see Lod.h)
+void drawElements(const Mesh& mesh, IShader& shader, Framebuffer& image, DepthBuffer& zbuffer, int lod = 0);
+
+// the vertex stage of a drawElements() run ahead of its rasterization (see prepareElements): the clip space position
+// and varyings of every vertex of the mesh, and the triangles that survive culling. The buffers keep their capacity
+// from one frame to the next
+struct PreparedDraw
+{
+	const Mesh* mesh = nullptr;
+	int lod = 0;
+	int nVaryings = 0;
+	std::vector<glm::vec4> clip;
+	// nVaryings floats per vertex
+	std::vector<float> varyings;
+	// first index (in the index buffer of the level of detail) of each triangle kept
+	std::vector<uint32_t> triangles;
+};
+
+// runs the vertex shader on every vertex of the mesh and culls the triangles that cannot cover a pixel center of an
+// imageWidth x imageHeight image (back facing, outside the image or between pixel centers, the rejections of
+// RasterTriangle::setup). Only reads the mesh and writes the shader and out, so it can run on another thread while
+// other draws are rasterized, e.g. the vertex stage of the next frame of a sequence
+void prepareElements(const Mesh& mesh, IShader& shader, uint32_t imageWidth, uint32_t imageHeight, PreparedDraw& out,
+                     int lod = 0);
+// rasterizes a prepared draw with the shader it was prepared with: the same pixels as drawElements()
+void drawPrepared(const PreparedDraw& draw, IShader& shader, Framebuffer& image, DepthBuffer& zbuffer);
+
+// draws the mesh once per instance (like gl.drawElementsInstanced):
+// the model-view-projection matrices of all instances are computed up front (SSE), instances whose bounding box
+// is outside the view frustum or hidden by the occluders of the installed occlusion buffer (see setOcclusion) are skipped,
+// and the remaining ones are drawn in a single submission.
+// when lodPixelError > 0, each instance is drawn with the coarsest level of detail of the mesh whose error stays
+// under lodPixelError pixels (see selectLOD() in Lod.h); pixelScale is the lodPixelScale() of the projection of
+// viewProjection and the height of image.
+// returns the number of instances drawn
+size_t drawElementsInstanced(const Mesh& mesh, IShader& shader, const glm::mat4& viewProjection,
+                             const std::vector<Instance>& instances, Framebuffer& image, DepthBuffer& zbuffer,
+                             float lodPixelError = 0.f, float pixelScale = 0.f);
+
+// a camera of drawElementsMultiView() and its render targets
+struct RenderView
+{
+	glm::mat4 viewProjection{1.f};
+	Framebuffer* image = nullptr;
+	DepthBuffer* zbuffer = nullptr;
+};
+
+// draws the mesh (placed by model) into several views in a single submission (cube map faces, multi-angle shots):
+// - the mesh is culled against the view frustum of each view, and each view draws the level of detail selected like
+//   in drawElementsInstanced() (lodPixelError, pixelScale)
+// - a world space pre-pass runs IShader::worldVertex() once per vertex for all the views: the world space vertices and
+//   the varyings are shared, a view only multiplies the positions by its view-projection
+// - the views are rasterized in parallel (one view per worker), each worker with its shader of mesh m in shaders
+//   (see ShaderPool), set up with IShader::instance(viewProjection * model, model)
+// The diagnostics (see setDiagnostics) and the installed shading rate (see setShadingRate) count the pixels of a
+// single image: they must not be installed. Returns the number of views drawn
+size_t drawElementsMultiView(const Mesh& mesh, size_t m, const glm::mat4& model, const ShaderPool& shaders,
+                             const std::vector<RenderView>& views, float lodPixelError = 0.f, float pixelScale = 0.f);
+
+// is the box [aabbMin, aabbMax] transformed by mvp (at least partially) inside the view frustum?
+bool insideFrustum(const glm::mat4& mvp, const glm::vec3& aabbMin, const glm::vec3& aabbMax);
+
 // this function 
 // 1) covers the geometric shape assembly process (Primitive Assembly): note we only support gl.TRIANGLES 
 // 2) covers the rasterization process (Rasterizer): the geometric shape assembled in the geometric assembly process is converted into fragments  
 // 3) calls fragment shader
-void triangle(glm::vec4* hcp, IShader& shader, TGAImage& image, std::vector<float>& zbuffer);
+void triangle(glm::vec4* hcp, IShader& shader, Framebuffer& image, DepthBuffer& zbuffer);
+
+// depth-only version of triangle(): no shader and no color, only the depth test and write (shadow maps, depth pre-passes)
+void triangleDepth(const glm::vec4* hcp, DepthBuffer& zbuffer);